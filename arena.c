@@ -0,0 +1,206 @@
+/*  Bump allocator for parse-lifetime data.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+
+struct arena_block
+{
+  struct arena_block* next;
+  size_t size;
+};
+
+#define ALIGN(size) (((size) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+void*
+arena_alloc (struct arena* arena, size_t size)
+{
+  struct arena_block* block;
+  size_t block_size;
+  void* result;
+
+  size = ALIGN (size ? size : 1);
+
+  if (size > arena->end - arena->next)
+    {
+      /* Oversized requests get a block of their own, so that the rest of
+         the current block is not wasted */
+      block_size = ALIGN (sizeof (*block)) + (size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE);
+
+      if (!(block = malloc (block_size)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      block->size = block_size;
+      arena->reserved += block_size;
+
+      if (size > ARENA_BLOCK_SIZE / 4 && arena->blocks)
+        {
+          block->next = arena->blocks->next;
+          arena->blocks->next = block;
+          arena->used += size;
+          arena->last = 0;
+
+          return (char*) block + ALIGN (sizeof (*block));
+        }
+
+      block->next = arena->blocks;
+      arena->blocks = block;
+      arena->next = (char*) block + ALIGN (sizeof (*block));
+      arena->end = (char*) block + block_size;
+    }
+
+  result = arena->next;
+  arena->next += size;
+  arena->used += size;
+  arena->last = result;
+
+  return result;
+}
+
+/* Grows PTR, which was allocated from ARENA with OLD_SIZE bytes.  The
+   allocation is extended in place if it is the most recent one and there
+   is room, otherwise its contents are copied to a new allocation.  The
+   old memory is not reclaimed until the arena is reset.  */
+void*
+arena_realloc (struct arena* arena, void* ptr, size_t old_size, size_t new_size)
+{
+  void* result;
+
+  if (!ptr)
+    return arena_alloc (arena, new_size);
+
+  if (ptr == arena->last
+      && ALIGN (new_size) <= arena->end - (char*) ptr)
+    {
+      arena->used += ALIGN (new_size) - ALIGN (old_size);
+      arena->next = (char*) ptr + ALIGN (new_size);
+
+      return ptr;
+    }
+
+  result = arena_alloc (arena, new_size);
+  memcpy (result, ptr, old_size < new_size ? old_size : new_size);
+
+  return result;
+}
+
+char*
+arena_strdup (struct arena* arena, const char* string)
+{
+  size_t length = strlen (string) + 1;
+
+  return memcpy (arena_alloc (arena, length), string, length);
+}
+
+char*
+arena_printf (struct arena* arena, const char* format, ...)
+{
+  va_list args, args_copy;
+  char* result;
+  int length;
+
+  va_start (args, format);
+  va_copy (args_copy, args);
+
+  if (0 > (length = vsnprintf (0, 0, format, args)))
+    errx (EXIT_FAILURE, "Failed to format '%s': %s", format, strerror (errno));
+
+  result = arena_alloc (arena, length + 1);
+  vsnprintf (result, length + 1, format, args_copy);
+
+  va_end (args_copy);
+  va_end (args);
+
+  return result;
+}
+
+/* Moves all blocks of SOURCE to TARGET, leaving SOURCE empty.  Used to
+   keep memory allocated by worker threads alive after they exit.  */
+void
+arena_merge (struct arena* target, struct arena* source)
+{
+  struct arena_block* tail;
+
+  if (!source->blocks)
+    return;
+
+  for (tail = source->blocks; tail->next; tail = tail->next)
+    ;
+
+  /* Keep TARGET's current block at the head, so it can still be used */
+  if (target->blocks)
+    {
+      tail->next = target->blocks->next;
+      target->blocks->next = source->blocks;
+    }
+  else
+    {
+      tail->next = 0;
+      target->blocks = source->blocks;
+    }
+
+  target->used += source->used;
+  target->reserved += source->reserved;
+
+  memset (source, 0, sizeof (*source));
+}
+
+/* Releases everything but the current block, and starts reusing it */
+void
+arena_reset (struct arena* arena)
+{
+  struct arena_block* block;
+
+  if (!arena->blocks)
+    return;
+
+  while (0 != (block = arena->blocks->next))
+    {
+      arena->blocks->next = block->next;
+      free (block);
+    }
+
+  arena->next = (char*) arena->blocks + ALIGN (sizeof (*arena->blocks));
+  arena->end = (char*) arena->blocks + arena->blocks->size;
+  arena->last = 0;
+  arena->used = 0;
+  arena->reserved = arena->blocks->size;
+}
+
+void
+arena_free (struct arena* arena)
+{
+  struct arena_block* block;
+
+  while (0 != (block = arena->blocks))
+    {
+      arena->blocks = block->next;
+      free (block);
+    }
+
+  memset (arena, 0, sizeof (*arena));
+}
@@ -0,0 +1,46 @@
+#ifndef ARENA_H_
+#define ARENA_H_ 1
+
+#include <stdlib.h>
+
+struct arena_block;
+
+/* Bump allocator.  Memory is handed out from large blocks and only
+   released all at once, by arena_reset() or arena_free().  */
+struct arena
+{
+  struct arena_block* blocks;
+  char* next;
+  char* end;
+
+  /* The most recent allocation, which arena_realloc() can grow in place */
+  void* last;
+
+  /* Bytes handed out, and bytes obtained from malloc */
+  size_t used;
+  size_t reserved;
+};
+
+void*
+arena_alloc (struct arena* arena, size_t size);
+
+void*
+arena_realloc (struct arena* arena, void* ptr, size_t old_size, size_t new_size);
+
+char*
+arena_strdup (struct arena* arena, const char* string);
+
+char*
+arena_printf (struct arena* arena, const char* format, ...)
+  __attribute__((format (printf, 2, 3)));
+
+void
+arena_merge (struct arena* target, struct arena* source);
+
+void
+arena_reset (struct arena* arena);
+
+void
+arena_free (struct arena* arena);
+
+#endif /* !ARENA_H_ */
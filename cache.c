@@ -0,0 +1,745 @@
+/*  Binary cache of the parsed datafile.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "graph.h"
+#include "munin.h"
+
+/* Bump whenever the layout of the structures below, or what is cached
+   in them, changes */
+#define CACHE_FORMAT 6
+
+static const char cache_magic[8] = { 'M', 'H', 'G', 'C', 'A', 'C', 'H', 'E' };
+
+/* The cache file holds a header, followed by graph_count graph records,
+   curve_count curve records and string_size bytes of NUL-terminated
+   strings.  Strings are referred to by their offset in the string table,
+   with offset zero meaning a null pointer.  Equal strings are stored only
+   once.  Graphs are stored interned and sorted, with graph_order
+   already resolved;
+   alias targets are stored as a graph index plus one and a curve index
+   within that graph.  */
+struct cache_header
+{
+  char magic[8];
+  uint32_t format;
+  uint32_t version;
+
+  uint64_t datafile_size;
+  int64_t datafile_mtime;
+  int64_t datafile_mtime_nsec;
+  uint64_t datafile_checksum;
+
+  uint64_t graph_count;
+  uint64_t curve_count;
+  uint64_t string_size;
+
+  uint32_t tmpldir, htmldir, dbdir, rundir, logdir;
+  uint32_t reserved;
+
+  /* Checksum of everything following the header */
+  uint64_t checksum;
+};
+
+struct cache_graph
+{
+  double lower_limit, upper_limit;
+  uint64_t width, height;
+  uint64_t update_rate;
+  uint64_t first_curve, curve_count;
+  uint64_t domain_id, host_id, name_id;
+
+  uint32_t domain, host, name;
+  uint32_t rrd_prefix, png_prefix;
+  uint32_t name_png_path, name_rrd_path;
+  uint32_t title, category, info, order, period, total, vlabel;
+
+  int32_t noscale, nograph;
+  int32_t base, precision;
+  int32_t has_lower_limit, has_upper_limit, logarithmic;
+  uint32_t assigned;
+};
+
+struct cache_curve
+{
+  double max, min;
+  double warning, critical;
+  uint64_t order_rank;
+  uint64_t alias_graph, alias_curve;
+
+  uint32_t name;
+  uint32_t label, draw, type, info, cdef, negative;
+  uint32_t filename, ds;
+
+  int32_t nograph;
+  uint32_t color;
+  int32_t has_color, has_min, has_max;
+  uint32_t assigned;
+  int32_t alias_missing;
+};
+
+/* Mapping and curve array of the loaded cache, released by cache_close() */
+static void* cache_map;
+static size_t cache_map_size;
+static struct curve* cache_curves;
+
+static uint64_t
+file_checksum (const char* path, uint64_t size)
+{
+  void* data;
+  uint64_t result;
+  int fd;
+
+  if (-1 == (fd = open (path, O_RDONLY)))
+    return 0;
+
+  if (!size)
+    {
+      close (fd);
+
+      return cache_checksum ("", 0);
+    }
+
+  data = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return 0;
+
+  madvise (data, size, MADV_SEQUENTIAL);
+
+  result = cache_checksum (data, size);
+
+  munmap (data, size);
+
+  return result;
+}
+
+/* Returns the string at OFFSET in the string table, setting *DAMAGED if
+   the offset is out of range */
+static const char*
+cache_string (const struct cache_header* header, const char* strings,
+              uint32_t offset, int* damaged)
+{
+  if (offset >= header->string_size)
+    {
+      *damaged = 1;
+
+      return 0;
+    }
+
+  return offset ? strings + offset : 0;
+}
+
+/* Stores the modification time of the data file in the header of the
+   cache at PATH, whose contents were found to match it.  The header is
+   not covered by the cache checksum.  Failure only means the file is
+   read again on the next run.  */
+static void
+cache_set_mtime (const char* path, const struct stat* datafile_stat)
+{
+  int64_t mtime[2];
+  int fd;
+
+  if (-1 == (fd = open (path, O_WRONLY)))
+    return;
+
+  mtime[0] = datafile_stat->st_mtim.tv_sec;
+  mtime[1] = datafile_stat->st_mtim.tv_nsec;
+
+  if (sizeof (mtime) != pwrite (fd, mtime, sizeof (mtime),
+                                offsetof (struct cache_header, datafile_mtime))
+      && debug)
+    fprintf (stderr, "Failed to update cache '%s': %s\n", path, strerror (errno));
+
+  close (fd);
+}
+
+/* Returns 0 if the cache at PATH was made from the current contents of
+   DATAFILE, and replaces the graph table with the one in the cache.
+   Returns -1, leaving the graph table alone, if the cache is missing,
+   stale or damaged.  */
+int
+cache_load (const char* path, const char* datafile, const struct stat* datafile_stat)
+{
+  const struct cache_header* header;
+  const struct cache_graph* cgraphs;
+  const struct cache_curve* ccurves;
+  const char* strings;
+  struct graph* new_graphs = 0;
+  struct stat st;
+  const char* dirs[5];
+  size_t i;
+  void* map;
+  int fd, damaged = 0, refresh_mtime = 0;
+
+  if (-1 == (fd = open (path, O_RDONLY)))
+    {
+      if (debug && errno != ENOENT)
+        fprintf (stderr, "Failed to open cache '%s': %s\n", path, strerror (errno));
+
+      return -1;
+    }
+
+  if (-1 == fstat (fd, &st) || st.st_size < sizeof (*header))
+    {
+      close (fd);
+
+      return -1;
+    }
+
+  /* Writable, since struct graph wants the PNG and RRD path names as char*.
+     Nobody writes to them, so no pages are ever copied.  */
+  map = mmap (0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+  close (fd);
+
+  if (map == MAP_FAILED)
+    return -1;
+
+  header = map;
+
+  if (memcmp (header->magic, cache_magic, sizeof (cache_magic))
+      || header->format != CACHE_FORMAT
+      || header->datafile_size != datafile_stat->st_size
+      || header->graph_count > st.st_size / sizeof (*cgraphs)
+      || header->curve_count > st.st_size / sizeof (*ccurves)
+      || header->string_size > st.st_size
+      || st.st_size != sizeof (*header)
+                       + header->graph_count * sizeof (*cgraphs)
+                       + header->curve_count * sizeof (*ccurves)
+                       + header->string_size
+      || !header->string_size)
+    {
+      if (debug)
+        fprintf (stderr, "Cache '%s' does not match '%s'\n", path, datafile);
+
+      goto fail;
+    }
+
+  cgraphs = (const struct cache_graph*) (header + 1);
+  ccurves = (const struct cache_curve*) (cgraphs + header->graph_count);
+  strings = (const char*) (ccurves + header->curve_count);
+
+  if (strings[header->string_size - 1]
+      || header->checksum != cache_checksum (header + 1, st.st_size - sizeof (*header)))
+    {
+      if (debug)
+        fprintf (stderr, "Cache '%s' is damaged\n", path);
+
+      goto fail;
+    }
+
+  /* munin-update writes a new data file on every run, usually with the
+     same contents.  If the modification time is the one the cache was
+     made from, the file is trusted without reading it.  Otherwise its
+     checksum decides, and the cache is given the new time.  */
+  if (header->datafile_mtime != datafile_stat->st_mtim.tv_sec
+      || header->datafile_mtime_nsec != datafile_stat->st_mtim.tv_nsec)
+    {
+      if (header->datafile_checksum != file_checksum (datafile, header->datafile_size))
+        {
+          if (debug)
+            fprintf (stderr, "Cache '%s' does not match the contents of '%s'\n", path, datafile);
+
+          goto fail;
+        }
+
+      refresh_mtime = 1;
+    }
+
+  if (!(new_graphs = calloc (header->graph_count ? header->graph_count : 1, sizeof (*new_graphs)))
+      || !(cache_curves = calloc (header->curve_count ? header->curve_count : 1, sizeof (*cache_curves))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+#define string(offset) cache_string (header, strings, (offset), &damaged)
+
+  for (i = 0; i < header->curve_count; ++i)
+    {
+      const struct cache_curve* src = &ccurves[i];
+      struct curve* c = &cache_curves[i];
+
+      c->name = string (src->name);
+      c->label = string (src->label);
+      c->draw = string (src->draw);
+      c->type = string (src->type);
+      c->info = string (src->info);
+      c->cdef = string (src->cdef);
+      c->negative = string (src->negative);
+      c->filename = string (src->filename);
+      c->ds = string (src->ds);
+      c->nograph = src->nograph;
+      c->color = src->color;
+      c->has_color = src->has_color;
+      c->max = src->max;
+      c->min = src->min;
+      c->has_max = src->has_max;
+      c->has_min = src->has_min;
+      c->warning = src->warning;
+      c->critical = src->critical;
+      c->assigned = src->assigned;
+      c->order_rank = src->order_rank;
+      c->alias_missing = src->alias_missing;
+
+      if (src->alias_graph)
+        {
+          const struct cache_graph* alias_graph;
+
+          if (src->alias_graph > header->graph_count)
+            goto fail;
+
+          alias_graph = &cgraphs[src->alias_graph - 1];
+
+          if (src->alias_curve >= alias_graph->curve_count
+              || alias_graph->first_curve + src->alias_curve >= header->curve_count)
+            goto fail;
+
+          c->alias_graph = &new_graphs[src->alias_graph - 1];
+          c->alias = &cache_curves[alias_graph->first_curve + src->alias_curve];
+        }
+
+      if (!c->name)
+        goto fail;
+
+      c->basename = strrchr (c->name, '.');
+      c->basename = c->basename ? c->basename + 1 : c->name;
+    }
+
+  for (i = 0; i < header->graph_count; ++i)
+    {
+      const struct cache_graph* src = &cgraphs[i];
+      struct graph* g = &new_graphs[i];
+
+      if (src->first_curve > header->curve_count
+          || src->curve_count > header->curve_count - src->first_curve)
+        goto fail;
+
+      g->domain = string (src->domain);
+      g->host = string (src->host);
+      g->name = string (src->name);
+      g->domain_id = src->domain_id;
+      g->host_id = src->host_id;
+      g->name_id = src->name_id;
+      g->rrd_prefix = string (src->rrd_prefix);
+      g->png_prefix = string (src->png_prefix);
+      g->name_png_path = (char*) string (src->name_png_path);
+      g->name_rrd_path = (char*) string (src->name_rrd_path);
+      g->title = string (src->title);
+      g->category = string (src->category);
+      g->info = string (src->info);
+      g->order = string (src->order);
+      g->period = string (src->period);
+      g->noscale = src->noscale;
+      g->total = string (src->total);
+      g->vlabel = string (src->vlabel);
+      g->nograph = src->nograph;
+      g->base = src->base;
+      g->precision = src->precision;
+      g->has_lower_limit = src->has_lower_limit;
+      g->lower_limit = src->lower_limit;
+      g->has_upper_limit = src->has_upper_limit;
+      g->upper_limit = src->upper_limit;
+      g->logarithmic = src->logarithmic;
+      g->width = src->width;
+      g->height = src->height;
+      g->update_rate = src->update_rate;
+      g->assigned = src->assigned;
+
+      /* All curve arrays share one allocation, so they must not grow */
+      g->curves = cache_curves + src->first_curve;
+      g->curve_count = g->curve_alloc = src->curve_count;
+
+      /* The curve hash tables are not stored.  Aliases and graph_order
+         are already resolved, so these tables are only searched again by
+         find_curve() and curve_index(), which build them on first use,
+         and process_graph() builds its own for the curves it draws.  */
+      g->curve_hash = 0;
+      g->curve_hash_size = 0;
+      g->curve_hash_count = 0;
+
+      if (!g->domain || !g->host || !g->name || !g->name_png_path || !g->name_rrd_path
+          || !g->rrd_prefix || !g->png_prefix)
+        goto fail;
+    }
+
+  dirs[0] = string (header->tmpldir);
+  dirs[1] = string (header->htmldir);
+  dirs[2] = string (header->dbdir);
+  dirs[3] = string (header->rundir);
+  dirs[4] = string (header->logdir);
+
+#undef string
+
+  for (i = 0; i < 5; ++i)
+    {
+      if (!dirs[i])
+        goto fail;
+    }
+
+  if (damaged)
+    goto fail;
+
+  cur_version = header->version;
+  tmpldir = dirs[0];
+  htmldir = dirs[1];
+  dbdir = dirs[2];
+  rundir = dirs[3];
+  logdir = dirs[4];
+
+  free (graphs);
+  graphs = new_graphs;
+  graph_count = graph_alloc = header->graph_count;
+
+  cache_map = map;
+  cache_map_size = st.st_size;
+
+  if (refresh_mtime)
+    cache_set_mtime (path, datafile_stat);
+
+  return 0;
+
+fail:
+
+  if (debug)
+    fprintf (stderr, "Ignoring cache '%s'\n", path);
+
+  free (new_graphs);
+  free (cache_curves);
+  cache_curves = 0;
+
+  munmap (map, st.st_size);
+
+  return -1;
+}
+
+/* Open addressing hash table used to store each string only once */
+struct string_table
+{
+  char* data;
+  size_t size, alloc;
+
+  /* Set when the table would exceed the 4 GB addressable by offsets */
+  int overflow;
+
+  uint32_t* hash;
+  size_t hash_size, hash_count;
+};
+
+static size_t
+string_hash (const char* string)
+{
+  size_t hash = 0xcbf29ce484222325ULL;
+
+  while (*string)
+    hash = (hash ^ (unsigned char) *string++) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+static void
+string_table_grow (struct string_table* table)
+{
+  size_t i, slot, mask;
+  uint32_t* old_hash = table->hash;
+  size_t old_size = table->hash_size;
+
+  table->hash_size = old_size ? old_size * 2 : 4096;
+  mask = table->hash_size - 1;
+
+  if (!(table->hash = calloc (table->hash_size, sizeof (*table->hash))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < old_size; ++i)
+    {
+      if (!old_hash[i])
+        continue;
+
+      for (slot = string_hash (table->data + old_hash[i]) & mask; table->hash[slot]; slot = (slot + 1) & mask)
+        ;
+
+      table->hash[slot] = old_hash[i];
+    }
+
+  free (old_hash);
+}
+
+/* Returns the offset of STRING in TABLE, adding it if necessary */
+static uint32_t
+string_table_add (struct string_table* table, const char* string)
+{
+  size_t slot, mask, length;
+  uint32_t offset;
+
+  if (!string)
+    return 0;
+
+  if (table->hash_count * 2 >= table->hash_size)
+    string_table_grow (table);
+
+  mask = table->hash_size - 1;
+
+  for (slot = string_hash (string) & mask; table->hash[slot]; slot = (slot + 1) & mask)
+    {
+      if (!strcmp (table->data + table->hash[slot], string))
+        return table->hash[slot];
+    }
+
+  length = strlen (string) + 1;
+
+  if (table->size + length > UINT32_MAX)
+    {
+      table->overflow = 1;
+
+      return 0;
+    }
+
+  if (table->size + length > table->alloc)
+    {
+      table->alloc = (table->size + length) * 3 / 2 + 65536;
+
+      if (!(table->data = realloc (table->data, table->alloc)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+    }
+
+  offset = table->size;
+  memcpy (table->data + offset, string, length);
+  table->size += length;
+
+  table->hash[slot] = offset;
+  ++table->hash_count;
+
+  return offset;
+}
+
+/* Writes the current graph table to PATH.  The file is written under a
+   temporary name and then renamed, so that a concurrent or interrupted
+   run never sees a partial cache.  Returns 0 on success, -1 on failure.  */
+int
+cache_write (const char* path, const struct stat* datafile_stat, uint64_t datafile_checksum)
+{
+  struct cache_header header;
+  struct cache_graph* cgraphs;
+  struct cache_curve* ccurves;
+  struct string_table strings;
+  size_t i, j, curve_count = 0, payload_size;
+  char* payload = 0;
+  char* tmp_path;
+  FILE* f;
+  int result = -1;
+
+  for (i = 0; i < graph_count; ++i)
+    curve_count += graphs[i].curve_count;
+
+  memset (&header, 0, sizeof (header));
+  memset (&strings, 0, sizeof (strings));
+
+  if (!(cgraphs = calloc (graph_count ? graph_count : 1, sizeof (*cgraphs)))
+      || !(ccurves = calloc (curve_count ? curve_count : 1, sizeof (*ccurves))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  /* Reserve offset zero for null pointers */
+  strings.size = strings.alloc = 1;
+
+  if (!(strings.data = calloc (1, 1)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+#define string(value) string_table_add (&strings, (value))
+
+  for (i = 0, curve_count = 0; i < graph_count; ++i)
+    {
+      const struct graph* g = &graphs[i];
+      struct cache_graph* dst = &cgraphs[i];
+
+      dst->domain = string (g->domain);
+      dst->host = string (g->host);
+      dst->name = string (g->name);
+      dst->domain_id = g->domain_id;
+      dst->host_id = g->host_id;
+      dst->name_id = g->name_id;
+      dst->rrd_prefix = string (g->rrd_prefix);
+      dst->png_prefix = string (g->png_prefix);
+      dst->name_png_path = string (g->name_png_path);
+      dst->name_rrd_path = string (g->name_rrd_path);
+      dst->title = string (g->title);
+      dst->category = string (g->category);
+      dst->info = string (g->info);
+      dst->order = string (g->order);
+      dst->period = string (g->period);
+      dst->noscale = g->noscale;
+      dst->total = string (g->total);
+      dst->vlabel = string (g->vlabel);
+      dst->nograph = g->nograph;
+      dst->base = g->base;
+      dst->precision = g->precision;
+      dst->has_lower_limit = g->has_lower_limit;
+      dst->lower_limit = g->lower_limit;
+      dst->has_upper_limit = g->has_upper_limit;
+      dst->upper_limit = g->upper_limit;
+      dst->logarithmic = g->logarithmic;
+      dst->width = g->width;
+      dst->height = g->height;
+      dst->update_rate = g->update_rate;
+      dst->assigned = g->assigned;
+      dst->first_curve = curve_count;
+      dst->curve_count = g->curve_count;
+
+      for (j = 0; j < g->curve_count; ++j)
+        {
+          const struct curve* c = &g->curves[j];
+          struct cache_curve* cdst = &ccurves[curve_count++];
+
+          cdst->name = string (c->name);
+          cdst->label = string (c->label);
+          cdst->draw = string (c->draw);
+          cdst->type = string (c->type);
+          cdst->info = string (c->info);
+          cdst->cdef = string (c->cdef);
+          cdst->negative = string (c->negative);
+          cdst->filename = string (c->filename);
+          cdst->ds = string (c->ds);
+          cdst->nograph = c->nograph;
+          cdst->color = c->color;
+          cdst->has_color = c->has_color;
+          cdst->max = c->max;
+          cdst->min = c->min;
+          cdst->has_max = c->has_max;
+          cdst->has_min = c->has_min;
+          cdst->warning = c->warning;
+          cdst->critical = c->critical;
+          cdst->assigned = c->assigned;
+          cdst->order_rank = c->order_rank;
+          cdst->alias_missing = c->alias_missing;
+
+          if (c->alias)
+            {
+              cdst->alias_graph = c->alias_graph - graphs + 1;
+              cdst->alias_curve = c->alias - c->alias_graph->curves;
+            }
+        }
+    }
+
+  memcpy (header.magic, cache_magic, sizeof (cache_magic));
+  header.format = CACHE_FORMAT;
+  header.version = cur_version;
+  header.datafile_size = datafile_stat->st_size;
+  header.datafile_mtime = datafile_stat->st_mtim.tv_sec;
+  header.datafile_mtime_nsec = datafile_stat->st_mtim.tv_nsec;
+  header.datafile_checksum = datafile_checksum;
+  header.graph_count = graph_count;
+  header.curve_count = curve_count;
+  header.tmpldir = string (tmpldir);
+  header.htmldir = string (htmldir);
+  header.dbdir = string (dbdir);
+  header.rundir = string (rundir);
+  header.logdir = string (logdir);
+  header.string_size = strings.size;
+
+#undef string
+
+  if (strings.overflow)
+    {
+      if (debug)
+        fprintf (stderr, "Too much text to cache in '%s'\n", path);
+
+      goto done;
+    }
+
+  /* Lay out the payload exactly as cache_load() will see it */
+  payload_size = graph_count * sizeof (*cgraphs) + curve_count * sizeof (*ccurves) + strings.size;
+
+  if (!(payload = malloc (payload_size)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  memcpy (payload, cgraphs, graph_count * sizeof (*cgraphs));
+  memcpy (payload + graph_count * sizeof (*cgraphs), ccurves, curve_count * sizeof (*ccurves));
+  memcpy (payload + payload_size - strings.size, strings.data, strings.size);
+
+  header.checksum = cache_checksum (payload, payload_size);
+
+  if (-1 == asprintf (&tmp_path, "%s.%d", path, (int) getpid ()))
+    errx (EXIT_FAILURE, "asprintf failed: %s", strerror (errno));
+
+  if (!(f = fopen (tmp_path, "w")))
+    {
+      if (debug)
+        fprintf (stderr, "Failed to open '%s' for writing: %s\n", tmp_path, strerror (errno));
+
+      free (tmp_path);
+
+      goto done;
+    }
+
+  if (1 == fwrite (&header, sizeof (header), 1, f)
+      && payload_size == fwrite (payload, 1, payload_size, f))
+    result = 0;
+
+  if (fclose (f))
+    result = -1;
+
+  if (result == -1)
+    {
+      if (debug)
+        fprintf (stderr, "Failed to write '%s': %s\n", tmp_path, strerror (errno));
+
+      unlink (tmp_path);
+    }
+  else if (-1 == rename (tmp_path, path))
+    {
+      if (debug)
+        fprintf (stderr, "Failed to rename '%s' to '%s': %s\n", tmp_path, path, strerror (errno));
+
+      result = -1;
+      unlink (tmp_path);
+    }
+
+  free (tmp_path);
+
+done:
+
+  free (payload);
+  free (strings.data);
+  free (strings.hash);
+  free (ccurves);
+  free (cgraphs);
+
+  return result;
+}
+
+void
+cache_close ()
+{
+  if (cache_map)
+    munmap (cache_map, cache_map_size);
+
+  free (cache_curves);
+
+  cache_map = 0;
+  cache_curves = 0;
+}
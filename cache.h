@@ -0,0 +1,19 @@
+#ifndef CACHE_H_
+#define CACHE_H_ 1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+int
+cache_load (const char* path, const char* datafile, const struct stat* datafile_stat);
+
+int
+cache_write (const char* path, const struct stat* datafile_stat, uint64_t datafile_checksum);
+
+void
+cache_close ();
+
+#endif /* !CACHE_H_ */
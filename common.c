@@ -0,0 +1,51 @@
+/*  Globals and helpers shared by all programs.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+int debug = 0;
+
+uint64_t
+cache_checksum (const void* data, size_t size)
+{
+  const unsigned char* in = data;
+  uint64_t a = 0x9e3779b97f4a7c15ULL ^ size, b = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t word[2];
+
+  /* Two independent lanes, so that the multiplications can overlap */
+  for (; size >= sizeof (word); in += sizeof (word), size -= sizeof (word))
+    {
+      memcpy (word, in, sizeof (word));
+
+      a = (a ^ word[0]) * 0x100000001b3ULL;
+      b = (b ^ word[1]) * 0x9e3779b97f4a7c15ULL;
+      a ^= a >> 29;
+      b ^= b >> 31;
+    }
+
+  while (size--)
+    a = (a ^ *in++) * 0x100000001b3ULL;
+
+  a ^= b * 0xc2b2ae3d27d4eb4fULL;
+  a ^= a >> 33;
+  a *= 0xff51afd7ed558ccdULL;
+  a ^= a >> 33;
+
+  return a;
+}
@@ -0,0 +1,16 @@
+#ifndef COMMON_H_
+#define COMMON_H_ 1
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* State and helpers shared by the graph and update programs.  They are
+   kept apart from graph.c, so that munin-hardcore-update does not link
+   in the drawing code and its libraries.  */
+
+extern int debug;
+
+uint64_t
+cache_checksum (const void* data, size_t size);
+
+#endif /* !COMMON_H_ */
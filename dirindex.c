@@ -0,0 +1,259 @@
+/*  Listings of the directories holding RRD files.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dirindex.h"
+
+/* Graphs name many fields that were never recorded, and every attempt
+   to open one of their files costs a failed path lookup.  Instead, each
+   directory is listed once with getdents64, and files missing from the
+   listing are refused without a system call.  Files that exist are
+   opened relative to the directory.  Files created after the listing
+   was made are not seen until the next run.
+
+   Graphs are drawn domain by domain, so one directory is in use at a
+   time, but the prefetcher may already be reading the next one, and
+   graph_order may refer to graphs of other domains.  */
+#define LISTING_COUNT 4
+
+struct dir_listing
+{
+  char* path;
+  size_t path_length;
+
+  /* -1 if the directory could not be listed; files in it are then
+     opened by path */
+  int fd;
+
+  /* The getdents64 records, and an open addressing table of pointers to
+     the names in them */
+  char* records;
+  const char** hash;
+  size_t hash_size;
+
+  size_t last_use;
+};
+
+/* Layout of the records returned by getdents64 */
+struct dirent64_record
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+size_t dir_index_scans, dir_index_missing;
+
+static struct dir_listing listings[LISTING_COUNT];
+static size_t use_count;
+
+static size_t
+dir_index_hash (const char* string)
+{
+  size_t hash = 0xcbf29ce484222325ULL;
+
+  while (*string)
+    hash = (hash ^ (unsigned char) *string++) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+static void
+listing_free (struct dir_listing* listing)
+{
+  if (listing->fd != -1)
+    close (listing->fd);
+
+  free (listing->path);
+  free (listing->records);
+  free (listing->hash);
+
+  memset (listing, 0, sizeof (*listing));
+  listing->fd = -1;
+}
+
+/* Reads the listing of the directory LISTING->PATH.  On failure, the
+   listing is left with FD set to -1.  */
+static void
+listing_read (struct dir_listing* listing)
+{
+#ifdef SYS_getdents64
+  size_t size = 0, alloc = 0, offset, count = 0, slot;
+  long ret;
+
+  ++dir_index_scans;
+
+  if (-1 == (listing->fd = open (listing->path, O_RDONLY | O_DIRECTORY)))
+    return;
+
+  for (;;)
+    {
+      if (alloc - size < 32768)
+        {
+          alloc = alloc * 3 / 2 + 65536;
+
+          if (!(listing->records = realloc (listing->records, alloc)))
+            errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+        }
+
+      if (-1 == (ret = syscall (SYS_getdents64, listing->fd, listing->records + size, alloc - size)))
+        {
+          close (listing->fd);
+          listing->fd = -1;
+
+          return;
+        }
+
+      if (!ret)
+        break;
+
+      size += ret;
+    }
+
+  for (offset = 0; offset < size; offset += ((struct dirent64_record*) (listing->records + offset))->d_reclen)
+    ++count;
+
+  for (listing->hash_size = 16; listing->hash_size < count * 2; listing->hash_size *= 2)
+    ;
+
+  if (!(listing->hash = calloc (listing->hash_size, sizeof (*listing->hash))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (offset = 0; offset < size; offset += ((struct dirent64_record*) (listing->records + offset))->d_reclen)
+    {
+      const char* name = ((struct dirent64_record*) (listing->records + offset))->d_name;
+
+      for (slot = dir_index_hash (name) & (listing->hash_size - 1); listing->hash[slot];
+           slot = (slot + 1) & (listing->hash_size - 1))
+        ;
+
+      listing->hash[slot] = name;
+    }
+#endif
+}
+
+/* Returns the listing of the directory of the first PATH_LENGTH bytes
+   of PATH, reading it if no listing of it is kept */
+static struct dir_listing*
+listing_get (const char* path, size_t path_length)
+{
+  struct dir_listing* result = &listings[0];
+  size_t i;
+
+  for (i = 0; i < LISTING_COUNT; ++i)
+    {
+      if (listings[i].path
+          && listings[i].path_length == path_length
+          && !memcmp (listings[i].path, path, path_length))
+        {
+          listings[i].last_use = ++use_count;
+
+          return &listings[i];
+        }
+
+      if (!listings[i].path)
+        {
+          result = &listings[i];
+
+          break;
+        }
+
+      if (listings[i].last_use < result->last_use)
+        result = &listings[i];
+    }
+
+  if (result->path)
+    listing_free (result);
+
+  if (!(result->path = strndup (path, path_length)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  result->path_length = path_length;
+  result->fd = -1;
+  result->last_use = ++use_count;
+
+  listing_read (result);
+
+  return result;
+}
+
+/* Opens PATH for reading, like open().  If the listing of its directory
+   does not have it, returns -1 and sets errno to ENOENT.
+
+   The listing holds names only.  It saves the failed lookups of absent
+   files, but opening a listed file, and any fstat() of it, still costs a
+   system call each, and a file deleted after the listing was made is
+   still taken to be present until openat() fails.  That failure is
+   counted and reported like a file missing from the listing.  */
+int
+dir_index_open (const char* path)
+{
+  struct dir_listing* listing;
+  const char* name;
+  size_t slot;
+
+  if (!(name = strrchr (path, '/')) || name == path)
+    return open (path, O_RDONLY);
+
+  listing = listing_get (path, name - path);
+  ++name;
+
+  if (listing->fd == -1)
+    return open (path, O_RDONLY);
+
+  for (slot = dir_index_hash (name) & (listing->hash_size - 1); listing->hash[slot];
+       slot = (slot + 1) & (listing->hash_size - 1))
+    {
+      if (!strcmp (listing->hash[slot], name))
+        {
+          int fd;
+
+          if (-1 == (fd = openat (listing->fd, name, O_RDONLY)) && errno == ENOENT)
+            ++dir_index_missing;
+
+          return fd;
+        }
+    }
+
+  ++dir_index_missing;
+  errno = ENOENT;
+
+  return -1;
+}
+
+/* Forgets all listings, closing their directories */
+void
+dir_index_reset ()
+{
+  size_t i;
+
+  for (i = 0; i < LISTING_COUNT; ++i)
+    {
+      if (listings[i].path)
+        listing_free (&listings[i]);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef DIRINDEX_H_
+#define DIRINDEX_H_ 1
+
+#include <stdlib.h>
+
+/* Directories listed, and opens of files that the listing did not
+   have, or that were deleted after it was made */
+extern size_t dir_index_scans, dir_index_missing;
+
+int
+dir_index_open (const char* path);
+
+void
+dir_index_reset ();
+
+#endif /* !DIRINDEX_H_ */
@@ -4,13 +4,445 @@
 #include <string.h>
 
 #include <err.h>
+#include <png.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "font.h"
 #include "graph.h"
 #include "munin.h"
 
+/* Parses a small datafile with two domains and checks the interned name
+   IDs, the per-host path prefixes and the graph_order aliases built from
+   them */
+static void
+check_interning ()
+{
+  static const char datafile[] =
+    "dbdir /srv/munin\n"
+    "b.example;web.b.example:load.graph_title Load\n"
+    "b.example;web.b.example:load.load.label load\n"
+    "a.example;web.a.example:load.graph_title Load\n"
+    "a.example;web.a.example:load.load.label load\n"
+    "a.example;db.a.example:memory.graph_title Memory\n"
+    "a.example;db.a.example:memory.free.label free\n"
+    "a.example;db.a.example:memory.free.type DERIVE\n"
+    "a.example;db.a.example:load.graph_title Load\n"
+    "a.example;db.a.example:load.graph_order l=memory;free missing=memory;none\n"
+    "a.example;db.a.example:load.l.label alias\n"
+    "a.example;db.a.example:load.missing.label missing\n";
+  static const char* expected[][3] =
+    {
+      { "a.example", "db.a.example", "load" },
+      { "a.example", "web.a.example", "load" },
+      { "a.example", "db.a.example", "memory" },
+      { "b.example", "web.b.example", "load" }
+    };
+  enum version saved_version = cur_version;
+  const char* saved_dbdir = dbdir;
+  struct arena arena;
+  char* buffer;
+  char* path;
+  size_t i;
+
+  memset (&arena, 0, sizeof (arena));
+
+  if (!(buffer = strdup (datafile)))
+    err (EX_OSERR, "strdup failed");
+
+  cur_version = ver_1_4;
+  parse_datafile (buffer, buffer + strlen (buffer), "interning");
+
+  intern_graphs ();
+  sort_graphs ();
+  graph_index_rebuild ();
+
+  for (i = 0; i < graph_count; ++i)
+    resolve_graph_order (&graphs[i]);
+
+  if (graph_count != sizeof (expected) / sizeof (expected[0]))
+    errx (EXIT_FAILURE, "Expected %zu graphs, found %zu",
+          sizeof (expected) / sizeof (expected[0]), graph_count);
+
+  for (i = 0; i < graph_count; ++i)
+    {
+      const struct graph* g = &graphs[i];
+
+      if (strcmp (g->domain, expected[i][0]) || strcmp (g->host, expected[i][1])
+          || strcmp (g->name, expected[i][2]))
+        errx (EXIT_FAILURE, "Graph %zu is %s/%s/%s, expected %s/%s/%s", i,
+              g->domain, g->host, g->name, expected[i][0], expected[i][1], expected[i][2]);
+
+      if (find_graph_id (g->domain_id, g->host_id, g->name_id) != i)
+        errx (EXIT_FAILURE, "find_graph_id() does not find graph %zu", i);
+    }
+
+  /* Names order like their IDs, and hosts share one prefix */
+  if (graphs[0].domain_id >= graphs[3].domain_id
+      || graphs[0].host_id >= graphs[1].host_id
+      || graphs[0].name_id >= graphs[2].name_id)
+    errx (EXIT_FAILURE, "Name IDs do not follow strcmp() order");
+
+  if (graphs[0].rrd_prefix != graphs[2].rrd_prefix
+      || strcmp (graphs[0].rrd_prefix, "/srv/munin/a.example/db.a.example-")
+      || strcmp (graphs[1].rrd_prefix, "/srv/munin/a.example/web.a.example-"))
+    errx (EXIT_FAILURE, "Unexpected RRD prefix '%s'", graphs[0].rrd_prefix);
+
+  if (!graphs[0].curves[0].alias || graphs[0].curves[0].alias_graph != &graphs[2]
+      || graphs[0].curves[0].alias != &graphs[2].curves[0])
+    errx (EXIT_FAILURE, "Alias 'l=memory;free' was not resolved");
+
+  if (!graphs[0].curves[1].alias_missing)
+    errx (EXIT_FAILURE, "Alias 'missing=memory;none' was resolved");
+
+  path = curve_rrd_path (&graphs[0], &graphs[0].curves[0], &arena);
+
+  if (strcmp (path, "/srv/munin/a.example/db.a.example-memory-free-d.rrd"))
+    errx (EXIT_FAILURE, "Unexpected RRD path '%s'", path);
+
+  arena_free (&arena);
+
+  for (i = 0; i < graph_count; ++i)
+    free (graphs[i].curve_hash);
+
+  free (graphs);
+  graphs = 0;
+  graph_count = graph_alloc = 0;
+  free (buffer);
+
+  cur_version = saved_version;
+  dbdir = saved_dbdir;
+}
+
+/* A graph whose lines are split between two parser threads is merged as
+   if one thread had parsed it */
+static void
+check_chunk_merge ()
+{
+  static const char first[] = "a.example;h.a.example:load.graph_title Load\n";
+  static const char filler[] = "a.example;h.a.example:filler.graph_title Filler\n";
+  static const char last[] = "a.example;h.a.example:load.update_rate 86400\n";
+  enum version saved_version = cur_version;
+  int saved_thread_count = parse_thread_count;
+  size_t i, filler_count, size;
+  ssize_t load;
+  char* buffer;
+  char* o;
+
+  /* Enough to give two threads more than 4 MB each */
+  filler_count = (9 << 20) / (sizeof (filler) - 1);
+  size = sizeof (first) - 1 + filler_count * (sizeof (filler) - 1) + sizeof (last) - 1;
+
+  if (!(buffer = malloc (size)))
+    err (EX_OSERR, "malloc failed");
+
+  o = buffer;
+  memcpy (o, first, sizeof (first) - 1);
+  o += sizeof (first) - 1;
+
+  for (i = 0; i < filler_count; ++i, o += sizeof (filler) - 1)
+    memcpy (o, filler, sizeof (filler) - 1);
+
+  memcpy (o, last, sizeof (last) - 1);
+
+  cur_version = ver_1_4;
+  parse_thread_count = 2;
+  parse_datafile (buffer, buffer + size, "chunk merge");
+
+  if (parse_chunk_count != 2)
+    errx (EXIT_FAILURE, "Expected 2 parse chunks, got %zu", parse_chunk_count);
+
+  if (-1 == (load = find_graph ("a.example", "h.a.example", "load", 0)))
+    errx (EXIT_FAILURE, "Graph 'load' was not parsed");
+
+  if (graphs[load].update_rate != 86400 || strcmp (graphs[load].title, "Load"))
+    errx (EXIT_FAILURE, "Graph 'load' lost settings when chunks were merged");
+
+  for (i = 0; i < graph_count; ++i)
+    free (graphs[i].curve_hash);
+
+  free (graphs);
+  graphs = 0;
+  graph_count = graph_alloc = 0;
+  free (buffer);
+
+  cur_version = saved_version;
+  parse_thread_count = saved_thread_count;
+}
+
+/* Checks value_rows() against EXPECTED, for a plot 101 pixels high
+   spanning GLOBAL_MIN to GLOBAL_MAX */
+static void
+check_rows (const char* what, const double* values, const int16_t* expected,
+            size_t count, int negate, double global_min, double global_max)
+{
+  int16_t rows[16];
+  size_t i;
+
+  value_rows (values, count, negate, global_min, global_max, 101, rows);
+
+  for (i = 0; i < count; ++i)
+    {
+      if (rows[i] != expected[i])
+        errx (EXIT_FAILURE, "%s: row %zu is %d, expected %d", what, i, rows[i], expected[i]);
+    }
+}
+
+/* Values far off the plot are clamped to the int16_t range, instead of
+   wrapping around onto the canvas.  The counts are odd, so that the last
+   value goes through the scalar code.  */
+static void
+check_value_rows ()
+{
+  static const double values[11] =
+    {
+      50, 1e9, -1e9, NAN, 0, 100, INFINITY, -INFINITY, 32867, -32666.5, 1e9
+    };
+  static const int16_t rows[11] =
+    {
+      50, -32767, 32767, ROW_UNKNOWN, 100, 0, -32767, 32767, -32767, 32766, -32767
+    };
+  static const double negated[5] = { -50, -1e9, 1e9, NAN, 1e9 };
+  static const int16_t negated_rows[5] = { 50, -32767, 32767, ROW_UNKNOWN, 32767 };
+  static const double flat[3] = { 5, 5, 5 };
+  static const int16_t flat_rows[3] = { -32767, -32767, -32767 };
+
+  check_rows ("values", values, rows, 11, 0, 0, 100);
+  check_rows ("negated values", negated, negated_rows, 5, 1, 0, 100);
+
+  /* An empty span puts the rows off the canvas */
+  check_rows ("empty span", flat, flat_rows, 3, 0, 5, 5);
+}
+
+/* The hour graph spans an hour whatever the update rate, and is only
+   drawn for graphs updated more often than every five minutes */
+static void
+check_periods ()
+{
+  static const size_t update_rates[] = { 0, 10, 60, 299, 300 };
+  static const size_t widths[] = { 400, 497 };
+  size_t i, j, interval;
+
+  for (i = 0; i < sizeof (update_rates) / sizeof (update_rates[0]); ++i)
+    for (j = 0; j < sizeof (widths) / sizeof (widths[0]); ++j)
+      {
+        interval = period_interval (0, update_rates[i], widths[j]);
+
+        if (!update_rates[i] || update_rates[i] >= 300)
+          {
+            if (interval)
+              errx (EXIT_FAILURE, "Hour graph drawn for update rate %zu", update_rates[i]);
+
+            continue;
+          }
+
+        if (interval * widths[j] > 3600 || (interval + 1) * widths[j] <= 3600)
+          errx (EXIT_FAILURE, "Hour graph %zu wide, updated every %zu seconds, spans %zu seconds",
+                widths[j], update_rates[i], interval * widths[j]);
+      }
+
+  if (period_interval (1, 10, 400) != 300)
+    errx (EXIT_FAILURE, "Day graph columns are not five minutes long");
+}
+
+/* Returns the RGB pixels of the PNG file PATH, written by write_png() */
+static unsigned char*
+read_png (const char* path, size_t* width, size_t* height)
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  png_bytepp rows;
+  unsigned char* result;
+  size_t i;
+  FILE* f;
+
+  if (!(f = fopen (path, "rb")))
+    err (EXIT_FAILURE, "Failed to open '%s' for reading", path);
+
+  if (!(png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, 0, 0, 0))
+      || !(info_ptr = png_create_info_struct (png_ptr)))
+    errx (EX_OSERR, "Failed to create PNG reader");
+
+  if (setjmp (png_jmpbuf (png_ptr)))
+    errx (EXIT_FAILURE, "Failed to read '%s'", path);
+
+  png_init_io (png_ptr, f);
+  png_read_png (png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, 0);
+
+  if (png_get_color_type (png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB
+      || png_get_bit_depth (png_ptr, info_ptr) != 8)
+    errx (EXIT_FAILURE, "'%s' is not an 8 bit RGB image", path);
+
+  *width = png_get_image_width (png_ptr, info_ptr);
+  *height = png_get_image_height (png_ptr, info_ptr);
+  rows = png_get_rows (png_ptr, info_ptr);
+
+  if (!(result = malloc (*width * *height * 3)))
+    err (EX_OSERR, "malloc failed");
+
+  for (i = 0; i < *height; ++i)
+    memcpy (result + i * *width * 3, rows[i], *width * 3);
+
+  png_destroy_read_struct (&png_ptr, &info_ptr, 0);
+  fclose (f);
+
+  return result;
+}
+
+/* Every period of a graph is drawn from the same render plan, so its
+   PNGs have the same size and the same colors in the legend */
+static void
+check_render_plan ()
+{
+  static const char* const draws[] = { "line2", "area", "stack", "line1" };
+  static const char* const names[] = { "a", "b", "c", "hidden" };
+  unsigned char* pixels;
+  uint32_t legend[3], color;
+  size_t i, j, k, period, width, height, drawn = 0;
+  size_t expected_width, expected_height;
+  struct graph* g;
+  struct curve* c;
+  char* path;
+
+  graph_alloc = graph_count = 1;
+
+  if (!(graphs = calloc (graph_alloc, sizeof (*graphs))))
+    err (EX_OSERR, "calloc failed");
+
+  g = &graphs[0];
+  g->domain = "test-domain";
+  g->host = "test-host";
+  g->name = "render-plan";
+  g->name_png_path = "render-plan";
+  g->title = "Render plan";
+  g->total = "Total";
+  g->vlabel = "per ${graph_period}";
+  g->width = 300;
+  g->height = 120;
+
+  g->curve_alloc = g->curve_count = 4;
+
+  if (!(g->curves = calloc (g->curve_count, sizeof (*g->curves))))
+    err (EX_OSERR, "calloc failed");
+
+  for (i = 0; i < g->curve_count; ++i)
+    {
+      c = &g->curves[i];
+      c->name = names[i];
+      c->draw = draws[i];
+      c->nograph = (i == 3);
+
+      if (i == 1)
+        {
+          c->has_color = 1;
+          c->color = 0x123456;
+        }
+
+      if (!(c->work = calloc (1, sizeof (*c->work)))
+          || !(c->work->data.rra_defs = calloc (12, sizeof (struct rra_def)))
+          || !(c->work->data.rra_ptrs = calloc (12, sizeof (unsigned long)))
+          || !(c->work->data.values = calloc (576 * 12, sizeof (double))))
+        err (EX_OSERR, "calloc failed");
+
+      c->work->data.data = c;
+      c->work->data.header.ds_count = 1;
+      c->work->data.header.rra_count = 12;
+      c->work->data.header.pdp_step = 300;
+      c->work->data.live_header.last_up = 946681200;
+
+      for (j = 0; j < 12; ++j)
+        {
+          struct rra_def* rd = &c->work->data.rra_defs[j];
+          static const unsigned long pdp_counts[] = { 1, 6, 24, 288 };
+
+          strcpy (rd->cf_name, (j % 3 == 0) ? "AVERAGE" : (j % 3 == 1) ? "MIN" : "MAX");
+          rd->pdp_count = pdp_counts[j / 3];
+          rd->row_count = 576;
+          c->work->data.rra_ptrs[j] = 0;
+
+          for (k = 0; k < 576; ++k)
+            c->work->data.values[j * 576 + k] = (i + 1) * (1.5 + sin (k * 0.05 * (j / 3 + 1)));
+        }
+    }
+
+  htmldir = "./tests";
+
+  intern_graphs ();
+  resolve_graph_order (g);
+
+  for (period = 0; period < period_count; ++period)
+    {
+      if (-1 == asprintf (&path, "%s%s-%s.png", g->png_prefix, g->name_png_path, periods[period].name))
+        err (EX_OSERR, "asprintf failed");
+
+      unlink (path);
+      free (path);
+    }
+
+  process_graph (0);
+
+  /* Three curves in the legend, and the total */
+  expected_width = plot_width (g) + 95;
+  expected_height = g->height + 75 + 3 * 14 + 14;
+
+  for (period = 0; period < period_count; ++period)
+    {
+      if (!period_interval (period, g->update_rate, plot_width (g)))
+        continue;
+
+      if (-1 == asprintf (&path, "%s%s-%s.png", g->png_prefix, g->name_png_path, periods[period].name))
+        err (EX_OSERR, "asprintf failed");
+
+      pixels = read_png (path, &width, &height);
+
+      if (width != expected_width || height != expected_height)
+        errx (EXIT_FAILURE, "'%s' is %zux%zu, expected %zux%zu", path,
+              width, height, expected_width, expected_height);
+
+      /* Inside the color box of each legend line */
+      for (i = 0; i < 3; ++i)
+        {
+          const unsigned char* pixel;
+
+          pixel = pixels + ((30 + g->height + 20 + 14 * (i + 1) + 2) * width + 12) * 3;
+          color = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+
+          if (!drawn)
+            legend[i] = color;
+          else if (color != legend[i])
+            errx (EXIT_FAILURE, "'%s' has legend color %06x on line %zu, expected %06x",
+                  path, color, i, legend[i]);
+        }
+
+      if (legend[1] != 0x123456)
+        errx (EXIT_FAILURE, "'%s' has legend color %06x for a curve colored 123456",
+              path, legend[1]);
+
+      ++drawn;
+      free (pixels);
+      free (path);
+    }
+
+  if (drawn < 2)
+    errx (EXIT_FAILURE, "Only %zu periods were drawn", drawn);
+
+  for (i = 0; i < g->curve_count; ++i)
+    {
+      c = &g->curves[i];
+
+      free (c->work->data.rra_defs);
+      free (c->work->data.rra_ptrs);
+      free (c->work->data.values);
+      free (c->work);
+    }
+
+  free (g->curves);
+  free (graphs);
+  graphs = 0;
+  graph_count = graph_alloc = 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -21,6 +453,12 @@ main (int argc, char **argv)
 
   font_init ();
 
+  check_interning ();
+  check_chunk_merge ();
+  check_value_rows ();
+  check_periods ();
+  check_render_plan ();
+
   debug = 1;
   nolazy = 1;
 
@@ -85,24 +523,27 @@ main (int argc, char **argv)
                 err (EX_OSERR, "asprintf failed");
             }
 
-          c->data.data = c;
-          c->data.file_size = 0;
-          c->data.header.ds_count = 1;
-          c->data.header.rra_count = 12;
-          c->data.header.pdp_step = 300;
+          if (!(c->work = calloc (1, sizeof (*c->work))))
+            err (EX_OSERR, "calloc failed");
+
+          c->work->data.data = c;
+          c->work->data.file_size = 0;
+          c->work->data.header.ds_count = 1;
+          c->work->data.header.rra_count = 12;
+          c->work->data.header.pdp_step = 300;
 
-          c->data.live_header.last_up = 946681200;
+          c->work->data.live_header.last_up = 946681200;
 
-          c->data.rra_defs = calloc (sizeof (struct ds_def), 12);
+          c->work->data.rra_defs = calloc (sizeof (struct ds_def), 12);
 
-          c->data.rra_ptrs = calloc (sizeof (unsigned long), 12);
-          c->data.values = calloc (sizeof (double), 576 * 12);
+          c->work->data.rra_ptrs = calloc (sizeof (unsigned long), 12);
+          c->work->data.values = calloc (sizeof (double), 576 * 12);
 
           for (j = 0; j < 12; ++j)
             {
               struct rra_def *rd;
 
-              rd = &c->data.rra_defs[j];
+              rd = &c->work->data.rra_defs[j];
 
               switch (j % 3)
                 {
@@ -121,25 +562,25 @@ main (int argc, char **argv)
 
               rd->row_count = 576;
 
-              c->data.rra_ptrs[j] = rra_ptr;
+              c->work->data.rra_ptrs[j] = rra_ptr;
 
               for (k = 0; k < 576; ++k)
                 {
                   switch (i)
                     {
-                    case 0: c->data.values[rra_ptr + k] = sin(k * 0.1 + i); break;
-                    case 1: c->data.values[rra_ptr + k] = 0.1;  break;
-                    case 2: c->data.values[rra_ptr + k] = (double) rand() / RAND_MAX - 0.5; break;
-                    case 3: c->data.values[rra_ptr + k] = cos(k * 0.1 + i); break;
-                    case 4: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.9; break;
-                    case 5: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.8; break;
-                    case 6: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.7; break;
-                    case 7: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.6; break;
-                    case 8: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.5; break;
-                    case 9: c->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.4; break;
-                    case 10: c->data.values[rra_ptr + k] = rand(); break;
-                    case 11: c->data.values[rra_ptr + k] = NAN; break;
-                    default: c->data.values[rra_ptr + k] = rand();  break;
+                    case 0: c->work->data.values[rra_ptr + k] = sin(k * 0.1 + i); break;
+                    case 1: c->work->data.values[rra_ptr + k] = 0.1;  break;
+                    case 2: c->work->data.values[rra_ptr + k] = (double) rand() / RAND_MAX - 0.5; break;
+                    case 3: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i); break;
+                    case 4: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.9; break;
+                    case 5: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.8; break;
+                    case 6: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.7; break;
+                    case 7: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.6; break;
+                    case 8: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.5; break;
+                    case 9: c->work->data.values[rra_ptr + k] = cos(k * 0.1 + i) * 0.4; break;
+                    case 10: c->work->data.values[rra_ptr + k] = rand(); break;
+                    case 11: c->work->data.values[rra_ptr + k] = NAN; break;
+                    default: c->work->data.values[rra_ptr + k] = rand();  break;
                     }
                 }
 
@@ -149,6 +590,8 @@ main (int argc, char **argv)
 
       htmldir = "./tests";
 
+      intern_graphs ();
+      resolve_graph_order (g);
       process_graph (0);
 
       for (i = 0; i < g->curve_count; ++i)
@@ -158,9 +601,10 @@ main (int argc, char **argv)
           free ((char *) c->name);
           free ((char *) c->label);
 
-          free (c->data.rra_defs);
-          free (c->data.rra_ptrs);
-          free (c->data.values);
+          free (c->work->data.rra_defs);
+          free (c->work->data.rra_ptrs);
+          free (c->work->data.values);
+          free (c->work);
         }
 
       free (g->curves);
@@ -18,6 +18,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,14 +26,21 @@
 #include <time.h>
 
 #include <err.h>
+#include <pthread.h>
 #include <sysexits.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
 #include "draw.h"
 #include "font.h"
 #include "graph.h"
+#include "intern.h"
 #include "munin.h"
 #include "rrd.h"
 
@@ -45,6 +53,20 @@
 
 #define INTERVAL_MONTH -1
 
+/* Smallest part of the datafile worth handing to a parser thread */
+#define PARSE_CHUNK_MIN (4 << 20)
+
+/* Bits in the `assigned' field of graphs and curves, for settings where
+   zero is a valid value.  Used when merging per-thread parse results.  */
+#define ASSIGNED_NOGRAPH   0x0001
+#define ASSIGNED_WARNING   0x0002
+#define ASSIGNED_CRITICAL  0x0004
+#define ASSIGNED_NOSCALE   0x0008
+#define ASSIGNED_BASE      0x0010
+#define ASSIGNED_PRECISION 0x0020
+#define ASSIGNED_WIDTH     0x0040
+#define ASSIGNED_HEIGHT    0x0080
+
 struct time_args
 {
   const char* format;
@@ -60,8 +82,43 @@ static const uint32_t colors[] =
   0x808000, 0x000000
 };
 
+enum parse_error
+{
+  parse_ok = 0,
+  parse_error_space,
+  parse_error_host
+};
+
+struct parse_chunk
+{
+  char* begin;
+  char* end;
+
+  int host_terminator;
+  int graph_terminator;
+
+  /* Line number of `begin', if known.  Only used for debug messages */
+  size_t first_line;
+  size_t line_count;
+  enum parse_error error;
+
+  /* Global settings found in this chunk */
+  const char* tmpldir;
+  const char* htmldir;
+  const char* dbdir;
+  const char* rundir;
+  const char* logdir;
+
+  /* Graph table built by the parser thread, and the arena holding it */
+  struct graph* graphs;
+  size_t graph_count;
+  struct arena arena;
+};
+
 const struct time_args time_args[] =
 {
+    { "%H:%M", 0, 600, 120 },
+    { "%H:%M", 0, 3600, 900 },
     { "%a %H:%M", 0, 43200, 3600 },
     { "%d", 0, 86400, 21600 },
     { "Week %V", 345600, 86400 * 7, 86400 },
@@ -70,16 +127,26 @@ const struct time_args time_args[] =
 
 enum version cur_version = ver_unknown;
 
-int debug = 0;
 int nolazy = 0;
 
 FILE* stats;
 static int first_domain = 1;
 static struct timeval domain_start, domain_end;
 
-struct graph* graphs = 0;
-size_t graph_count = 0;
-size_t graph_alloc = 0;
+int parse_thread_count = 1;
+size_t parse_chunk_count = 0;
+
+__thread struct graph* graphs = 0;
+__thread size_t graph_count = 0;
+__thread size_t graph_alloc = 0;
+
+__thread struct arena parse_arena;
+
+/* Strings needed while rendering a single graph */
+static struct arena graph_arena;
+
+/* Domain, host and graph names, built by intern_graphs() */
+static struct intern_table graph_names;
 
 const char* tmpldir = "/etc/munin/templates";
 const char* htmldir = "/var/www/munin";
@@ -87,22 +154,95 @@ const char* dbdir = "/var/lib/munin";
 const char* rundir = "/var/run/munin";
 const char* logdir = "/var/log/munin";
 
-static __thread const char* graph_order;
+
+struct render_plan;
+
+static void
+do_graph (struct graph* g, const struct render_plan* plan, size_t interval, const char* suffix);
+
+/* Open addressing hash table over graphs[], keyed on (domain, host, name).
+   Slots hold the graph index plus one, so that zero marks an empty slot.  */
+static __thread size_t* graph_hash;
+static __thread size_t graph_hash_size;
+static __thread size_t graph_hash_count;
+
+static size_t
+hash_string (size_t hash, const char* string)
+{
+  while (*string)
+    hash = (hash ^ (unsigned char) *string++) * 0x100000001b3ULL;
+
+  return (hash ^ 0xff) * 0x100000001b3ULL;
+}
+
+static size_t
+graph_hash_key (const char* domain, const char* host, const char* name)
+{
+  size_t hash = 0xcbf29ce484222325ULL;
+
+  hash = hash_string (hash, domain);
+  hash = hash_string (hash, host);
+  hash = hash_string (hash, name);
+
+  return hash;
+}
 
 static void
-do_graph (struct graph* g, size_t interval, const char* suffix);
+graph_hash_insert (size_t index)
+{
+  size_t slot;
+
+  slot = graph_hash_key (graphs[index].domain, graphs[index].host, graphs[index].name);
+
+  for (slot &= graph_hash_size - 1; graph_hash[slot]; slot = (slot + 1) & (graph_hash_size - 1))
+    ;
+
+  graph_hash[slot] = index + 1;
+  ++graph_hash_count;
+}
+
+void
+graph_index_rebuild ()
+{
+  size_t i;
+
+  if (!graph_hash || graph_hash_size < graph_count * 2)
+    {
+      free (graph_hash);
+
+      for (graph_hash_size = 64; graph_hash_size < graph_count * 2; graph_hash_size <<= 1)
+        ;
+
+      if (!(graph_hash = malloc (sizeof (*graph_hash) * graph_hash_size)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+    }
+
+  memset (graph_hash, 0, sizeof (*graph_hash) * graph_hash_size);
+  graph_hash_count = 0;
+
+  for (i = 0; i < graph_count; ++i)
+    graph_hash_insert (i);
+}
 
 ssize_t
 find_graph (const char* domain, const char* host, const char* name, int create)
 {
-  size_t i;
+  size_t i, slot;
   char *ch;
 
-  for (i = graph_count; i-- > 0; )
+  /* The graph array was modified behind our back */
+  if (!graph_hash || graph_hash_count != graph_count)
+    graph_index_rebuild ();
+
+  slot = graph_hash_key (domain, host, name);
+
+  for (slot &= graph_hash_size - 1; graph_hash[slot]; slot = (slot + 1) & (graph_hash_size - 1))
     {
-      if (!strcmp (graphs[i].domain, domain)
+      i = graph_hash[slot] - 1;
+
+      if (!strcmp (graphs[i].name, name)
           && !strcmp (graphs[i].host, host)
-          && !strcmp (graphs[i].name, name))
+          && !strcmp (graphs[i].domain, domain))
         return i;
     }
 
@@ -124,18 +264,16 @@ find_graph (const char* domain, const char* host, const char* name, int create)
   graphs[i].domain = domain;
   graphs[i].host = host;
   graphs[i].name = name;
-  graphs[i].name_png_path = strdup (name);
-
-  if (!graphs[i].name_png_path)
-    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
-
-  graphs[i].name_rrd_path = strdup (name);
-
-  if (!graphs[i].name_rrd_path)
-    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+  graphs[i].name_png_path = arena_strdup (&parse_arena, name);
+  graphs[i].name_rrd_path = arena_strdup (&parse_arena, name);
 
   ++graph_count;
 
+  if (graph_hash_size < graph_count * 2)
+    graph_index_rebuild ();
+  else
+    graph_hash_insert (i);
+
   for (ch = strchr (graphs[i].name_png_path, '.'); ch; ch = strchr (graphs[i].name_png_path, '.'))
     *ch = '/';
 
@@ -145,13 +283,273 @@ find_graph (const char* domain, const char* host, const char* name, int create)
   return i;
 }
 
+/* Gives every domain, host and graph name an ID in strcmp() order,
+   replaces the names with their canonical copies, and builds the RRD and
+   PNG path prefixes once per host.  Run after parsing, before sorting.  */
+void
+intern_graphs ()
+{
+  size_t i, slot, mask, prefix_size;
+  size_t* remap;
+  size_t* prefix_hash;
+
+  intern_free (&graph_names);
+
+  for (i = 0; i < graph_count; ++i)
+    {
+      graphs[i].domain_id = intern_add (&graph_names, graphs[i].domain);
+      graphs[i].host_id = intern_add (&graph_names, graphs[i].host);
+      graphs[i].name_id = intern_add (&graph_names, graphs[i].name);
+    }
+
+  for (prefix_size = 64; prefix_size < graph_count * 2; prefix_size <<= 1)
+    ;
+
+  if (!(remap = malloc (sizeof (*remap) * (graph_names.count + 1)))
+      || !(prefix_hash = calloc (prefix_size, sizeof (*prefix_hash))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  intern_sort (&graph_names, remap);
+
+  mask = prefix_size - 1;
+
+  for (i = 0; i < graph_count; ++i)
+    {
+      struct graph* g = &graphs[i];
+
+      g->domain_id = remap[g->domain_id];
+      g->host_id = remap[g->host_id];
+      g->name_id = remap[g->name_id];
+
+      g->domain = graph_names.strings[g->domain_id];
+      g->host = graph_names.strings[g->host_id];
+      g->name = graph_names.strings[g->name_id];
+
+      /* Slots hold the index plus one of the first graph of each host */
+      for (slot = (g->domain_id * 0x9e3779b97f4a7c15ULL + g->host_id) & mask; prefix_hash[slot]; slot = (slot + 1) & mask)
+        {
+          const struct graph* first = &graphs[prefix_hash[slot] - 1];
+
+          if (first->domain_id == g->domain_id && first->host_id == g->host_id)
+            break;
+        }
+
+      if (prefix_hash[slot])
+        {
+          g->rrd_prefix = graphs[prefix_hash[slot] - 1].rrd_prefix;
+          g->png_prefix = graphs[prefix_hash[slot] - 1].png_prefix;
+
+          continue;
+        }
+
+      prefix_hash[slot] = i + 1;
+
+      g->rrd_prefix = arena_printf (&parse_arena, "%s/%s/%s-", dbdir, g->domain, g->host);
+      g->png_prefix = arena_printf (&parse_arena, (cur_version < ver_1_3) ? "%s/%s/%s-" : "%s/%s/%s/",
+                                    htmldir, g->domain, g->host);
+    }
+
+  free (prefix_hash);
+  free (remap);
+}
+
+/* Orders graphs by domain, then name, then host */
+int
+graph_cmp (const void* plhs, const void* prhs)
+{
+  const struct graph* lhs = plhs;
+  const struct graph* rhs = prhs;
+
+  if (lhs->domain_id != rhs->domain_id)
+    return (lhs->domain_id < rhs->domain_id) ? -1 : 1;
+
+  if (lhs->name_id != rhs->name_id)
+    return (lhs->name_id < rhs->name_id) ? -1 : 1;
+
+  if (lhs->host_id != rhs->host_id)
+    return (lhs->host_id < rhs->host_id) ? -1 : 1;
+
+  return 0;
+}
+
+struct graph_sort_entry
+{
+  size_t domain_id, name_id, host_id;
+  size_t index;
+};
+
+static int
+graph_sort_entry_cmp (const void* plhs, const void* prhs)
+{
+  const struct graph_sort_entry* lhs = plhs;
+  const struct graph_sort_entry* rhs = prhs;
+
+  if (lhs->domain_id != rhs->domain_id)
+    return (lhs->domain_id < rhs->domain_id) ? -1 : 1;
+
+  if (lhs->name_id != rhs->name_id)
+    return (lhs->name_id < rhs->name_id) ? -1 : 1;
+
+  if (lhs->host_id != rhs->host_id)
+    return (lhs->host_id < rhs->host_id) ? -1 : 1;
+
+  return 0;
+}
+
+/* Sorts graphs[] with graph_cmp().  The sort works on small key and
+   index entries, and each graph is then moved exactly once, instead of
+   qsort() swapping the graph structures around.  */
+void
+sort_graphs ()
+{
+  struct graph_sort_entry* entries;
+  struct graph* sorted;
+  size_t i;
+
+  if (!graph_count)
+    return;
+
+  if (!(entries = malloc (sizeof (*entries) * graph_count)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < graph_count; ++i)
+    {
+      entries[i].domain_id = graphs[i].domain_id;
+      entries[i].name_id = graphs[i].name_id;
+      entries[i].host_id = graphs[i].host_id;
+      entries[i].index = i;
+    }
+
+  qsort (entries, graph_count, sizeof (*entries), graph_sort_entry_cmp);
+
+  if (!(sorted = malloc (sizeof (*sorted) * graph_count)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < graph_count; ++i)
+    sorted[i] = graphs[entries[i].index];
+
+  free (graphs);
+  free (entries);
+
+  graphs = sorted;
+  graph_alloc = graph_count;
+}
+
+/* Binary search for a graph by name IDs.  Requires graphs[] to be sorted
+   with graph_cmp().  */
+ssize_t
+find_graph_id (size_t domain_id, size_t host_id, size_t name_id)
+{
+  struct graph key;
+  size_t first = 0, last = graph_count, middle;
+  int cmp;
+
+  key.domain_id = domain_id;
+  key.host_id = host_id;
+  key.name_id = name_id;
+
+  while (first < last)
+    {
+      middle = first + (last - first) / 2;
+
+      if (0 == (cmp = graph_cmp (&key, &graphs[middle])))
+        return middle;
+
+      if (cmp > 0)
+        first = middle + 1;
+      else
+        last = middle;
+    }
+
+  return -1;
+}
+
+/* Each graph keeps two open addressing tables of curve indices plus one,
+   stored back to back: one keyed on the full curve name for
+   curve_index(), and one keyed on the part after the last '.' for
+   find_curve().  Only the first curve with a given base name is indexed
+   in the second table, matching the old front-to-back search.  */
+static size_t
+curve_hash_key (const char* name)
+{
+  return hash_string (0xcbf29ce484222325ULL, name);
+}
+
+static void
+curve_hash_insert (struct graph* g, size_t index)
+{
+  struct curve* c = &g->curves[index];
+  size_t mask = g->curve_hash_size - 1;
+  size_t* base_hash = g->curve_hash + g->curve_hash_size;
+  size_t slot;
+
+  for (slot = curve_hash_key (c->name) & mask; g->curve_hash[slot]; slot = (slot + 1) & mask)
+    ;
+
+  g->curve_hash[slot] = index + 1;
+
+  for (slot = curve_hash_key (c->basename) & mask; base_hash[slot]; slot = (slot + 1) & mask)
+    {
+      if (!strcmp (g->curves[base_hash[slot] - 1].basename, c->basename))
+        break;
+    }
+
+  if (!base_hash[slot])
+    base_hash[slot] = index + 1;
+
+  ++g->curve_hash_count;
+}
+
+void
+curve_hash_rebuild (struct graph* g)
+{
+  size_t i, size;
+  const char* ch;
+
+  for (size = 16; size < g->curve_count * 2; size <<= 1)
+    ;
+
+  /* Kept out of the arena: the table is replaced as the curve array
+     grows, and allocating it between two growth steps would keep the
+     arena from extending the curve array in place */
+  if (size != g->curve_hash_size)
+    {
+      free (g->curve_hash);
+
+      if (!(g->curve_hash = malloc (sizeof (*g->curve_hash) * size * 2)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      g->curve_hash_size = size;
+    }
+
+  memset (g->curve_hash, 0, sizeof (*g->curve_hash) * size * 2);
+  g->curve_hash_count = 0;
+
+  for (i = 0; i < g->curve_count; ++i)
+    {
+      struct curve* c = &g->curves[i];
+
+      c->basename = (0 != (ch = strrchr (c->name, '.'))) ? ch + 1 : c->name;
+
+      curve_hash_insert (g, i);
+    }
+}
+
 size_t
 curve_index (struct graph* graph, const char* name)
 {
-  size_t i;
+  size_t i, slot, mask;
+  const char* ch;
+
+  if (!graph->curve_hash || graph->curve_hash_count != graph->curve_count)
+    curve_hash_rebuild (graph);
 
-  for (i = graph->curve_count; i-- > 0; )
+  mask = graph->curve_hash_size - 1;
+
+  for (slot = curve_hash_key (name) & mask; graph->curve_hash[slot]; slot = (slot + 1) & mask)
     {
+      i = graph->curve_hash[slot] - 1;
+
       if (!strcmp (graph->curves[i].name, name))
         return i;
     }
@@ -160,17 +558,24 @@ curve_index (struct graph* graph, const char* name)
 
   if (graph->curve_count == graph->curve_alloc)
     {
-      graph->curve_alloc = graph->curve_alloc * 3 / 2 + 16;
-      graph->curves = realloc (graph->curves, sizeof (struct curve) * graph->curve_alloc);
+      size_t old_alloc = graph->curve_alloc;
 
-      if (!graph->curves)
-        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+      graph->curve_alloc = graph->curve_alloc * 3 / 2 + 16;
+      graph->curves = arena_realloc (&parse_arena, graph->curves,
+                                     sizeof (struct curve) * old_alloc,
+                                     sizeof (struct curve) * graph->curve_alloc);
     }
 
   memset (&graph->curves[i], 0, sizeof (struct curve));
   graph->curves[i].name = name;
+  graph->curves[i].basename = (0 != (ch = strrchr (name, '.'))) ? ch + 1 : name;
   ++graph->curve_count;
 
+  if (graph->curve_hash_size < graph->curve_count * 2)
+    curve_hash_rebuild (graph);
+  else
+    curve_hash_insert (graph, i);
+
   return i;
 }
 
@@ -194,88 +599,183 @@ strword (const char* haystack, const char* needle)
   return 0;
 }
 
-int
-curve_name_cmp (const void* plhs, const void* prhs)
+struct order_entry
 {
-  const struct curve* lhs = plhs;
-  const struct curve* rhs = prhs;
+  size_t position;
+  const char* name;
+  size_t index;
+};
 
-  if (graph_order)
-    {
-      const char* a = strword (graph_order, lhs->name);
-      const char* b = strword (graph_order, rhs->name);
+/* Curves named in graph_order come first, in that order, followed by the
+   remaining curves sorted by name */
+static int
+order_entry_cmp (const void* plhs, const void* prhs)
+{
+  const struct order_entry* lhs = plhs;
+  const struct order_entry* rhs = prhs;
 
-      if (a)
-        {
-          if (!b)
-            return -1;
-          else
-            return a - b;
-        }
-      else if (b)
-        return 1;
-    }
+  if (lhs->position != rhs->position)
+    return (lhs->position < rhs->position) ? -1 : 1;
 
-  return strcmp (lhs->name, rhs->name);
+  if (lhs->position == SIZE_MAX)
+    return strcmp (lhs->name, rhs->name);
+
+  return 0;
 }
 
-const char* key_strings[] =
+/* Every key recognized in the datafile.  The key_* enumeration and
+   key_strings[] are both generated from this list */
+#define DATAFILE_KEYS \
+  KEY (address) KEY (cdef) KEY (color) KEY (colour) KEY (critical) \
+  KEY (dbdir) KEY (draw) KEY (ds) KEY (filename) KEY (graph) KEY (graph_args) KEY (graph_category) \
+  KEY (graph_data_size) KEY (graph_height) KEY (graph_info) \
+  KEY (graph_order) KEY (graph_period) KEY (graph_scale) KEY (graph_title) \
+  KEY (graph_total) KEY (graph_vlabel) KEY (graph_width) KEY (htmldir) \
+  KEY (info) KEY (label) KEY (logdir) KEY (max) KEY (min) KEY (negative) \
+  KEY (rundir) KEY (skipdraw) KEY (tmpldir) KEY (type) KEY (update_rate) \
+  KEY (use_node_name) KEY (warn) KEY (warning)
+
+enum key
 {
-  "cdef", "color", "colour", "critical", "dbdir", "draw", "graph",
-  "graph_args", "graph_category", "graph_data_size", "graph_height",
-  "graph_info", "graph_order", "graph_period", "graph_scale", "graph_title",
-  "graph_total", "graph_vlabel", "graph_width", "htmldir", "info", "label",
-  "logdir", "max", "min", "negative", "rundir", "skipdraw", "tmpldir", "type",
-  "update_rate", "warn", "warning"
+#define KEY(name) key_##name,
+  DATAFILE_KEYS
+#undef KEY
+  key_count
 };
 
-enum key
+static const char* key_strings[] =
 {
-  key_cdef = 0, key_color, key_colour, key_critical, key_dbdir, key_draw,
-  key_graph, key_graph_args, key_graph_category, key_graph_data_size,
-  key_graph_height, key_graph_info, key_graph_order, key_graph_period,
-  key_graph_scale, key_graph_title, key_graph_total, key_graph_vlabel,
-  key_graph_width, key_htmldir, key_info, key_label, key_logdir, key_max,
-  key_min, key_negative, key_rundir, key_skipdraw, key_tmpldir, key_type,
-  key_update_rate, key_warn, key_warning
+#define KEY(name) #name,
+  DATAFILE_KEYS
+#undef KEY
 };
 
+/* Maps the LENGTH bytes at KEY to a key_* value, or -1 if the key is
+   unknown.  The length and at most two bytes select the only possible
+   candidate, which is then verified with a single memcmp */
 static int
-lookup_key (const char* string)
+lookup_key (const char* key, size_t length)
 {
-  int first, last, len, half, middle, cmp;
-
-  first = 0;
-  len = last = sizeof (key_strings) / sizeof (key_strings[0]);
+  int result;
 
-  while (len > 0)
+  switch (length)
     {
-      half = len >> 1;
-      middle = first + half;
+    case 2: result = key_ds; break;
+    case 3: result = (key[1] == 'a') ? key_max : key_min; break;
 
-      cmp = strcmp (string, key_strings[middle]);
+    case 4:
 
-      if (cmp == 0)
-        return middle;
+      switch (key[0])
+        {
+        case 'c': result = key_cdef; break;
+        case 'd': result = key_draw; break;
+        case 'i': result = key_info; break;
+        case 't': result = key_type; break;
+        case 'w': result = key_warn; break;
+        default: return -1;
+        }
 
-      if (cmp > 0)
+      break;
+
+    case 5:
+
+      switch (key[0])
         {
-          first = middle + 1;
-          len = len - half - 1;
+        case 'c': result = key_color; break;
+        case 'd': result = key_dbdir; break;
+        case 'g': result = key_graph; break;
+        case 'l': result = key_label; break;
+        default: return -1;
         }
-      else
-        len = half;
+
+      break;
+
+    case 6:
+
+      switch (key[0])
+        {
+        case 'c': result = key_colour; break;
+        case 'l': result = key_logdir; break;
+        case 'r': result = key_rundir; break;
+        default: return -1;
+        }
+
+      break;
+
+    case 7:
+
+      switch (key[0])
+        {
+        case 'a': result = key_address; break;
+        case 'h': result = key_htmldir; break;
+        case 't': result = key_tmpldir; break;
+        case 'w': result = key_warning; break;
+        default: return -1;
+        }
+
+      break;
+
+    case 8:
+
+      switch (key[0])
+        {
+        case 'c': result = key_critical; break;
+        case 'f': result = key_filename; break;
+        case 'n': result = key_negative; break;
+        case 's': result = key_skipdraw; break;
+        default: return -1;
+        }
+
+      break;
+
+    case 10: result = (key[6] == 'a') ? key_graph_args : key_graph_info; break;
+
+    case 11:
+
+      switch (key[6])
+        {
+        case 'o': result = key_graph_order; break;
+        case 's': result = key_graph_scale; break;
+        case 't': result = (key[7] == 'i') ? key_graph_title : key_graph_total; break;
+        case 'w': result = key_graph_width; break;
+        case '_': result = key_update_rate; break;
+        default: return -1;
+        }
+
+      break;
+
+    case 12:
+
+      switch (key[6])
+        {
+        case 'h': result = key_graph_height; break;
+        case 'p': result = key_graph_period; break;
+        case 'v': result = key_graph_vlabel; break;
+        default: return -1;
+        }
+
+      break;
+
+    case 13: result = key_use_node_name; break;
+    case 14: result = key_graph_category; break;
+    case 15: result = key_graph_data_size; break;
+
+    default: return -1;
     }
 
-  return -1;
+  return memcmp (key, key_strings[result], length) ? -1 : result;
 }
 
-void
-parse_datafile (char* in, const char *pathname)
+/* Parses the lines in [chunk->begin, chunk->end) into the calling
+   thread's graph table */
+static void
+parse_chunk (struct parse_chunk* chunk)
 {
   size_t curve, graph;
-  size_t lineno = 2;
+  size_t lineno = 0;
 
+  char* in = chunk->begin;
+  char* end = chunk->end;
   char *line_end;
   char* key_start;
   char* key_end;
@@ -286,61 +786,35 @@ parse_datafile (char* in, const char *pathname)
   char* graph_name;
   char* curve_name;
   char* graph_key;
+  int key;
 
-  int host_terminator;
-  int graph_terminator;
+  int host_terminator = chunk->host_terminator;
+  int graph_terminator = chunk->graph_terminator;
 
-  switch (cur_version)
+  while (in < end)
     {
-    case ver_1_2:
+      key_start = in;
 
-      host_terminator = ':';
-      graph_terminator = '.';
+      while (key_start != end && isspace (*key_start))
+        ++key_start;
 
-      break;
+      if (key_start == end)
+        break;
 
-    case ver_1_3:
-
-      host_terminator = ';';
-      graph_terminator = ';';
-
-      break;
-
-    case ver_1_4:
-    case ver_2_0:
-
-      htmldir = "/var/cache/munin/www";
-      host_terminator = ':';
-      graph_terminator = '.';
-
-      break;
-
-    default:
-
-      errx (EXIT_FAILURE, "parse_datafile: Unknown datafile version");
-    }
-
-  while (*in)
-    {
-      key_start = in;
-
-      while (isspace (*key_start))
-        ++key_start;
-
-      if (!*key_start)
-        break;
-
-      line_end = key_start + 1;
-
-      while (*line_end && *line_end != '\n')
-        ++line_end;
+      if (0 == (line_end = memchr (key_start, '\n', end - key_start)))
+        line_end = end;
 
       *line_end = 0;
 
-      key_end = strchr (key_start, ' ');
+      key_end = memchr (key_start, ' ', line_end - key_start);
 
       if (!key_end)
-        errx (EXIT_FAILURE, "Parse error at line %zu in '%s'.  Did not find a SPACE character", lineno, pathname);
+        {
+          chunk->error = parse_error_space;
+          chunk->line_count = lineno;
+
+          return;
+        }
 
       value_start = key_end + 1;
       *key_end = 0;
@@ -348,30 +822,44 @@ parse_datafile (char* in, const char *pathname)
       while (isspace (*value_start))
         ++value_start;
 
-      if (0 != (domain_end = strchr (key_start, ';')))
+      if (0 != (domain_end = memchr (key_start, ';', key_end - key_start)))
         {
           host_start = domain_end + 1;
           *domain_end = 0;
 
-          if (0 == (host_end = strchr (host_start, host_terminator)))
-            errx (EXIT_FAILURE, "Parse error at line %zu in '%s'.  Did not find a %c character after host name",
-                  lineno, pathname, host_terminator);
+          if (0 == (host_end = memchr (host_start, host_terminator, key_end - host_start)))
+            {
+              chunk->error = parse_error_host;
+              chunk->line_count = lineno;
+
+              return;
+            }
 
           graph_name = host_end + 1;
           *host_end = 0;
 
-          if (0 != (graph_key = strrchr (graph_name, graph_terminator)))
+          if (0 != (graph_key = memrchr (graph_name, graph_terminator, key_end - graph_name)))
 	    {
 	      struct graph *g;
 
 	      *graph_key++ = 0;
 
 	      if (strncmp (graph_key, "graph_", 6)
-		  && 0 != (curve_name = strrchr (graph_name, graph_terminator)))
+		  && 0 != (curve_name = memrchr (graph_name, graph_terminator, graph_key - 1 - graph_name)))
 		*curve_name++ = 0;
 	      else
 		curve_name = 0;
 
+	      if (-1 == (key = lookup_key (graph_key, key_end - graph_key)))
+		{
+		  if (debug)
+		    fprintf (stderr, "Skipping unknown %s key '%s' at line %zu\n",
+			     curve_name ? "data source" : "graph", graph_key,
+			     chunk->first_line + lineno);
+
+		  goto next_line;
+		}
+
 	      graph = find_graph (key_start, host_start, graph_name, 1);
 	      g = &graphs[graph];
 
@@ -382,7 +870,7 @@ parse_datafile (char* in, const char *pathname)
 		  curve = curve_index (g, curve_name);
 		  c = &g->curves[curve];
 
-		  switch (lookup_key (graph_key))
+		  switch (key)
 		    {
 		    case key_label:
 
@@ -407,12 +895,14 @@ parse_datafile (char* in, const char *pathname)
 		    case key_graph:
 
 		      c->nograph = !strcasecmp (value_start, "no");
+		      c->assigned |= ASSIGNED_NOGRAPH;
 
 		      break;
 
 		    case key_skipdraw:
 
 		      c->nograph = !!strtol (value_start, 0, 0);
+		      c->assigned |= ASSIGNED_NOGRAPH;
 
 		      break;
 
@@ -440,6 +930,18 @@ parse_datafile (char* in, const char *pathname)
 
 		      break;
 
+		    case key_filename:
+
+		      c->filename = value_start;
+
+		      break;
+
+		    case key_ds:
+
+		      c->ds = value_start;
+
+		      break;
+
 		    case key_max:
 
 		      c->max = strtod (value_start, 0);
@@ -458,42 +960,50 @@ parse_datafile (char* in, const char *pathname)
 		    case key_warn:
 
 		      c->warning = strtod (value_start, 0);
+		      c->assigned |= ASSIGNED_WARNING;
 
 		      break;
 
 		    case key_critical:
 
 		      c->critical = strtod (value_start, 0);
+		      c->assigned |= ASSIGNED_CRITICAL;
 
 		      break;
 
                     case key_update_rate:
 
+                      /* Only plugins have an update rate, but a field's
+                         is as good as its plugin's */
+                      g->update_rate = strtol (value_start, 0, 0);
+
                       break;
 
 		    default:
 
 		      if (debug)
-			fprintf (stderr, "Skipping unknown data source key '%s' at line %zu\n", graph_key, lineno);
+			fprintf (stderr, "Skipping unknown data source key '%s' at line %zu\n", graph_key, chunk->first_line + lineno);
 		    }
 		}
 	      else
 		{
-		  switch (lookup_key (graph_key))
+		  switch (key)
 		    {
 		    case key_graph:
 
 		      g->nograph = !strcasecmp (value_start, "no");
+		      g->assigned |= ASSIGNED_NOGRAPH;
 
 		      break;
 
 		    case key_graph_args:
 
 			{
-			  char *tmp = strdup (value_start);
-			  char *key, *value;
+			  char *key, *value, *saveptr;
 
-			  for (key = strtok (tmp, " "); key; key = strtok (0, " "))
+			  /* Nothing refers to the arguments afterwards, so
+			     they can be split in place */
+			  for (key = strtok_r (value_start, " ", &saveptr); key; key = strtok_r (0, " ", &saveptr))
 			    {
 			      if (!strcmp (key, "--base")
 				  || !strcmp (key, "-l")
@@ -501,7 +1011,7 @@ parse_datafile (char* in, const char *pathname)
 				  || !strcmp (key, "--upper-limit")
 				  || !strcmp (key, "--vertical-label"))
 				{
-				  value = strtok (0, " ");
+				  value = strtok_r (0, " ", &saveptr);
 
 				  if (!value)
 				    {
@@ -509,7 +1019,7 @@ parse_datafile (char* in, const char *pathname)
 					fprintf (stderr,
 						 "Missing argument for graph "
 						 "arg '%s' at line %zu\n",
-						 key, lineno);
+						 key, chunk->first_line + lineno);
 
 				      continue;
 				    }
@@ -518,9 +1028,15 @@ parse_datafile (char* in, const char *pathname)
 				value = 0;
 
 			      if (!strcmp (key, "--base"))
-				g->base = atoi (value);
+				{
+				  g->base = atoi (value);
+				  g->assigned |= ASSIGNED_BASE;
+				}
 			      else if (!strcmp (key, "-l"))
-				g->precision = atoi (value);
+				{
+				  g->precision = atoi (value);
+				  g->assigned |= ASSIGNED_PRECISION;
+				}
 			      else if (!strcmp (key, "--lower-limit"))
 				{
 				  g->has_lower_limit = 1;
@@ -534,10 +1050,8 @@ parse_datafile (char* in, const char *pathname)
 			      else if (!strcmp (key, "--logarithmic"))
 				g->logarithmic = 1;
 
-			      /* XXX: Handle vertical-label without leaking memory */
+			      /* XXX: Handle vertical-label */
 			    }
-
-			  free (tmp);
 			}
 
 		      break;
@@ -575,18 +1089,21 @@ parse_datafile (char* in, const char *pathname)
 		    case key_graph_scale:
 
 		      g->noscale = !strcasecmp (value_start, "no");
+		      g->assigned |= ASSIGNED_NOSCALE;
 
 		      break;
 
 		    case key_graph_height:
 
 		      g->height = strtol (value_start, 0, 0);
+		      g->assigned |= ASSIGNED_HEIGHT;
 
 		      break;
 
 		    case key_graph_width:
 
 		      g->width = strtol (value_start, 0, 0);
+		      g->assigned |= ASSIGNED_WIDTH;
 
 		      break;
 
@@ -602,6 +1119,14 @@ parse_datafile (char* in, const char *pathname)
 
 		      break;
 
+                    case key_update_rate:
+
+                      g->update_rate = strtol (value_start, 0, 0);
+
+                      break;
+
+                    /* Says how munin-update creates the archives, which
+                       are read from the RRD files instead */
                     case key_graph_data_size:
 
                       break;
@@ -609,35 +1134,308 @@ parse_datafile (char* in, const char *pathname)
 		    default:
 
 		      if (debug)
-			fprintf (stderr, "Skipping unknown graph key '%s' at line %zu\n", graph_key, lineno);
+			fprintf (stderr, "Skipping unknown graph key '%s' at line %zu\n", graph_key, chunk->first_line + lineno);
 		    }
 		}
 	    }
-          else if (!strcmp (graph_name, "use_node_name"))
+          else if (debug)
             {
+              key = lookup_key (graph_name, key_end - graph_name);
+
+              if (key != key_use_node_name && key != key_address)
+                fprintf (stderr, "Skipping unknown host key '%s' at line %zu\n", graph_name, chunk->first_line + lineno);
             }
-          else if (!strcmp (graph_name, "address"))
+        }
+      else
+        {
+          switch (lookup_key (key_start, key_end - key_start))
             {
+            case key_tmpldir: chunk->tmpldir = value_start; break;
+            case key_htmldir: chunk->htmldir = value_start; break;
+            case key_dbdir: chunk->dbdir = value_start; break;
+            case key_rundir: chunk->rundir = value_start; break;
+            case key_logdir: chunk->logdir = value_start; break;
+
+            default:
+
+              if (debug)
+                fprintf (stderr, "Skipping unknown global key '%s' at line %zu\n", key_start, chunk->first_line + lineno);
             }
-          else if (debug)
-            fprintf (stderr, "Skipping unknown host key '%s' at line %zu\n", graph_name, lineno);
-        }
-      else if (!strcmp (key_start, "tmpldir"))
-        tmpldir = value_start;
-      else if (!strcmp (key_start, "htmldir"))
-        htmldir = value_start;
-      else if (!strcmp (key_start, "dbdir"))
-        dbdir = value_start;
-      else if (!strcmp (key_start, "rundir"))
-        rundir = value_start;
-      else if (!strcmp (key_start, "logdir"))
-        logdir = value_start;
-      else if (debug)
-        fprintf (stderr, "Skipping unknown global key '%s' at line %zu\n", key_start, lineno);
+        }
+
+next_line:
 
       in = line_end + 1;
       ++lineno;
     }
+
+  chunk->line_count = lineno;
+}
+
+static void*
+parse_thread (void* arg)
+{
+  struct parse_chunk* chunk = arg;
+
+  parse_chunk (chunk);
+
+  chunk->graphs = graphs;
+  chunk->graph_count = graph_count;
+  chunk->arena = parse_arena;
+
+  free (graph_hash);
+
+  return 0;
+}
+
+static void
+merge_graph (struct graph* dst, const struct graph* src)
+{
+#define merge_pointer(field) if (src->field) dst->field = src->field
+#define merge_assigned(field, flag) if (src->assigned & (flag)) dst->field = src->field
+
+  merge_pointer (title);
+  merge_pointer (category);
+  merge_pointer (info);
+  merge_pointer (order);
+  merge_pointer (period);
+  merge_pointer (total);
+  merge_pointer (vlabel);
+
+  merge_assigned (nograph, ASSIGNED_NOGRAPH);
+  merge_assigned (noscale, ASSIGNED_NOSCALE);
+  merge_assigned (base, ASSIGNED_BASE);
+  merge_assigned (precision, ASSIGNED_PRECISION);
+  merge_assigned (width, ASSIGNED_WIDTH);
+  merge_assigned (height, ASSIGNED_HEIGHT);
+
+  if (src->has_lower_limit)
+    {
+      dst->has_lower_limit = 1;
+      dst->lower_limit = src->lower_limit;
+    }
+
+  if (src->has_upper_limit)
+    {
+      dst->has_upper_limit = 1;
+      dst->upper_limit = src->upper_limit;
+    }
+
+  if (src->logarithmic)
+    dst->logarithmic = 1;
+
+  if (src->update_rate)
+    dst->update_rate = src->update_rate;
+
+  dst->assigned |= src->assigned;
+}
+
+static void
+merge_curve (struct curve* dst, const struct curve* src)
+{
+  merge_pointer (label);
+  merge_pointer (draw);
+  merge_pointer (type);
+  merge_pointer (info);
+  merge_pointer (cdef);
+  merge_pointer (negative);
+  merge_pointer (filename);
+  merge_pointer (ds);
+
+  merge_assigned (nograph, ASSIGNED_NOGRAPH);
+  merge_assigned (warning, ASSIGNED_WARNING);
+  merge_assigned (critical, ASSIGNED_CRITICAL);
+
+#undef merge_assigned
+#undef merge_pointer
+
+  if (src->has_color)
+    {
+      dst->has_color = 1;
+      dst->color = src->color;
+    }
+
+  if (src->has_min)
+    {
+      dst->has_min = 1;
+      dst->min = src->min;
+    }
+
+  if (src->has_max)
+    {
+      dst->has_max = 1;
+      dst->max = src->max;
+    }
+
+  dst->assigned |= src->assigned;
+}
+
+/* Adds the graphs parsed by another thread to this thread's graph table.
+   Chunks are merged in file order, so graphs and curves end up in order
+   of first appearance, and later assignments override earlier ones, just
+   as if all lines had been parsed by a single thread.  */
+static void
+merge_chunk (struct parse_chunk* chunk)
+{
+  size_t i, j;
+
+  for (i = 0; i < chunk->graph_count; ++i)
+    {
+      struct graph* src = &chunk->graphs[i];
+      struct graph* g;
+      size_t graph, old_count = graph_count;
+
+      graph = find_graph (src->domain, src->host, src->name, 1);
+      g = &graphs[graph];
+
+      /* Most graphs are contained in a single chunk, and can be moved as is */
+      if (graph_count != old_count)
+        {
+          *g = *src;
+
+          continue;
+        }
+
+      merge_graph (g, src);
+
+      for (j = 0; j < src->curve_count; ++j)
+        {
+          size_t curve = curve_index (g, src->curves[j].name);
+
+          merge_curve (&g->curves[curve], &src->curves[j]);
+        }
+
+      free (src->curve_hash);
+    }
+
+  free (chunk->graphs);
+  arena_merge (&parse_arena, &chunk->arena);
+}
+
+void
+parse_datafile (char* in, char* end, const char *pathname)
+{
+  struct parse_chunk* chunks;
+  pthread_t* threads;
+  size_t i, chunk_count, lineno;
+  char* ch;
+
+  int host_terminator;
+  int graph_terminator;
+
+  switch (cur_version)
+    {
+    case ver_1_2:
+
+      host_terminator = ':';
+      graph_terminator = '.';
+
+      break;
+
+    case ver_1_3:
+
+      host_terminator = ';';
+      graph_terminator = ';';
+
+      break;
+
+    case ver_1_4:
+    case ver_2_0:
+
+      htmldir = "/var/cache/munin/www";
+      host_terminator = ':';
+      graph_terminator = '.';
+
+      break;
+
+    default:
+
+      errx (EXIT_FAILURE, "parse_datafile: Unknown datafile version");
+    }
+
+  /* Only the serial parser knows the line numbers for debug messages */
+  chunk_count = debug ? 1 : parse_thread_count;
+
+  if (chunk_count > (end - in) / PARSE_CHUNK_MIN)
+    chunk_count = (end - in) / PARSE_CHUNK_MIN;
+
+  if (chunk_count < 1)
+    chunk_count = 1;
+
+  parse_chunk_count = chunk_count;
+
+  if (!(chunks = calloc (chunk_count, sizeof (*chunks)))
+      || !(threads = calloc (chunk_count, sizeof (*threads))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  /* Split at newlines, so that no line is shared by two chunks */
+  for (i = 0; i < chunk_count; ++i)
+    {
+      chunks[i].host_terminator = host_terminator;
+      chunks[i].graph_terminator = graph_terminator;
+
+      chunks[i].begin = i ? chunks[i - 1].end : in;
+      chunks[i].end = end;
+
+      if (i + 1 < chunk_count)
+        {
+          ch = in + (end - in) / chunk_count * (i + 1);
+
+          if (ch < chunks[i].begin)
+            ch = chunks[i].begin;
+
+          if (0 != (ch = memchr (ch, '\n', end - ch)))
+            chunks[i].end = ch + 1;
+        }
+    }
+
+  chunks[0].first_line = 2;
+
+  for (i = 1; i < chunk_count; ++i)
+    {
+      if (0 != (errno = pthread_create (&threads[i], 0, parse_thread, &chunks[i])))
+        errx (EXIT_FAILURE, "Failed to create parser thread: %s", strerror (errno));
+    }
+
+  parse_chunk (&chunks[0]);
+
+  for (i = 1; i < chunk_count; ++i)
+    pthread_join (threads[i], 0);
+
+  for (i = 0, lineno = 2; i < chunk_count; lineno += chunks[i++].line_count)
+    {
+      switch (chunks[i].error)
+        {
+        case parse_ok:
+
+          break;
+
+        case parse_error_space:
+
+          errx (EXIT_FAILURE, "Parse error at line %zu in '%s'.  Did not find a SPACE character",
+                lineno + chunks[i].line_count, pathname);
+
+        case parse_error_host:
+
+          errx (EXIT_FAILURE, "Parse error at line %zu in '%s'.  Did not find a %c character after host name",
+                lineno + chunks[i].line_count, pathname, host_terminator);
+        }
+    }
+
+  for (i = 0; i < chunk_count; ++i)
+    {
+      if (i)
+        merge_chunk (&chunks[i]);
+
+      if (chunks[i].tmpldir) tmpldir = chunks[i].tmpldir;
+      if (chunks[i].htmldir) htmldir = chunks[i].htmldir;
+      if (chunks[i].dbdir)   dbdir = chunks[i].dbdir;
+      if (chunks[i].rundir)  rundir = chunks[i].rundir;
+      if (chunks[i].logdir)  logdir = chunks[i].logdir;
+    }
+
+  free (threads);
+  free (chunks);
 }
 
 int
@@ -661,10 +1459,348 @@ pmkdir (const char* path, int mode)
           return -1;
         }
 
-      *t++ = '/';
-    }
+      *t++ = '/';
+    }
+
+  return 0;
+}
+
+/* Ranks the curves of G by graph_order, and resolves the
+   `name=graph.field' aliases in it, so that process_graph() can sort the
+   curves and locate their RRD files without searching any strings.
+   Requires intern_graphs() to have run and graphs[] to be sorted.  */
+void
+resolve_graph_order (struct graph* g)
+{
+  struct order_entry* entries;
+  size_t i, length;
+  const char* ch;
+  char* target;
+  char* curve_name;
+  char* separator;
+  ssize_t eff_graph_index, name_id;
+
+  int curve_terminator;
+
+  if (cur_version < ver_1_3)
+    curve_terminator = '.';
+  else if (cur_version < ver_2_0)
+    curve_terminator = ';';
+  else
+    curve_terminator = ':';
+
+  if (!g->curve_count)
+    return;
+
+  if (!(entries = malloc (sizeof (*entries) * g->curve_count)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < g->curve_count; ++i)
+    {
+      struct curve* c = &g->curves[i];
+
+      c->alias_graph = 0;
+      c->alias = 0;
+      c->alias_missing = 0;
+
+      entries[i].position = SIZE_MAX;
+      entries[i].name = c->name;
+      entries[i].index = i;
+
+      if (!g->order || 0 == (ch = strword (g->order, c->name)))
+        continue;
+
+      entries[i].position = ch - g->order;
+
+      ch += strlen (c->name);
+
+      if (*ch != '=')
+        continue;
+
+      ++ch;
+      length = strcspn (ch, " ");
+
+      if (!(target = strndup (ch, length)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      c->alias_graph = g;
+      curve_name = target;
+
+      if (0 != (separator = strchr (target, curve_terminator)))
+        {
+          *separator = 0;
+          curve_name = separator + 1;
+
+          if (-1 == (name_id = intern_lookup (&graph_names, target))
+              || -1 == (eff_graph_index = find_graph_id (g->domain_id, g->host_id, name_id)))
+            c->alias_graph = 0;
+          else
+            c->alias_graph = &graphs[eff_graph_index];
+        }
+
+      if (c->alias_graph)
+        c->alias = find_curve (c->alias_graph, curve_name);
+
+      if (!c->alias)
+        {
+          c->alias_graph = 0;
+          c->alias_missing = 1;
+        }
+
+      free (target);
+    }
+
+  qsort (entries, g->curve_count, sizeof (*entries), order_entry_cmp);
+
+  for (i = 0; i < g->curve_count; ++i)
+    g->curves[entries[i].index].order_rank = i;
+
+  free (entries);
+}
+
+const struct period periods[] =
+{
+  { 0, "hour", 300, 3600 },
+  { 300, "day", 0, 0 },
+  { 1800, "week", 0, 0 },
+  { 7200, "month", 0, 0 },
+  { 86400, "year", 0, 0 }
+};
+
+const size_t period_count = sizeof (periods) / sizeof (periods[0]);
+
+/* Returns the length in seconds of the columns of period PERIOD, for a
+   graph WIDTH columns wide updated every UPDATE_RATE seconds, or zero if
+   the graph does not have that period.  The update rate only decides
+   whether the period is drawn; columns shorter than it repeat rows.  */
+size_t
+period_interval (size_t period, size_t update_rate, size_t width)
+{
+  const struct period* p = &periods[period];
+  size_t interval;
+
+  if (p->max_update_rate
+      && (!update_rate || update_rate >= p->max_update_rate))
+    return 0;
+
+  if (p->interval)
+    return p->interval;
+
+  interval = width ? p->span / width : p->span;
+
+  return interval ? interval : 1;
+}
+
+/* Returns the name of the RRD file holding the data of curve C in graph
+   G, allocated in ARENA.  Returns null if graph_order names a curve that
+   does not exist, or if the curve type is unknown.  */
+char*
+curve_rrd_path (const struct graph* g, const struct curve* c, struct arena* arena)
+{
+  int suffix;
+
+  if (c->alias_missing)
+    return 0;
+
+  if (c->alias)
+    {
+      g = c->alias_graph;
+      c = c->alias;
+    }
+
+  if (c->filename)
+    {
+      if (c->filename[0] == '/')
+        return arena_strdup (arena, c->filename);
+
+      return arena_printf (arena, "%s/%s", dbdir, c->filename);
+    }
+
+  if (!c->type || !strcasecmp (c->type, "gauge"))
+    suffix = 'g';
+  else if (!strcasecmp (c->type, "derive"))
+    suffix = 'd';
+  else if (!strcasecmp (c->type, "counter"))
+    suffix = 'c';
+  else if (!strcasecmp (c->type, "absolute"))
+    suffix = 'a';
+  else
+    return 0;
+
+  return arena_printf (arena, "%s%s-%s-%c.rrd", g->rrd_prefix, g->name_rrd_path, c->name, suffix);
+}
+
+/* Width of the plotted area, which is also the number of rows drawn */
+size_t
+plot_width (const struct graph* g)
+{
+  return g->width ? g->width : 400;
+}
+
+/* How a curve is drawn, from its draw attribute */
+enum draw_mode
+{
+  curve_line,
+  curve_area,
+  curve_stack,
+  curve_other
+};
+
+/* The parts of drawing a curve that are the same for every period */
+struct curve_plan
+{
+  enum draw_mode mode;
+
+  /* PLOT_WIDTH2 or PLOT_WIDTH3, for lines */
+  unsigned int flags;
+
+  uint32_t color;
+  const char* label;
+  size_t label_width;
+
+  /* The curve drawn upside down below this one.  NEGATIVE_MISSING is
+     set if the curve names one that does not exist.  */
+  const struct curve* negative;
+  int negative_missing;
+};
+
+/* The parts of drawing a graph that are the same for every period,
+   worked out by plan_graph() before the first period is drawn */
+struct render_plan
+{
+  struct curve_plan* curves;
+  size_t visible_count;
+  int has_negative;
+  int draw_min_max;
+
+  size_t graph_width, graph_height;
+  size_t canvas_width, canvas_height;
+
+  /* The vertical label, with ${graph_period} expanded */
+  const char* vlabel;
+  size_t vlabel_width;
+
+  /* Left edge and column width of the legend numbers.  The labels of
+     the curves only count towards the edge when the curves are plotted,
+     which is index 1.  */
+  size_t legend_x[2];
+  size_t column_width[2];
+};
+
+static void
+plan_graph (struct render_plan* plan, const struct graph* g, struct arena* arena)
+{
+  size_t curve, graph_index = 0, label_width = 0, total_width = 0;
+  char buf[256];
+
+  memset (plan, 0, sizeof (*plan));
+
+  plan->curves = arena_alloc (arena, sizeof (*plan->curves) * g->curve_count);
+  memset (plan->curves, 0, sizeof (*plan->curves) * g->curve_count);
+
+  for (curve = 0; curve < g->curve_count; ++curve)
+    {
+      const struct curve* c = &g->curves[curve];
+      struct curve_plan* cp = &plan->curves[curve];
+
+      if (!c->draw || !strcasecmp (c->draw, "line2"))
+        {
+          cp->mode = curve_line;
+          cp->flags = PLOT_WIDTH2;
+        }
+      else if (!strcasecmp (c->draw, "line1"))
+        cp->mode = curve_line;
+      else if (!strcasecmp (c->draw, "line3"))
+        {
+          cp->mode = curve_line;
+          cp->flags = PLOT_WIDTH3;
+        }
+      else if (!strcasecmp (c->draw, "area"))
+        cp->mode = curve_area;
+      else if (!strcasecmp (c->draw, "stack") || !strcasecmp (c->draw, "areastack"))
+        cp->mode = curve_stack;
+      else
+        cp->mode = curve_other;
+
+      if (c->negative)
+        {
+          plan->has_negative = 1;
+
+          if (!(cp->negative = find_curve (g, c->negative)))
+            cp->negative_missing = 1;
+        }
+
+      if (c->nograph)
+        continue;
+
+      if (c->has_color)
+        cp->color = c->color;
+      else
+        cp->color = colors[graph_index % (sizeof (colors) / sizeof (colors[0]))];
+
+      cp->label = c->label ? c->label : c->name;
+      cp->label_width = font_width (cp->label);
+
+      if (cp->label_width > label_width)
+        label_width = cp->label_width;
+
+      ++graph_index;
+    }
+
+  plan->visible_count = graph_index;
+  plan->draw_min_max = (plan->visible_count == 1 && plan->curves[0].mode == curve_line);
+
+  plan->graph_width = plot_width (g);
+  plan->graph_height = g->height ? g->height : 175;
+
+  plan->canvas_width = plan->graph_width + 95;
+  plan->canvas_height = plan->graph_height + 75 + plan->visible_count * LINE_HEIGHT;
+
+  if (g->total)
+    {
+      plan->canvas_height += LINE_HEIGHT;
+      total_width = font_width (g->total);
+
+      if (total_width > label_width)
+        label_width = total_width;
+    }
+
+  plan->legend_x[0] = 22 + total_width + 10;
+  plan->legend_x[1] = 22 + label_width + 10;
+  plan->column_width[0] = (plan->canvas_width - plan->legend_x[0] - 20) / 4;
+  plan->column_width[1] = (plan->canvas_width - plan->legend_x[1] - 20) / 4;
+
+  if (g->vlabel)
+    {
+      const char* i = g->vlabel;
+      char* o = buf;
+      char* o_end = buf + sizeof (buf) - 1;
+
+      while (*i && o != o_end)
+        {
+          if (*i == '$')
+            {
+              if (!strncmp (i, "${graph_period}", 15))
+                {
+                  if (o + 6 < o_end)
+                    {
+                      memcpy (o, "second", 7);
+                      o += 6;
+                    }
+                  i += 15;
+                }
+              else
+                *o++ = *i++;
+            }
+          else
+            *o++ = *i++;
+        }
+
+      *o = 0;
 
-  return 0;
+      plan->vlabel = arena_strdup (arena, buf);
+      plan->vlabel_width = font_width (buf);
+    }
 }
 
 void
@@ -673,33 +1809,36 @@ process_graph (size_t graph_index)
   struct graph* g = &graphs[graph_index];
   size_t curve;
   struct timeval graph_start, graph_end;
+  struct graph saved;
+  size_t* ranked;
+  size_t bytes_start, period, i;
+  struct curve_work** works;
   char *path;
 
-  int curve_terminator;
-
-  if (cur_version < ver_1_3)
-    curve_terminator = '.';
-  else if (cur_version < ver_2_0)
-    curve_terminator = ';';
-  else
-    curve_terminator = ':';
-
   if (g->nograph)
       return;
 
-  if (-1 == asprintf (&path, "%s/%s/", htmldir, g->domain))
-    err (EXIT_FAILURE, "asprintf failed");
+  path = arena_printf (&graph_arena, "%s/%s/", htmldir, g->domain);
 
   if (-1 == pmkdir (path, 0775))
     {
-      free (path);
+      arena_reset (&graph_arena);
 
       return;
     }
 
-  free(path);
+  /* Leave the parse-time curve table untouched, so that aliases resolved
+     by resolve_graph_order() keep pointing at the right curves, and build
+     the list of curves to draw in the render arena instead.  ORDER_RANK
+     is a permutation of the curve indices, so the surviving curves are
+     bucketed straight into graph_order without sorting.  */
+  saved = *g;
+  ranked = arena_alloc (&graph_arena, sizeof (*ranked) * saved.curve_count);
+  works = arena_alloc (&graph_arena, sizeof (*works) * saved.curve_count);
+  memset (ranked, 0, sizeof (*ranked) * saved.curve_count);
 
   gettimeofday (&graph_start, 0);
+  bytes_start = rrd_bytes_read;
 
   if (first_domain)
     {
@@ -707,77 +1846,65 @@ process_graph (size_t graph_index)
       first_domain = 0;
     }
 
-  for (curve = 0; curve < g->curve_count; )
+  for (curve = 0; curve < saved.curve_count; ++curve)
     {
-      struct curve* c = &g->curves[curve];
-
-      const struct graph* eff_g = g;
-      const struct curve* eff_c = c;
-      int suffix;
+      const struct curve* c = &saved.curves[curve];
+      struct curve_work* work = c->work;
 
-      if (g->order)
+      if (!work)
         {
-          const char* ch;
-          char* curve_name;
+          work = arena_alloc (&graph_arena, sizeof (*work));
+          memset (work, 0, sizeof (*work));
+        }
 
-          ch = strword (g->order, c->name);
+      if (c->alias_missing)
+        goto skip_data_source;
 
-          if (ch && ch[strlen (c->name)] == '=')
-            {
-              ch += strlen(c->name) + 1;
-              curve_name = alloca(strlen(ch) + 1);
-              strcpy(curve_name, ch);
+      if (!(work->path = curve_rrd_path (g, c, &graph_arena)))
+        errx (EXIT_FAILURE, "Unknown curve type '%s'", (c->alias ? c->alias : c)->type);
 
-              if (strchr (curve_name, ' '))
-                *strchr (curve_name, ' ') = 0;
+      /* Data loaded by caller.  Curves reading data sources of one file,
+         in this graph or in one drawn earlier, share its mapping through
+         rrd_open().  */
+      if (work->data.data
+          || 0 == rrd_open (&work->data, work->path))
+        {
+          const char* ds = (c->alias ? c->alias : c)->ds;
+          int ds_index = 0;
 
-              if (strchr (curve_name, curve_terminator))
-                {
-                  char* graph_name;
-                  ssize_t eff_graph_index;
+          if (ds && -1 == (ds_index = rrd_ds_index (&work->data, ds)))
+            {
+              if (debug)
+                fprintf (stderr, "Data source '%s' not found in %s\n", ds, work->path);
 
-                  graph_name = curve_name;
-                  curve_name = strchr (graph_name, curve_terminator);
-                  *curve_name++ = 0;
+              if (work->data.file_size)
+                rrd_close (&work->data);
 
-                  eff_graph_index = find_graph (g->domain, g->host, graph_name, 0);
+              memset (&work->data, 0, sizeof (work->data));
 
-                  if (eff_graph_index == -1)
-                    goto skip_data_source;
+              if (!c->cdef)
+                goto skip_data_source;
 
-                  eff_g = &graphs[eff_graph_index];
-                }
+              ranked[c->order_rank] = curve + 1;
+              works[c->order_rank] = work;
 
-              if (0 == (eff_c = find_curve (eff_g, curve_name)))
-                goto skip_data_source;
+              continue;
             }
-        }
 
-      if (!eff_c->type || !strcasecmp (eff_c->type, "gauge"))
-        suffix = 'g';
-      else if (!strcasecmp (eff_c->type, "derive"))
-        suffix = 'd';
-      else if (!strcasecmp (eff_c->type, "counter"))
-        suffix = 'c';
-      else if (!strcasecmp (eff_c->type, "absolute"))
-        suffix = 'a';
-      else
-        errx (EXIT_FAILURE, "Unknown curve type '%s'", eff_c->type);
+          work->ds = ds_index;
 
-      if (-1 == asprintf (&c->path, "%s/%s/%s-%s-%s-%c.rrd", dbdir, eff_g->domain, eff_g->host, eff_g->name_rrd_path, eff_c->name, suffix))
-        errx (EXIT_FAILURE, "asprintf failed while building RRD path: %s", strerror (errno));
+          for (i = 0; i < 3; ++i)
+            work->window[i] = arena_alloc (&graph_arena, sizeof (double) * plot_width (g));
 
-      /* Data loaded by caller */
-      if (c->data.data)
-        {
-          ++curve;
+          ranked[c->order_rank] = curve + 1;
+          works[c->order_rank] = work;
 
           continue;
         }
-
-      if (0 == rrd_parse (&c->data, c->path) || c->cdef)
+      else if (c->cdef)
         {
-          ++curve;
+          ranked[c->order_rank] = curve + 1;
+          works[c->order_rank] = work;
 
           continue;
         }
@@ -785,25 +1912,39 @@ process_graph (size_t graph_index)
 skip_data_source:
 
       if (debug)
-        fprintf (stderr, "Skipping data source %s.%s.%s.%s (%s)\n", g->domain, g->host, g->name, c->name, c->path);
+        fprintf (stderr, "Skipping data source %s.%s.%s.%s (%s)\n", g->domain, g->host, g->name, c->name, work->path);
+    }
 
-      free (c->path);
+  g->curves = arena_alloc (&graph_arena, sizeof (struct curve) * saved.curve_count);
+  g->curve_alloc = saved.curve_count;
+  g->curve_count = 0;
+  g->curve_hash = 0;
+  g->curve_hash_size = 0;
+  g->curve_hash_count = 0;
 
-      --g->curve_count;
-      memmove (&g->curves[curve], &g->curves[curve + 1], sizeof (struct curve) * (g->curve_count - curve));
+  for (curve = 0; curve < saved.curve_count; ++curve)
+    {
+      if (!ranked[curve])
+        continue;
 
-      continue;
+      g->curves[g->curve_count] = saved.curves[ranked[curve] - 1];
+      g->curves[g->curve_count++].work = works[curve];
     }
 
   if (g->curve_count)
     {
-      graph_order = g->order;
-      qsort (g->curves, g->curve_count, sizeof (struct curve), curve_name_cmp);
+      struct render_plan plan;
+
+      curve_hash_rebuild (g);
+      plan_graph (&plan, g, &graph_arena);
+
+      for (period = 0; period < period_count; ++period)
+        {
+          size_t interval;
 
-      do_graph (g, 300, "day");
-      do_graph (g, 1800, "week");
-      do_graph (g, 7200, "month");
-      do_graph (g, 86400, "year");
+          if ((interval = period_interval (period, g->update_rate, plan.graph_width)))
+            do_graph (g, &plan, interval, periods[period].name);
+        }
 
       if (stats)
         {
@@ -811,9 +1952,11 @@ skip_data_source:
 
           fprintf (stats, "GS|%s|%s|%s|%.3f\n", g->domain, g->host, g->name,
                   graph_end.tv_sec - graph_start.tv_sec + (graph_end.tv_usec - graph_start.tv_usec) * 1.0e-6);
+          fprintf (stats, "GI|%s|%s|%s|%zu\n", g->domain, g->host, g->name,
+                   rrd_bytes_read - bytes_start);
 
           if (graph_index + 1 == graph_count
-             || strcmp (graphs[graph_index + 1].domain, graphs[graph_index].domain))
+             || graphs[graph_index + 1].domain_id != graphs[graph_index].domain_id)
             {
               domain_end = graph_end;
 
@@ -826,126 +1969,299 @@ skip_data_source:
 
       for (curve = 0; curve < g->curve_count; ++curve)
         {
-          if (g->curves[curve].data.file_size)
-            rrd_free (&g->curves[curve].data);
+          if (g->curves[curve].work->data.file_size)
+            rrd_close (&g->curves[curve].work->data);
+
+          free (g->curves[curve].work->script.tokens);
+
+          for (i = 0; i < 3; ++i)
+            rrd_iterator_free (&g->curves[curve].work->iterator[i]);
+        }
+    }
+
+  free (g->curve_hash);
+  *g = saved;
+
+  arena_reset (&graph_arena);
+}
+
+/* Returns the row, counted from the top, where VALUE is drawn in a plot
+   HEIGHT pixels high spanning GLOBAL_MIN to GLOBAL_MAX.  Truncate to get
+   the pixel.  */
+static double
+value_row (double value, double global_min, double global_max, size_t height)
+{
+  return height - (value - global_min) * (height - 1) / (global_max - global_min) - 1;
+}
+
+/* Stores the pixel rows of the first COUNT VALUES in ROWS, negating the
+   values first if NEGATE is set.  Rows are clamped to the range of
+   int16_t, which keeps rows outside the canvas outside it, and unknown
+   values get ROW_UNKNOWN.  The arithmetic is that of value_row(), so the
+   rows match it exactly.  */
+void
+value_rows (const double* values, size_t count, int negate,
+            double global_min, double global_max, size_t height,
+            int16_t* rows)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128d sign = _mm_set1_pd (negate ? -0.0 : 0.0);
+  const __m128d min = _mm_set1_pd (global_min);
+  const __m128d span = _mm_set1_pd (global_max - global_min);
+  const __m128d scale = _mm_set1_pd (height - 1);
+  const __m128d top = _mm_set1_pd (height);
+  const __m128d one = _mm_set1_pd (1.0);
+  const __m128d lowest = _mm_set1_pd (-32767.0), highest = _mm_set1_pd (32767.0);
+  const __m128d unknown = _mm_set1_pd (ROW_UNKNOWN);
+
+  for (; i + 2 <= count; i += 2)
+    {
+      __m128d value = _mm_xor_pd (_mm_loadu_pd (values + i), sign);
+      __m128d known = _mm_cmpord_pd (value, value);
+      __m128d row;
+      int32_t pair;
+
+      row = _mm_div_pd (_mm_mul_pd (_mm_sub_pd (value, min), scale), span);
+      row = _mm_sub_pd (_mm_sub_pd (top, row), one);
 
-          free (g->curves[curve].work.script.tokens);
-          free (g->curves[curve].path);
+      /* Rows that are NaN, from an empty span, end up off the canvas */
+      row = _mm_min_pd (_mm_max_pd (row, lowest), highest);
+      row = _mm_or_pd (_mm_and_pd (known, row), _mm_andnot_pd (known, unknown));
+
+      pair = _mm_cvtsi128_si32 (_mm_packs_epi32 (_mm_cvttpd_epi32 (row), _mm_setzero_si128 ()));
+      memcpy (rows + i, &pair, sizeof (pair));
+    }
+#endif
+
+  for (; i < count; ++i)
+    {
+      double value = negate ? -values[i] : values[i];
+      double row = value_row (value, global_min, global_max, height);
+
+      if (isnan (value))
+        rows[i] = ROW_UNKNOWN;
+      else
+        {
+          row = (row > -32767.0) ? row : -32767.0;
+          rows[i] = (row < 32767.0) ? row : 32767.0;
         }
     }
 }
 
 void
 plot_gauge (struct canvas* canvas,
-           struct rrd_iterator* iterator,
+           const double* values, size_t count,
            size_t graph_x, size_t graph_y,
            size_t width, size_t height,
            double global_min, double global_max, size_t ds,
            uint32_t color, unsigned int flags)
 {
-  int x = 0, y, prev_y = -1;
-  size_t i;
-
-  for (i = 0; i < iterator->count && x < width; ++i, ++x)
-    {
-      double value = rrd_iterator_peek (iterator);
-      rrd_iterator_advance (iterator);
+  struct rrd_run* runs;
+  size_t run, run_count;
+  int16_t* rows;
+  int x, y, prev_y;
 
-      if (isnan (value))
-        {
-          prev_y = -1;
+  if (count > width)
+    count = width;
 
-          continue;
-        }
+  runs = alloca (sizeof (*runs) * (count / 2 + 1));
+  run_count = rrd_known_runs (values, values, count, runs);
 
-      if (flags & PLOT_NEGATIVE)
-        value = -value;
+  rows = alloca (sizeof (*rows) * count);
+  value_rows (values, count, flags & PLOT_NEGATIVE, global_min, global_max, height, rows);
 
-      y = height
-        - (value - global_min) * (height - 1) / (global_max - global_min)
-        - 1;
+  for (run = 0; run < run_count; ++run)
+    {
+      prev_y = -1;
 
-      if (prev_y != -1)
+      for (x = runs[run].begin; x < runs[run].end; ++x)
         {
-          if (flags & PLOT_WIDTH3)
-            draw_line2 (canvas, graph_x + x - 1, graph_y + prev_y, graph_x + x, graph_y + y, color);
+          y = rows[x];
+
+          if (prev_y != -1)
+            {
+              if (flags & PLOT_WIDTH3)
+                draw_line2 (canvas, graph_x + x - 1, graph_y + prev_y, graph_x + x, graph_y + y, color);
+              else
+                draw_line (canvas, graph_x + x - 1, graph_y + prev_y, graph_x + x, graph_y + y, color);
+            }
           else
-            draw_line (canvas, graph_x + x - 1, graph_y + prev_y, graph_x + x, graph_y + y, color);
-        }
-      else
-        {
-          draw_pixel (canvas, graph_y + y, graph_x + x, color);
+            {
+              draw_pixel (canvas, graph_y + y, graph_x + x, color);
 
-          if (flags & PLOT_WIDTH3)
-            draw_pixel (canvas, graph_y + y, graph_x + x, color);
-        }
+              if (flags & PLOT_WIDTH3)
+                draw_pixel (canvas, graph_y + y, graph_x + x, color);
+            }
 
-      prev_y = y;
+          prev_y = y;
+        }
     }
 }
 
 void
 plot_min_max (struct canvas* canvas,
-             struct rrd_iterator* mins,
-             struct rrd_iterator* maxs,
+             const double* mins, const double* maxs, size_t count,
              size_t graph_x, size_t graph_y,
              size_t width, size_t height,
              double global_min, double global_max, size_t ds,
              uint32_t color, unsigned int flags)
 {
-  size_t i, x = 0;
-
-  for (i = 0; i < mins->count && i < maxs->count && x < width; ++i, ++x)
-    {
-      double min_value = rrd_iterator_peek (mins);
-      double max_value = rrd_iterator_peek (maxs);
-      rrd_iterator_advance (mins);
-      rrd_iterator_advance (maxs);
+  struct rrd_run* runs;
+  size_t run, run_count, x;
+  int16_t* min_rows;
+  int16_t* max_rows;
 
-      if (isnan (min_value) || isnan (max_value))
-        continue;
+  if (count > width)
+    count = width;
 
-      if (flags & PLOT_NEGATIVE)
-        {
-          min_value = -min_value;
-          max_value = -max_value;
-        }
+  runs = alloca (sizeof (*runs) * (count / 2 + 1));
+  run_count = rrd_known_runs (mins, maxs, count, runs);
 
-      size_t y0 = height - (min_value - global_min) * (height - 1) / (global_max - global_min) - 1;
-      size_t y1 = height - (max_value - global_min) * (height - 1) / (global_max - global_min) - 1;
+  min_rows = alloca (sizeof (*min_rows) * count);
+  max_rows = alloca (sizeof (*max_rows) * count);
+  value_rows (mins, count, flags & PLOT_NEGATIVE, global_min, global_max, height, min_rows);
+  value_rows (maxs, count, flags & PLOT_NEGATIVE, global_min, global_max, height, max_rows);
 
-      draw_vline (canvas, graph_x + x, graph_y + y0, graph_y + y1, color);
+  for (run = 0; run < run_count; ++run)
+    {
+      for (x = runs[run].begin; x < runs[run].end; ++x)
+        draw_vline (canvas, graph_x + x, graph_y + min_rows[x], graph_y + max_rows[x], color);
     }
 }
 
 void
 plot_area (struct canvas* canvas,
-          struct rrd_iterator* iterator, double* maxs,
+          const double* values, size_t count, double* maxs,
           size_t graph_x, size_t graph_y,
           size_t width, size_t height,
           double global_min, double global_max, size_t ds,
           uint32_t color)
 {
-  int x = 0, y0, y1;
-  size_t i;
+  struct rrd_run* runs;
+  size_t run, run_count;
+  int16_t* base_rows;
+  int16_t* top_rows;
+  int x;
+
+  if (count > width)
+    count = width;
+
+  runs = alloca (sizeof (*runs) * (count / 2 + 1));
+  run_count = rrd_known_runs (values, values, count, runs);
+
+  /* The area of each sample spans from the level of the areas below it
+     to that level plus the sample */
+  base_rows = alloca (sizeof (*base_rows) * count);
+  top_rows = alloca (sizeof (*top_rows) * count);
+  value_rows (maxs, count, 0, global_min, global_max, height, base_rows);
+
+  for (run = 0; run < run_count; ++run)
+    {
+      for (x = runs[run].begin; x < runs[run].end; ++x)
+        {
+          if (values[x] > 0)
+            maxs[x] += values[x];
+        }
+    }
+
+  value_rows (maxs, count, 0, global_min, global_max, height, top_rows);
+
+  for (run = 0; run < run_count; ++run)
+    {
+      for (x = runs[run].begin; x < runs[run].end; ++x)
+        {
+          if (values[x] <= 0)
+            continue;
+
+          draw_vline (canvas, graph_x + x, graph_y + base_rows[x], graph_y + top_rows[x], color);
+        }
+    }
+}
+
+/* Number of values of ITERATOR drawn in a plot WIDTH pixels wide */
+static size_t
+window_size (const struct rrd_iterator* iterator, size_t width)
+{
+  return (iterator->count < width) ? iterator->count : width;
+}
+
+/* Copies the stored values drawn by every curve of G into the curve's
+   windows, so that the plotting loops need not wrap around the archive
+   for every sample.  The data sources of curves sharing a file are
+   gathered together, in one pass over its rows.  */
+static void
+gather_windows (struct graph* g, size_t width)
+{
+  size_t curve, other, i, column_count;
+  size_t* columns;
+  double** results;
+  struct curve_work** group;
 
-  for (i = 0; i < iterator->count && x < width; ++i, ++x)
+  columns = alloca (sizeof (*columns) * g->curve_count);
+  results = alloca (sizeof (*results) * g->curve_count);
+  group = alloca (sizeof (*group) * g->curve_count);
+
+  for (curve = 0; curve < g->curve_count; ++curve)
     {
-      double value = rrd_iterator_peek (iterator);
-      rrd_iterator_advance (iterator);
+      struct curve_work* work = g->curves[curve].work;
 
-      if (isnan (value) || value <= 0)
+      if (!work->data.header.ds_count || work->window_count[average])
         continue;
 
-      y0 = height - (maxs[x] - global_min) * (height - 1) / (global_max - global_min) - 1;
-      y1 = height - ((value + maxs[x]) - global_min) * (height - 1) / (global_max - global_min) - 1;
+      column_count = 0;
+
+      for (other = curve; other < g->curve_count; ++other)
+        {
+          struct curve_work* other_work = g->curves[other].work;
+
+          if (other_work->data.data != work->data.data
+              || !other_work->data.header.ds_count)
+            continue;
+
+          group[column_count] = other_work;
+          columns[column_count++] = other_work->ds;
+        }
+
+      for (i = 0; i < 3; ++i)
+        {
+          const struct rrd_iterator* iterator = &work->iterator[i];
+          size_t count, j;
+
+          count = window_size (iterator, width);
 
-      draw_vline (canvas, graph_x + x, graph_y + y0, graph_y + y1, color);
+          for (j = 0; j < column_count; ++j)
+            {
+              results[j] = group[j]->window[i];
+              group[j]->window_count[i] = count;
+            }
 
-      maxs[x] += value;
+          rrd_iterator_gather_columns (iterator, iterator->current_position,
+                                       iterator->current_position + count,
+                                       columns, results, column_count);
+        }
     }
 }
 
+/* Returns the first COUNT values drawn from iterator NAME of WORK, read
+   from its window if the iterator has stored values, and otherwise
+   evaluated into SCRATCH.  */
+static const double*
+window_values (const struct curve_work* work, enum iterator_name name,
+               size_t count, double* scratch)
+{
+  const struct rrd_iterator* iterator = &work->eff_iterator[name];
+
+  if (!iterator->generator && count <= work->window_count[name])
+    return work->window[name];
+
+  rrd_iterator_gather (iterator, iterator->current_position,
+                       iterator->current_position + count, scratch);
+
+  return scratch;
+}
+
 double
 calc_step_size (double range, size_t graph_height)
 {
@@ -1106,18 +2422,22 @@ find_curve_global (const struct graph** g, const struct curve** c, const char* g
 const struct curve*
 find_curve (const struct graph* g, const char* name)
 {
-  const char *basename, *ch;
-  size_t i;
+  const size_t* base_hash;
+  size_t slot, mask;
 
-  for (i = 0; i < g->curve_count; ++i)
-    {
-      basename = g->curves[i].name;
+  /* The curve array was modified since the index was built */
+  if (!g->curve_hash || g->curve_hash_count != g->curve_count)
+    curve_hash_rebuild ((struct graph*) g);
 
-      while (0 != (ch = strchr (basename, '.')))
-	basename = ch + 1;
+  mask = g->curve_hash_size - 1;
+  base_hash = g->curve_hash + g->curve_hash_size;
+
+  for (slot = curve_hash_key (name) & mask; base_hash[slot]; slot = (slot + 1) & mask)
+    {
+      const struct curve* c = &g->curves[base_hash[slot] - 1];
 
-      if (!strcmp (basename, name))
-	return &g->curves[i];
+      if (!strcmp (c->basename, name))
+	return c;
     }
 
   return 0;
@@ -1175,7 +2495,7 @@ draw_grid (struct graph* g, struct canvas* canvas,
 
   for (j = global_min / step_size; j <= global_max / step_size; ++j)
     {
-      y = graph_height - (j * step_size - global_min) * (graph_height - 1) / (global_max - global_min) - 1;
+      y = value_row (j * step_size, global_min, global_max, graph_height);
 
       sprintf (buf, format, (j * step_size) * scale, suffix);
 
@@ -1238,30 +2558,24 @@ draw_grid (struct graph* g, struct canvas* canvas,
 }
 
 static void
-do_graph (struct graph* g, size_t interval, const char* suffix)
+do_graph (struct graph* g, const struct render_plan* plan, size_t interval, const char* suffix)
 {
   size_t x, y, width;
   time_t last_update = 0;
   size_t i, curve, ds = 0;
 
-  const char *png_path_format;
   char* png_path;
 
   struct stat png_stat;
 
-  if (cur_version < ver_1_3)
-    png_path_format = "%s/%s/%s-%s-%s.png";
-  else
-    png_path_format = "%s/%s/%s/%s-%s.png";
-
-  if (-1 == asprintf (&png_path, png_path_format, htmldir, g->domain, g->host, g->name_png_path, suffix))
+  if (-1 == asprintf (&png_path, "%s%s-%s.png", g->png_prefix, g->name_png_path, suffix))
     err (EX_OSERR, "asprintf failed");
 
   if (!nolazy && interval > 300 && 0 == stat (png_path, &png_stat))
     {
       for (curve = 0; curve < g->curve_count; ++curve)
         {
-          if (g->curves[curve].data.live_header.last_up / interval != png_stat.st_mtime / interval)
+          if (g->curves[curve].work->data.live_header.last_up / interval != png_stat.st_mtime / interval)
             break;
         }
 
@@ -1274,51 +2588,63 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
     }
 
 
-  int has_negative = 0, draw_min_max = 0;
+  int draw_min_max = plan->draw_min_max;
 
-  size_t graph_width, graph_height;
+  size_t graph_width = plan->graph_width, graph_height = plan->graph_height;
   size_t graph_x = 60, graph_y = 30;
 
-  graph_width = g->width ? g->width : 400;
-  graph_height = g->height ? g->height : 175;
-
   double global_min = 0, global_max = 0;
   double* maxs = alloca (sizeof (double) * graph_width);
   memset (maxs, 0, sizeof (double) * graph_width);
 
-  size_t visible_graph_count = 0;
+  double* scratch[3];
+  const double* values[3];
+  size_t count;
+
+  struct rrd_summary summary;
+
+  for (i = 0; i < 3; ++i)
+    scratch[i] = alloca (sizeof (double) * graph_width);
 
   for (curve = 0; curve < g->curve_count; ++curve)
     {
       struct curve* c = &g->curves[curve];
 
-      memset (&c->work, 0, sizeof (c->work));
+      /* Reset everything but the path and the RRD data */
+      free (c->work->script.tokens);
 
-      if (c->data.header.ds_count)
+      for (i = 0; i < 3; ++i)
+        rrd_iterator_free (&c->work->iterator[i]);
+
+      memset (&c->work->script, 0, sizeof (*c->work) - offsetof (struct curve_work, script));
+
+      if (c->work->data.header.ds_count)
         {
-          if (-1 == rrd_iterator_create (&c->work.iterator[average], &c->data, "AVERAGE", interval, graph_width)
-             || -1 == rrd_iterator_create (&c->work.iterator[min],   &c->data, "MIN",     interval, graph_width)
-             || -1 == rrd_iterator_create (&c->work.iterator[max],   &c->data, "MAX",     interval, graph_width))
-            errx (EXIT_FAILURE, "Did not find all required round robin archives in '%s'", c->path);
+          if (-1 == rrd_iterator_create (&c->work->iterator[average], &c->work->data, "AVERAGE", interval, graph_width, c->work->ds)
+             || -1 == rrd_iterator_create (&c->work->iterator[min],   &c->work->data, "MIN",     interval, graph_width, c->work->ds)
+             || -1 == rrd_iterator_create (&c->work->iterator[max],   &c->work->data, "MAX",     interval, graph_width, c->work->ds))
+            {
+              fprintf (stderr, "Did not find all required round robin archives in '%s'\n", c->work->path);
+              free (png_path);
+
+              return;
+            }
         }
     }
 
+  gather_windows (g, graph_width);
+
   for (curve = 0; curve < g->curve_count; ++curve)
     {
       struct curve* c = &g->curves[curve];
-      int area = 0, first = 1;
+      int area = 0;
 
-      struct rrd_iterator iterator_average;
-      struct rrd_iterator iterator_min;
-      struct rrd_iterator iterator_max;
-      size_t avg_count = 0;
-
-      if (c->data.live_header.last_up > last_update)
-        last_update = c->data.live_header.last_up;
+      if (c->work->data.live_header.last_up > last_update)
+        last_update = c->work->data.live_header.last_up;
 
       if (c->cdef)
         {
-          if (-1 == cdef_compile (&c->work.script, g, c->cdef))
+          if (-1 == cdef_compile (&c->work->script, g, c->cdef))
             {
               free (png_path);
 
@@ -1326,109 +2652,48 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
             }
 
           for (i = 0; i < 3; ++i)
-            cdef_create_iterator (&c->work.eff_iterator[i], g, c, i, graph_width);
+            cdef_create_iterator (&c->work->eff_iterator[i], g, c, i, graph_width);
         }
       else
         {
           for (i = 0; i < 3; ++i)
-            c->work.eff_iterator[i] = c->work.iterator[i];
+            c->work->eff_iterator[i] = c->work->iterator[i];
         }
 
-      if (!c->nograph && c->draw)
+      if (!c->nograph)
         {
-          if (!strcasecmp (c->draw, "area"))
+          if (plan->curves[curve].mode == curve_area)
             {
               memset (maxs, 0, sizeof (double) * graph_width);
               area = 1;
             }
-          else if (!strcasecmp (c->draw, "stack") || !strcasecmp (c->draw, "areastack"))
+          else if (plan->curves[curve].mode == curve_stack)
             area = 1;
         }
 
-      iterator_average = c->work.eff_iterator[average];
-      iterator_min = c->work.eff_iterator[min];
-      iterator_max = c->work.eff_iterator[max];
-
-      c->work.cur = rrd_iterator_last (&iterator_average);
-      c->work.max_avg = 0.0;
-      c->work.min_avg = 0.0;
-      c->work.min = 0.0;
-      c->work.max = 0.0;
-      c->work.avg = 0.0;
-
-      for (i = 0, x = 0; i < iterator_average.count && x < graph_width; ++i, ++x)
-        {
-          double avg_value = rrd_iterator_peek (&iterator_average);
-          double min_value = rrd_iterator_peek (&iterator_min);
-          double max_value = rrd_iterator_peek (&iterator_max);
-
-          rrd_iterator_advance (&iterator_average);
-          rrd_iterator_advance (&iterator_min);
-          rrd_iterator_advance (&iterator_max);
-
-          if (!isnan (avg_value))
-            {
-              if (area)
-                {
-                  if (avg_value > 0)
-                    maxs[x] += avg_value;
-
-                  if (maxs[x] > global_max)
-                    global_max = maxs[x];
-                }
-
-              c->work.avg += avg_value;
-              ++avg_count;
-
-              if (first)
-                {
-                  c->work.max_avg = avg_value;
-                  c->work.min_avg = avg_value;
-                  c->work.min = avg_value;
-                  first = 0;
-                }
-              else
-                {
-                  if (avg_value > c->work.max_avg)
-                    c->work.max_avg = avg_value;
-                  else if (avg_value < c->work.min_avg)
-                    c->work.min_avg = avg_value;
-                }
-            }
-
-          if (!isnan (max_value) && max_value > c->work.max)
-            c->work.max = max_value;
+      c->work->cur = rrd_iterator_last (&c->work->eff_iterator[average]);
 
-          if (!isnan (min_value) && min_value < c->work.min)
-            c->work.min = min_value;
-        }
+      count = window_size (&c->work->eff_iterator[average], graph_width);
 
-      if (avg_count)
-        c->work.avg /= avg_count;
+      for (i = 0; i < 3; ++i)
+        values[i] = window_values (c->work, i, count, scratch[i]);
 
-      if (!c->nograph)
-        ++visible_graph_count;
+      rrd_summarize (values[average], values[min], values[max], count,
+                     area ? maxs : 0, &global_max, &summary);
 
-      if (c->negative)
-        {
-          has_negative = 1;
+      c->work->max_avg = summary.avg_max;
+      c->work->min_avg = summary.avg_min;
+      c->work->min = summary.min;
+      c->work->max = summary.max;
+      c->work->avg = summary.avg_count ? summary.avg_sum / summary.avg_count : 0.0;
+      c->work->unknown = !summary.known;
 
-          c->work.negative = find_curve (g, c->negative);
+      if (plan->curves[curve].negative_missing)
+        errx (EXIT_FAILURE, "Negative '%s' for '%s' not found", c->negative, c->name);
 
-          if (!c->work.negative)
-            errx (EXIT_FAILURE, "Negative '%s' for '%s' not found", c->negative, c->name);
-        }
-      else
-        c->work.negative = 0;
+      c->work->negative = plan->curves[curve].negative;
     }
 
-  if (visible_graph_count == 1
-     && (!g->curves[0].draw
-         || !strcasecmp (g->curves[0].draw, "line1")
-         || !strcasecmp (g->curves[0].draw, "line2")
-         || !strcasecmp (g->curves[0].draw, "line3")))
-    draw_min_max = 1;
-
   for (curve = 0; curve < g->curve_count; ++curve)
     {
       struct curve* c = &g->curves[curve];
@@ -1438,36 +2703,36 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
 
       if (draw_min_max)
         {
-          if (c->work.max > global_max)
-            global_max = c->work.max;
+          if (c->work->max > global_max)
+            global_max = c->work->max;
 
-          if (c->work.min < global_min)
-            global_min = c->work.min;
+          if (c->work->min < global_min)
+            global_min = c->work->min;
 
-          if (c->work.negative)
+          if (c->work->negative)
             {
-              if (-c->work.negative->work.max < global_min)
-                global_min = -c->work.negative->work.max;
+              if (-c->work->negative->work->max < global_min)
+                global_min = -c->work->negative->work->max;
 
-              if (-c->work.negative->work.min > global_max)
-                global_max = -c->work.negative->work.min;
+              if (-c->work->negative->work->min > global_max)
+                global_max = -c->work->negative->work->min;
             }
         }
       else
         {
-          if (c->work.max_avg > global_max)
-            global_max = c->work.max_avg;
+          if (c->work->max_avg > global_max)
+            global_max = c->work->max_avg;
 
-          if (c->work.min_avg < global_min)
-            global_min = c->work.min_avg;
+          if (c->work->min_avg < global_min)
+            global_min = c->work->min_avg;
 
           if (c->negative)
             {
-              if (-c->work.negative->work.max_avg < global_min)
-                global_min = -c->work.negative->work.max_avg;
+              if (-c->work->negative->work->max_avg < global_min)
+                global_min = -c->work->negative->work->max_avg;
 
-              if (-c->work.negative->work.min_avg > global_max)
-                global_max = -c->work.negative->work.min_avg;
+              if (-c->work->negative->work->min_avg > global_max)
+                global_max = -c->work->negative->work->min_avg;
             }
         }
     }
@@ -1482,11 +2747,8 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
   if (graph_width > MAX_DIM || graph_height > MAX_DIM)
     errx (EXIT_FAILURE, "Graph dimensions %zux%zu are too big", graph_width, graph_height);
 
-  canvas.width = graph_width + 95;
-  canvas.height = graph_height + 75 + visible_graph_count * LINE_HEIGHT;
-
-  if (g->total)
-    canvas.height += LINE_HEIGHT;
+  canvas.width = plan->canvas_width;
+  canvas.height = plan->canvas_height;
 
   canvas.data = malloc (3 * canvas.width * canvas.height);
   memset (canvas.data, 0xcc, 3 * canvas.width);
@@ -1508,41 +2770,12 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
 
   font_draw (&canvas, canvas.width - 15, 5, "Munin Hardcore/Morten Hustveit", 1, 0xc0);
 
-  if (g->vlabel)
-    {
-      const char* i = g->vlabel;
-      char* o = buf;
-      char* o_end = buf + sizeof (buf) - 1;
-
-      while (*i && o != o_end)
-        {
-          if (*i == '$')
-            {
-              if (!strncmp (i, "${graph_period}", 15))
-                {
-                  if (o + 6 < o_end)
-                    {
-                      memcpy (o, "second", 7);
-                      o += 6;
-                    }
-                  i += 15;
-                }
-              else
-                *o++ = *i++;
-            }
-          else
-            *o++ = *i++;
-        }
-
-      *o = 0;
-
-      width = font_width (buf);
-      font_draw (&canvas, 14, graph_y + graph_height / 2 + width / 2, buf, 2, 0x00);
-    }
+  if (plan->vlabel)
+    font_draw (&canvas, 14, graph_y + graph_height / 2 + plan->vlabel_width / 2, plan->vlabel, 2, 0x00);
 
-  size_t max_label_width = 0;
+  int plotted = (global_min != global_max);
 
-  if (global_min != global_max)
+  if (plotted)
     {
       int pass;
 
@@ -1550,8 +2783,6 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
 
       for (pass = 0; pass < 2; ++pass)
         {
-          size_t graph_index = 0;
-
           y = graph_y + graph_height + 20 + LINE_HEIGHT;
 
           if (pass == 1)
@@ -1559,95 +2790,99 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
 
           for (curve = 0; curve < g->curve_count; ++curve)
             {
-              struct rrd_iterator iterator_average;
-              struct rrd_iterator iterator_min;
-              struct rrd_iterator iterator_max;
-
               struct curve* c = &g->curves[curve];
-              uint32_t color;
+              const struct curve_plan* cp = &plan->curves[curve];
+              uint32_t color = cp->color;
 
               if (c->nograph)
                 continue;
 
-              const char* label = c->label ? c->label : c->name;
-              size_t label_width = font_width (label);
-
-              if (label_width > max_label_width)
-                max_label_width = label_width;
-
-              if (c->has_color)
-                color = c->color;
-              else
-                color = colors[graph_index % (sizeof (colors) / sizeof (colors[0]))];
-
-              iterator_average = c->work.eff_iterator[average];
-
-              if (!c->draw
-                  || !strcasecmp (c->draw, "line1")
-                  || !strcasecmp (c->draw, "line2")
-                  || !strcasecmp (c->draw, "line3"))
+              if (cp->mode == curve_line)
                 {
-                  int flags = 0;
-
-                  if (!c->draw || !strcasecmp (c->draw, "line2"))
-                    flags |= PLOT_WIDTH2;
-                  else if (!strcasecmp (c->draw, "line3"))
-                    flags |= PLOT_WIDTH3;
+                  int flags = cp->flags;
 
                   if (draw_min_max)
                     {
-                      if (pass == 0)
+                      if (pass == 0 && !c->work->unknown)
+                        {
+                          count = window_size (&c->work->eff_iterator[min], graph_width);
+                          count = window_size (&c->work->eff_iterator[max], count);
+                          values[min] = window_values (c->work, min, count, scratch[min]);
+                          values[max] = window_values (c->work, max, count, scratch[max]);
+
+                          plot_min_max (&canvas, values[min], values[max], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, flags);
+                        }
+                      else if (pass == 1 && !c->work->unknown)
                         {
-                          iterator_min = c->work.eff_iterator[min];
-                          iterator_max = c->work.eff_iterator[max];
+                          count = window_size (&c->work->eff_iterator[average], graph_width);
+                          values[average] = window_values (c->work, average, count, scratch[average]);
 
-                          plot_min_max (&canvas, &iterator_min, &iterator_max, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, flags);
+                          plot_gauge (&canvas, values[average], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, (color >> 1) & 0x7f7f7f, flags);
                         }
-                      else
-                        plot_gauge (&canvas, &iterator_average, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, (color >> 1) & 0x7f7f7f, flags);
 
-                      if (c->work.negative)
+                      if (c->work->negative && !c->work->negative->work->unknown)
                         {
                           if (pass == 0)
                             {
-                              iterator_min = c->work.negative->work.eff_iterator[min];
-                              iterator_max = c->work.negative->work.eff_iterator[max];
+                              count = window_size (&c->work->negative->work->eff_iterator[min], graph_width);
+                              count = window_size (&c->work->negative->work->eff_iterator[max], count);
+                              values[min] = window_values (c->work->negative->work, min, count, scratch[min]);
+                              values[max] = window_values (c->work->negative->work, max, count, scratch[max]);
 
-                              plot_min_max (&canvas, &iterator_min, &iterator_max, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, PLOT_NEGATIVE | flags);
+                              plot_min_max (&canvas, values[min], values[max], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, PLOT_NEGATIVE | flags);
                             }
                           else
                             {
-                              iterator_average = c->work.negative->work.eff_iterator[average];
+                              count = window_size (&c->work->negative->work->eff_iterator[average], graph_width);
+                              values[average] = window_values (c->work->negative->work, average, count, scratch[average]);
 
-                              plot_gauge (&canvas, &iterator_average, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, (color >> 1) & 0x7f7f7f, PLOT_NEGATIVE | flags);
+                              plot_gauge (&canvas, values[average], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, (color >> 1) & 0x7f7f7f, PLOT_NEGATIVE | flags);
                             }
                         }
                     }
                   else if (pass == 1)
                     {
-                      plot_gauge (&canvas, &iterator_average, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, 0);
+                      if (!c->work->unknown)
+                        {
+                          count = window_size (&c->work->eff_iterator[average], graph_width);
+                          values[average] = window_values (c->work, average, count, scratch[average]);
+
+                          plot_gauge (&canvas, values[average], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, 0);
+                        }
 
-                      if (c->work.negative)
+                      if (c->work->negative && !c->work->negative->work->unknown)
                         {
-                          iterator_average = c->work.negative->work.eff_iterator[average];
+                          count = window_size (&c->work->negative->work->eff_iterator[average], graph_width);
+                          values[average] = window_values (c->work->negative->work, average, count, scratch[average]);
 
-                          plot_gauge (&canvas, &iterator_average, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, PLOT_NEGATIVE);
+                          plot_gauge (&canvas, values[average], count, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color, PLOT_NEGATIVE);
                         }
                     }
                 }
-              else if (!strcasecmp (c->draw, "area"))
+              else if (cp->mode == curve_area)
                 {
                   if (pass == 0)
                     {
                       memset (maxs, 0, sizeof (double) * graph_width);
 
-                      plot_area (&canvas, &iterator_average, maxs, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color);
+                      if (!c->work->unknown)
+                        {
+                          count = window_size (&c->work->eff_iterator[average], graph_width);
+                          values[average] = window_values (c->work, average, count, scratch[average]);
+
+                          plot_area (&canvas, values[average], count, maxs, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color);
+                        }
                     }
                 }
-              else if ((!strcasecmp (c->draw, "stack") || !strcasecmp (c->draw, "areastack")) && (pass == 0))
+              else if (cp->mode == curve_stack && pass == 0)
                 {
-                  if (pass == 0)
-                    plot_area (&canvas, &iterator_average, maxs, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color);
+                  if (pass == 0 && !c->work->unknown)
+                    {
+                      count = window_size (&c->work->eff_iterator[average], graph_width);
+                      values[average] = window_values (c->work, average, count, scratch[average]);
+
+                      plot_area (&canvas, values[average], count, maxs, graph_x, graph_y, graph_width, graph_height, global_min, global_max, ds, color);
+                    }
                 }
 
               if (pass == 0)
@@ -1658,10 +2893,9 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
                   draw_vline (&canvas,  9, y, y + 6, 0);
                   draw_vline (&canvas, 16, y, y + 6, 0);
 
-                  font_draw (&canvas, 22, y + 9, c->label ? c->label : c->name, 0, 0x00);
+                  font_draw (&canvas, 22, y + 9, cp->label, 0, 0x00);
                 }
 
-              ++graph_index;
               y += LINE_HEIGHT;
             }
         }
@@ -1675,24 +2909,17 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
     }
 
   if (g->total)
-    {
-      size_t label_width = font_width (g->total);
-
-      if (label_width > max_label_width)
-        max_label_width = label_width;
-
-      font_draw (&canvas, 22, y + 9, g->total, 0, 0x00);
-    }
+    font_draw (&canvas, 22, y + 9, g->total, 0, 0x00);
 
   y = graph_y + graph_height + 20;
-  x = 22 + max_label_width + 10;
+  x = plan->legend_x[plotted];
 
-  size_t column_width = (canvas.width - x - 20) / 4;
+  size_t column_width = plan->column_width[plotted];
 
-  font_draw (&canvas, x + column_width * 1, y + 9, has_negative ? "Cur (-/+)" : "Cur", -1, 0x00);
-  font_draw (&canvas, x + column_width * 2, y + 9, has_negative ? "Min (-/+)" : "Min", -1, 0x00);
-  font_draw (&canvas, x + column_width * 3, y + 9, has_negative ? "Avg (-/+)" : "Avg", -1, 0x00);
-  font_draw (&canvas, x + column_width * 4, y + 9, has_negative ? "Max (-/+)" : "Max", -1, 0x00);
+  font_draw (&canvas, x + column_width * 1, y + 9, plan->has_negative ? "Cur (-/+)" : "Cur", -1, 0x00);
+  font_draw (&canvas, x + column_width * 2, y + 9, plan->has_negative ? "Min (-/+)" : "Min", -1, 0x00);
+  font_draw (&canvas, x + column_width * 3, y + 9, plan->has_negative ? "Avg (-/+)" : "Avg", -1, 0x00);
+  font_draw (&canvas, x + column_width * 4, y + 9, plan->has_negative ? "Max (-/+)" : "Max", -1, 0x00);
   y += LINE_HEIGHT;
 
   double totals[4][2];
@@ -1705,64 +2932,64 @@ do_graph (struct graph* g, size_t interval, const char* suffix)
       if (c->nograph)
         continue;
 
-      if (c->work.negative)
+      if (c->work->negative)
         {
-          print_numbers (&canvas, x + column_width * 1, y + 9, c->work.negative->work.cur, c->work.cur);
-          print_numbers (&canvas, x + column_width * 2, y + 9, c->work.negative->work.min, c->work.min);
-          print_numbers (&canvas, x + column_width * 3, y + 9, c->work.negative->work.avg, c->work.avg);
-          print_numbers (&canvas, x + column_width * 4, y + 9, c->work.negative->work.max, c->work.max);
-
-          totals[0][1] += c->work.negative->work.cur;
-          totals[1][1] += c->work.negative->work.min;
-          totals[2][1] += c->work.negative->work.avg;
-          totals[3][1] += c->work.negative->work.max;
+          print_numbers (&canvas, x + column_width * 1, y + 9, c->work->negative->work->cur, c->work->cur);
+          print_numbers (&canvas, x + column_width * 2, y + 9, c->work->negative->work->min, c->work->min);
+          print_numbers (&canvas, x + column_width * 3, y + 9, c->work->negative->work->avg, c->work->avg);
+          print_numbers (&canvas, x + column_width * 4, y + 9, c->work->negative->work->max, c->work->max);
+
+          totals[0][1] += c->work->negative->work->cur;
+          totals[1][1] += c->work->negative->work->min;
+          totals[2][1] += c->work->negative->work->avg;
+          totals[3][1] += c->work->negative->work->max;
         }
       else
         {
           double smallest, biggest;
 
-          if (c->critical && c->work.cur > c->critical)
+          if (c->critical && c->work->cur > c->critical)
             draw_rect (&canvas, x, y - 4, column_width + 2, LINE_HEIGHT, 0xff7777);
-          else if (c->warning && c->work.cur > c->warning)
+          else if (c->warning && c->work->cur > c->warning)
             draw_rect (&canvas, x, y - 4, column_width + 2, LINE_HEIGHT, 0xffff77);
 
-          smallest = biggest = c->work.cur;
+          smallest = biggest = c->work->cur;
 
-          if (c->work.min < smallest) smallest = c->work.min;
-          if (c->work.avg < smallest) smallest = c->work.avg;
-          if (c->work.max < smallest) smallest = c->work.max;
+          if (c->work->min < smallest) smallest = c->work->min;
+          if (c->work->avg < smallest) smallest = c->work->avg;
+          if (c->work->max < smallest) smallest = c->work->max;
 
-          if (c->work.min > biggest) biggest = c->work.min;
-          if (c->work.avg > biggest) biggest = c->work.avg;
-          if (c->work.max > biggest) biggest = c->work.max;
+          if (c->work->min > biggest) biggest = c->work->min;
+          if (c->work->avg > biggest) biggest = c->work->avg;
+          if (c->work->max > biggest) biggest = c->work->max;
 
           if (biggest / smallest < 100.0)
             {
-              print_number (&canvas, x + column_width * 1, y + 9, c->work.cur, smallest);
-              print_number (&canvas, x + column_width * 2, y + 9, c->work.min, smallest);
-              print_number (&canvas, x + column_width * 3, y + 9, c->work.avg, smallest);
-              print_number (&canvas, x + column_width * 4, y + 9, c->work.max, smallest);
+              print_number (&canvas, x + column_width * 1, y + 9, c->work->cur, smallest);
+              print_number (&canvas, x + column_width * 2, y + 9, c->work->min, smallest);
+              print_number (&canvas, x + column_width * 3, y + 9, c->work->avg, smallest);
+              print_number (&canvas, x + column_width * 4, y + 9, c->work->max, smallest);
             }
           else
             {
-              print_number (&canvas, x + column_width * 1, y + 9, c->work.cur, c->work.cur);
-              print_number (&canvas, x + column_width * 2, y + 9, c->work.min, c->work.min);
-              print_number (&canvas, x + column_width * 3, y + 9, c->work.avg, c->work.avg);
-              print_number (&canvas, x + column_width * 4, y + 9, c->work.max, c->work.max);
+              print_number (&canvas, x + column_width * 1, y + 9, c->work->cur, c->work->cur);
+              print_number (&canvas, x + column_width * 2, y + 9, c->work->min, c->work->min);
+              print_number (&canvas, x + column_width * 3, y + 9, c->work->avg, c->work->avg);
+              print_number (&canvas, x + column_width * 4, y + 9, c->work->max, c->work->max);
             }
         }
 
-      totals[0][0] += c->work.cur;
-      totals[1][0] += c->work.min;
-      totals[2][0] += c->work.avg;
-      totals[3][0] += c->work.max;
+      totals[0][0] += c->work->cur;
+      totals[1][0] += c->work->min;
+      totals[2][0] += c->work->avg;
+      totals[3][0] += c->work->max;
 
       y += LINE_HEIGHT;
     }
 
   if (g->total)
     {
-      if (has_negative)
+      if (plan->has_negative)
         {
           print_numbers (&canvas, x + column_width * 1, y + 9, totals[0][1], totals[0][0]);
           print_numbers (&canvas, x + column_width * 2, y + 9, totals[1][1], totals[1][0]);
@@ -1908,8 +3135,8 @@ cdef_eval (const struct rrd_iterator* iterator, size_t index, void* vargs)
 
               /* Avoid calling self-referencing CDEFs recursively */
               ref_iterator
-                = (ref_c == args->c) ? &ref_c->work.iterator[args->name]
-                : &ref_c->work.eff_iterator[args->name];
+                = (ref_c == args->c) ? &ref_c->work->iterator[args->name]
+                : &ref_c->work->eff_iterator[args->name];
 
               if(!ref_iterator->count)
                 {
@@ -1924,7 +3151,7 @@ cdef_eval (const struct rrd_iterator* iterator, size_t index, void* vargs)
                       if(ref_c == args->c)
                         fprintf(stderr, "CDEF token is self-referencing\n");
 
-                      fprintf(stderr, "Referenced curve is '%s'\n", ref_c->path);
+                      fprintf(stderr, "Referenced curve is '%s'\n", ref_c->work->path);
                     }
 
                   return NAN;
@@ -1952,9 +3179,9 @@ cdef_create_iterator (struct rrd_iterator* result, struct graph* g, struct curve
   struct cdef_script* script;
 
   memset (result, 0, sizeof (*result));
-  script = &c->work.script;
+  script = &c->work->script;
 
-  args = &c->work.script_args[name];
+  args = &c->work->script_args[name];
   args->script = script;
   args->name = name;
   args->c = c;
@@ -1967,8 +3194,22 @@ cdef_create_iterator (struct rrd_iterator* result, struct graph* g, struct curve
 
           ref_c = script->tokens[i].v.curve;
 
-          if (ref_c->work.iterator[name].count < min_count)
-            min_count = ref_c->work.iterator[name].count;
+          if (ref_c->work->iterator[name].count < min_count)
+            min_count = ref_c->work->iterator[name].count;
+        }
+    }
+
+  /* cdef_eval() reads the referenced curves from position zero, not just
+     the rows their own iterators cover */
+  for (i = 0; i < script->token_count; ++i)
+    {
+      if (script->tokens[i].type == cdef_curve)
+        {
+          const struct curve* ref_c;
+
+          ref_c = script->tokens[i].v.curve;
+
+          rrd_iterator_fetch (&ref_c->work->data, &ref_c->work->iterator[name], 0, min_count);
         }
     }
 
@@ -1,9 +1,13 @@
 #ifndef GRAPH_H_
 #define GRAPH_H_ 1
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "arena.h"
+#include "common.h"
+
 enum version
 {
   ver_unknown,
@@ -15,14 +19,25 @@ enum version
 
 extern enum version cur_version;
 
-extern int debug;
 extern int nolazy;
 
 extern FILE* stats;
 
-extern struct graph* graphs;
-extern size_t graph_count;
-extern size_t graph_alloc;
+extern int parse_thread_count;
+
+/* Number of chunks the last parse_datafile() call parsed concurrently.
+   Data files too small to give each thread 4 MB are
+   parsed serially, as one chunk.  */
+extern size_t parse_chunk_count;
+
+/* Thread-local, so that parse_datafile() can let each parser thread build
+   a table of its own.  Only the main thread's table is used afterwards.  */
+extern __thread struct graph* graphs;
+extern __thread size_t graph_count;
+extern __thread size_t graph_alloc;
+
+/* Holds the strings and curve arrays of the graph table */
+extern __thread struct arena parse_arena;
 
 extern const char* tmpldir;
 extern const char* htmldir;
@@ -36,7 +51,7 @@ struct curve;
 enum iterator_name;
 
 void
-parse_datafile (char* in, const char *pathname);
+parse_datafile (char* in, char* end, const char *pathname);
 
 int
 cdef_compile (struct cdef_script* target, struct graph* g, const char* string);
@@ -47,15 +62,68 @@ cdef_eval (const struct rrd_iterator* iterator, size_t index, void* vargs);
 void
 cdef_create_iterator (struct rrd_iterator* result, struct graph* g, struct curve* c, enum iterator_name name, size_t max_count);
 
+void
+graph_index_rebuild ();
+
 ssize_t
 find_graph (const char* domain, const char* host, const char* name, int create);
 
+void
+intern_graphs ();
+
+int
+graph_cmp (const void* plhs, const void* prhs);
+
+void
+sort_graphs ();
+
+ssize_t
+find_graph_id (size_t domain_id, size_t host_id, size_t name_id);
+
+void
+curve_hash_rebuild (struct graph* g);
+
 const struct curve*
 find_curve (const struct graph* g, const char* name);
 
 const char*
 strword (const char* haystack, const char* needle);
 
+void
+resolve_graph_order (struct graph* g);
+
+/* The periods drawn for graphs.  Columns are INTERVAL seconds long, or
+   if INTERVAL is zero, as long as it takes for the graph to span SPAN
+   seconds.  A period with a MAX_UPDATE_RATE is only drawn for graphs
+   updated more often than that; see period_interval().  */
+struct period
+{
+  size_t interval;
+  const char* name;
+  size_t max_update_rate;
+  size_t span;
+};
+
+extern const struct period periods[];
+extern const size_t period_count;
+
+size_t
+period_interval (size_t period, size_t update_rate, size_t width);
+
+char*
+curve_rrd_path (const struct graph* g, const struct curve* c, struct arena* arena);
+
+size_t
+plot_width (const struct graph* g);
+
+/* Row of unknown values in the buffers filled by value_rows() */
+#define ROW_UNKNOWN INT16_MIN
+
+void
+value_rows (const double* values, size_t count, int negate,
+            double global_min, double global_max, size_t height,
+            int16_t* rows);
+
 void
 process_graph (size_t graph_index);
 
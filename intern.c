@@ -0,0 +1,159 @@
+/*  String interning.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "intern.h"
+
+/* Slots of the open addressing table hold the string ID plus one */
+static size_t
+intern_hash (const char* string)
+{
+  size_t hash = 0xcbf29ce484222325ULL;
+
+  while (*string)
+    hash = (hash ^ (unsigned char) *string++) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+static void
+intern_rehash (struct intern_table* table, size_t size)
+{
+  size_t i, slot, mask = size - 1;
+
+  free (table->hash);
+
+  if (!(table->hash = calloc (size, sizeof (*table->hash))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  table->hash_size = size;
+
+  for (i = 0; i < table->count; ++i)
+    {
+      for (slot = intern_hash (table->strings[i]) & mask; table->hash[slot]; slot = (slot + 1) & mask)
+        ;
+
+      table->hash[slot] = i + 1;
+    }
+}
+
+/* Returns the ID of STRING, adding it if necessary.  The string itself
+   is not copied, and must outlive the table.  */
+size_t
+intern_add (struct intern_table* table, const char* string)
+{
+  size_t slot, mask;
+
+  if (table->count * 2 >= table->hash_size)
+    intern_rehash (table, table->hash_size ? table->hash_size * 2 : 256);
+
+  mask = table->hash_size - 1;
+
+  for (slot = intern_hash (string) & mask; table->hash[slot]; slot = (slot + 1) & mask)
+    {
+      if (!strcmp (table->strings[table->hash[slot] - 1], string))
+        return table->hash[slot] - 1;
+    }
+
+  if (table->count == table->alloc)
+    {
+      table->alloc = table->alloc * 3 / 2 + 64;
+
+      if (!(table->strings = realloc (table->strings, sizeof (*table->strings) * table->alloc)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+    }
+
+  table->strings[table->count] = string;
+  table->hash[slot] = ++table->count;
+
+  return table->count - 1;
+}
+
+/* Returns the ID of STRING, or -1 if it has not been added */
+ssize_t
+intern_lookup (const struct intern_table* table, const char* string)
+{
+  size_t slot, mask;
+
+  if (!table->count)
+    return -1;
+
+  mask = table->hash_size - 1;
+
+  for (slot = intern_hash (string) & mask; table->hash[slot]; slot = (slot + 1) & mask)
+    {
+      if (!strcmp (table->strings[table->hash[slot] - 1], string))
+        return table->hash[slot] - 1;
+    }
+
+  return -1;
+}
+
+static int
+intern_cmp (const void* plhs, const void* prhs)
+{
+  return strcmp (**(const char** const*) plhs, **(const char** const*) prhs);
+}
+
+/* Renumbers the strings in strcmp() order.  If REMAP is not null, the new
+   ID of every old ID is stored in it.  */
+void
+intern_sort (struct intern_table* table, size_t* remap)
+{
+  const char*** order;
+  const char** strings;
+  size_t i;
+
+  if (!table->count)
+    return;
+
+  if (!(order = malloc (sizeof (*order) * table->count))
+      || !(strings = malloc (sizeof (*strings) * table->alloc)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < table->count; ++i)
+    order[i] = &table->strings[i];
+
+  qsort (order, table->count, sizeof (*order), intern_cmp);
+
+  for (i = 0; i < table->count; ++i)
+    {
+      strings[i] = *order[i];
+
+      if (remap)
+        remap[order[i] - table->strings] = i;
+    }
+
+  free (order);
+  free (table->strings);
+  table->strings = strings;
+
+  intern_rehash (table, table->hash_size);
+}
+
+void
+intern_free (struct intern_table* table)
+{
+  free (table->strings);
+  free (table->hash);
+
+  memset (table, 0, sizeof (*table));
+}
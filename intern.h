@@ -0,0 +1,31 @@
+#ifndef INTERN_H_
+#define INTERN_H_ 1
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Maps strings to small integer IDs.  Each distinct string is stored once,
+   and after intern_sort() the IDs follow strcmp() order, so that strings
+   can be ordered by comparing their IDs.  */
+struct intern_table
+{
+  const char** strings;
+  size_t count, alloc;
+
+  size_t* hash;
+  size_t hash_size;
+};
+
+size_t
+intern_add (struct intern_table* table, const char* string);
+
+ssize_t
+intern_lookup (const struct intern_table* table, const char* string);
+
+void
+intern_sort (struct intern_table* table, size_t* remap);
+
+void
+intern_free (struct intern_table* table);
+
+#endif /* !INTERN_H_ */
@@ -0,0 +1,552 @@
+/*  Persistent index of RRD file layouts.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "common.h"
+#include "layout.h"
+
+/* Bump whenever struct rrd_layout or the file layout below changes */
+#define LAYOUT_FORMAT 2
+
+static const char layout_magic[8] = { 'M', 'H', 'G', 'L', 'A', 'Y', 'O', 'T' };
+
+/* The index file holds a header, an open addressing table of hash_size
+   record offsets keyed on device and inode, with zero marking an empty
+   slot, and record_count records.  Each record is a struct rrd_layout
+   followed by its archives, and is only trusted if its checksum matches
+   and layout_valid() accepts it.  A damaged record costs a full
+   rrd_parse() of the file it describes.  */
+struct layout_header
+{
+  char magic[8];
+  uint32_t format;
+  uint32_t reserved;
+
+  uint64_t file_size;
+  uint64_t record_count;
+  uint64_t hash_size;
+};
+
+size_t layout_hits, layout_misses;
+
+/* The index loaded by layout_open() */
+static const char* index_map;
+static size_t index_size;
+static const struct layout_header* index_header;
+static const uint64_t* index_hash;
+
+/* Layouts found by this process or merged from journals.  A layout
+   replaces any earlier one of the same file.  */
+static struct arena layout_arena;
+static struct rrd_layout** added;
+static size_t added_count, added_alloc;
+static size_t* added_hash;
+static size_t added_hash_size;
+
+static size_t
+layout_key (uint64_t device, uint64_t inode)
+{
+  uint64_t key;
+
+  key = (inode ^ (device << 32) ^ (device >> 32)) * 0x9e3779b97f4a7c15ULL;
+
+  return key ^ (key >> 29);
+}
+
+static size_t
+layout_size (size_t archive_count)
+{
+  return sizeof (struct rrd_layout) + archive_count * sizeof (struct rrd_archive);
+}
+
+static uint64_t
+layout_checksum (const struct rrd_layout* layout)
+{
+  return cache_checksum (&layout->checksum + 1,
+                         layout_size (layout->archive_count) - sizeof (layout->checksum));
+}
+
+/* Returns 1 if every part of LAYOUT lies within the file, in order */
+static int
+layout_valid (const struct rrd_layout* layout)
+{
+  size_t i;
+
+  if (layout->archive_count != layout->rra_count
+      || !layout->ds_count
+      || layout->ds_defs != sizeof (struct rrd_header)
+      || layout->rra_defs - layout->ds_defs != layout->ds_count * sizeof (struct ds_def)
+      || layout->live_header - layout->rra_defs != layout->rra_count * sizeof (struct rra_def)
+      || layout->pdp_preps < layout->live_header
+      || layout->pdp_preps - layout->live_header
+         < (layout->version >= 3 ? sizeof (struct live_header) : sizeof (time_t))
+      || layout->cdp_preps < layout->pdp_preps
+      || layout->rra_ptrs < layout->cdp_preps
+      || layout->values < layout->rra_ptrs + layout->rra_count * sizeof (unsigned long)
+      || layout->values > layout->file_size)
+    return 0;
+
+  for (i = 0; i < layout->archive_count; ++i)
+    {
+      const struct rrd_archive* a = &layout->archives[i];
+
+      if (!a->row_count
+          || ((uint64_t) a->offset + (uint64_t) a->row_count * layout->ds_count) * sizeof (double)
+             > layout->file_size - layout->values)
+        return 0;
+    }
+
+  return 1;
+}
+
+/* Returns the checksum of the data source and archive definitions of
+   the file whose first LAYOUT->LIVE_HEADER bytes are at DATA */
+uint64_t
+layout_defs_checksum (const void* data, const struct rrd_layout* layout)
+{
+  return cache_checksum ((const char*) data + layout->ds_defs,
+                         layout->live_header - layout->ds_defs);
+}
+
+/* Returns the record at OFFSET in the index, or null if it does not fit
+   or is damaged */
+static const struct rrd_layout*
+index_record (uint64_t offset)
+{
+  const struct rrd_layout* layout;
+
+  if (offset % sizeof (uint64_t)
+      || offset < sizeof (*index_header)
+      || index_size < sizeof (*layout)
+      || offset > index_size - sizeof (*layout))
+    return 0;
+
+  layout = (const struct rrd_layout*) (index_map + offset);
+
+  if (layout->archive_count > (index_size - offset) / sizeof (struct rrd_archive)
+      || layout_size (layout->archive_count) > index_size - offset
+      || layout->checksum != layout_checksum (layout))
+    return 0;
+
+  return layout;
+}
+
+/* Maps the index at PATH.  A missing or damaged index is treated as an
+   empty one.  Returns 0 on success, -1 otherwise.  */
+int
+layout_open (const char* path)
+{
+  const struct layout_header* header;
+  struct stat st;
+  void* map;
+  int fd;
+
+  if (-1 == (fd = open (path, O_RDONLY)))
+    {
+      if (debug && errno != ENOENT)
+        fprintf (stderr, "Failed to open layout index '%s': %s\n", path, strerror (errno));
+
+      return -1;
+    }
+
+  if (-1 == fstat (fd, &st) || st.st_size < sizeof (*header))
+    {
+      close (fd);
+
+      return -1;
+    }
+
+  map = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  close (fd);
+
+  if (map == MAP_FAILED)
+    return -1;
+
+  header = map;
+
+  if (memcmp (header->magic, layout_magic, sizeof (layout_magic))
+      || header->format != LAYOUT_FORMAT
+      || header->file_size != st.st_size
+      || !header->hash_size
+      || (header->hash_size & (header->hash_size - 1))
+      || header->hash_size > (st.st_size - sizeof (*header)) / sizeof (uint64_t))
+    {
+      if (debug)
+        fprintf (stderr, "Layout index '%s' is damaged\n", path);
+
+      munmap (map, st.st_size);
+
+      return -1;
+    }
+
+  if (index_map)
+    munmap ((void*) index_map, index_size);
+
+  index_map = map;
+  index_size = st.st_size;
+  index_header = header;
+  index_hash = (const uint64_t*) (header + 1);
+
+  return 0;
+}
+
+static ssize_t
+added_slot (uint64_t device, uint64_t inode)
+{
+  size_t slot;
+
+  if (!added_hash_size)
+    return -1;
+
+  for (slot = layout_key (device, inode) & (added_hash_size - 1); added_hash[slot];
+       slot = (slot + 1) & (added_hash_size - 1))
+    {
+      const struct rrd_layout* layout = added[added_hash[slot] - 1];
+
+      if (layout->device == device && layout->inode == inode)
+        return slot;
+    }
+
+  return slot;
+}
+
+/* Returns the layout of the file described by ST, or null if the file
+   is unknown or has changed size since its layout was recorded */
+const struct rrd_layout*
+layout_lookup (const struct stat* st)
+{
+  const struct rrd_layout* layout = 0;
+  ssize_t slot;
+
+  if (-1 != (slot = added_slot (st->st_dev, st->st_ino)) && added_hash[slot])
+    layout = added[added_hash[slot] - 1];
+  else if (index_map)
+    {
+      size_t mask = index_header->hash_size - 1, probes;
+
+      for (slot = layout_key (st->st_dev, st->st_ino) & mask, probes = 0;
+           index_hash[slot] && probes <= mask; slot = (slot + 1) & mask, ++probes)
+        {
+          const struct rrd_layout* candidate;
+
+          if (!(candidate = index_record (index_hash[slot])))
+            break;
+
+          if (candidate->device == st->st_dev && candidate->inode == st->st_ino)
+            {
+              layout = candidate;
+
+              break;
+            }
+        }
+    }
+
+  if (!layout || layout->file_size != st->st_size || !layout_valid (layout))
+    return 0;
+
+  return layout;
+}
+
+/* Like layout_lookup(), but counted in layout_hits and layout_misses */
+const struct rrd_layout*
+layout_find (const struct stat* st)
+{
+  const struct rrd_layout* layout;
+
+  if ((layout = layout_lookup (st)))
+    ++layout_hits;
+  else
+    ++layout_misses;
+
+  return layout;
+}
+
+struct rrd_layout*
+layout_alloc (size_t archive_count)
+{
+  struct rrd_layout* result;
+
+  result = arena_alloc (&layout_arena, layout_size (archive_count));
+  memset (result, 0, layout_size (archive_count));
+  result->archive_count = archive_count;
+
+  return result;
+}
+
+/* Adds LAYOUT, allocated with layout_alloc(), replacing any earlier
+   layout of the same file */
+void
+layout_insert (struct rrd_layout* layout)
+{
+  ssize_t slot;
+  size_t i;
+
+  if ((added_count + 1) * 2 > added_hash_size)
+    {
+      free (added_hash);
+
+      for (added_hash_size = added_hash_size ? added_hash_size * 2 : 64;
+           added_hash_size < (added_count + 1) * 2; added_hash_size <<= 1)
+        ;
+
+      if (!(added_hash = calloc (added_hash_size, sizeof (*added_hash))))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      for (i = 0; i < added_count; ++i)
+        added_hash[added_slot (added[i]->device, added[i]->inode)] = i + 1;
+    }
+
+  slot = added_slot (layout->device, layout->inode);
+
+  if (added_hash[slot])
+    {
+      added[added_hash[slot] - 1] = layout;
+
+      return;
+    }
+
+  if (added_count == added_alloc)
+    {
+      added_alloc = added_alloc * 3 / 2 + 64;
+
+      if (!(added = realloc (added, sizeof (*added) * added_alloc)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+    }
+
+  added[added_count] = layout;
+  added_hash[slot] = ++added_count;
+}
+
+size_t
+layout_added_count ()
+{
+  return added_count;
+}
+
+/* Adds every layout in the journal at PATH, written by layout_write()
+   in another process, and removes the journal.  Returns 0 on success,
+   -1 if the journal is missing or damaged.  */
+int
+layout_merge_journal (const char* path)
+{
+  const char* saved_map = index_map;
+  size_t saved_size = index_size;
+  const struct layout_header* saved_header = index_header;
+  const uint64_t* saved_hash = index_hash;
+  const struct rrd_layout* layout;
+  uint64_t i, offset;
+  int result = -1;
+
+  index_map = 0;
+
+  if (-1 == layout_open (path))
+    goto done;
+
+  offset = sizeof (*index_header) + index_header->hash_size * sizeof (uint64_t);
+
+  for (i = 0; i < index_header->record_count; ++i)
+    {
+      struct rrd_layout* copy;
+
+      if (!(layout = index_record (offset)))
+        break;
+
+      copy = layout_alloc (layout->archive_count);
+      memcpy (copy, layout, layout_size (layout->archive_count));
+      layout_insert (copy);
+
+      offset += layout_size (layout->archive_count);
+    }
+
+  munmap ((void*) index_map, index_size);
+
+  result = 0;
+
+done:
+
+  unlink (path);
+
+  index_map = saved_map;
+  index_size = saved_size;
+  index_header = saved_header;
+  index_hash = saved_hash;
+
+  return result;
+}
+
+/* Writes the layouts added in this process to PATH, along with the
+   layouts of the loaded index that were not replaced if MERGE is set.
+   The file is written under a temporary name and then renamed.  Returns
+   0 on success, -1 on failure.  */
+int
+layout_write (const char* path, int merge)
+{
+  struct layout_header header;
+  const struct rrd_layout** records;
+  size_t i, record_count = 0, record_alloc, payload_size = 0;
+  uint64_t offset;
+  uint64_t* hash;
+  char* payload;
+  char* tmp_path;
+  FILE* f;
+  int result = -1;
+
+  record_alloc = added_count;
+
+  if (merge && index_map)
+    record_alloc += index_header->record_count;
+
+  if (!(records = malloc (sizeof (*records) * (record_alloc ? record_alloc : 1))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < added_count; ++i)
+    records[record_count++] = added[i];
+
+  if (merge && index_map)
+    {
+      offset = sizeof (*index_header) + index_header->hash_size * sizeof (uint64_t);
+
+      for (i = 0; i < index_header->record_count; ++i)
+        {
+          const struct rrd_layout* layout;
+          ssize_t slot;
+
+          if (!(layout = index_record (offset)))
+            break;
+
+          offset += layout_size (layout->archive_count);
+
+          if (-1 != (slot = added_slot (layout->device, layout->inode)) && added_hash[slot])
+            continue;
+
+          records[record_count++] = layout;
+        }
+    }
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, layout_magic, sizeof (layout_magic));
+  header.format = LAYOUT_FORMAT;
+  header.record_count = record_count;
+
+  for (header.hash_size = 64; header.hash_size < record_count * 2; header.hash_size <<= 1)
+    ;
+
+  for (i = 0; i < record_count; ++i)
+    payload_size += layout_size (records[i]->archive_count);
+
+  offset = sizeof (header) + header.hash_size * sizeof (uint64_t);
+  header.file_size = offset + payload_size;
+
+  if (!(hash = calloc (header.hash_size, sizeof (*hash)))
+      || !(payload = malloc (payload_size ? payload_size : 1)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0, payload_size = 0; i < record_count; ++i)
+    {
+      const struct rrd_layout* layout = records[i];
+      size_t slot, mask = header.hash_size - 1;
+
+      for (slot = layout_key (layout->device, layout->inode) & mask; hash[slot];
+           slot = (slot + 1) & mask)
+        ;
+
+      hash[slot] = offset + payload_size;
+
+      memcpy (payload + payload_size, layout, layout_size (layout->archive_count));
+      ((struct rrd_layout*) (payload + payload_size))->checksum = layout_checksum (layout);
+      payload_size += layout_size (layout->archive_count);
+    }
+
+  if (-1 == asprintf (&tmp_path, "%s.%d", path, (int) getpid ()))
+    errx (EXIT_FAILURE, "asprintf failed: %s", strerror (errno));
+
+  if (!(f = fopen (tmp_path, "w")))
+    {
+      if (debug)
+        fprintf (stderr, "Failed to open '%s' for writing: %s\n", tmp_path, strerror (errno));
+
+      free (tmp_path);
+
+      goto done;
+    }
+
+  if (1 == fwrite (&header, sizeof (header), 1, f)
+      && header.hash_size == fwrite (hash, sizeof (*hash), header.hash_size, f)
+      && payload_size == fwrite (payload, 1, payload_size, f))
+    result = 0;
+
+  if (fclose (f))
+    result = -1;
+
+  if (result == -1)
+    {
+      if (debug)
+        fprintf (stderr, "Failed to write '%s': %s\n", tmp_path, strerror (errno));
+
+      unlink (tmp_path);
+    }
+  else if (-1 == rename (tmp_path, path))
+    {
+      if (debug)
+        fprintf (stderr, "Failed to rename '%s' to '%s': %s\n", tmp_path, path, strerror (errno));
+
+      result = -1;
+      unlink (tmp_path);
+    }
+
+  free (tmp_path);
+
+done:
+
+  free (payload);
+  free (hash);
+  free (records);
+
+  return result;
+}
+
+void
+layout_close ()
+{
+  if (index_map)
+    munmap ((void*) index_map, index_size);
+
+  index_map = 0;
+  index_size = 0;
+  index_header = 0;
+  index_hash = 0;
+
+  free (added);
+  free (added_hash);
+  arena_free (&layout_arena);
+
+  added = 0;
+  added_hash = 0;
+  added_count = added_alloc = added_hash_size = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef LAYOUT_H_
+#define LAYOUT_H_ 1
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "rrd.h"
+
+extern size_t layout_hits, layout_misses;
+
+int
+layout_open (const char* path);
+
+const struct rrd_layout*
+layout_lookup (const struct stat* st);
+
+const struct rrd_layout*
+layout_find (const struct stat* st);
+
+uint64_t
+layout_defs_checksum (const void* data, const struct rrd_layout* layout);
+
+struct rrd_layout*
+layout_alloc (size_t archive_count);
+
+void
+layout_insert (struct rrd_layout* layout);
+
+size_t
+layout_added_count ();
+
+int
+layout_merge_journal (const char* path);
+
+int
+layout_write (const char* path, int merge);
+
+void
+layout_close ();
+
+#endif /* !LAYOUT_H_ */
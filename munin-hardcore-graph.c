@@ -20,25 +20,46 @@
 #include <string.h>
 
 #include <err.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "dirindex.h"
 #include "font.h"
 #include "graph.h"
+#include "layout.h"
 #include "munin.h"
+#include "prefetch.h"
+#include "rrd.h"
 
 static int cpu_count = 1;
+static int prefetch_depth = 32;
+static int use_cache = 1;
+static int rebuild_cache = 0;
 
 static const struct option long_options[] =
 {
     { "data-file", required_argument, 0, 'd' },
+    { "cache-file", required_argument, 0, 'c' },
+    { "layout-file", required_argument, 0, 'l' },
+    { "rebuild-cache", no_argument, &rebuild_cache, 1 },
+    { "no-cache", no_argument, &use_cache, 0 },
     { "debug",   no_argument, &debug, 1 },
+    { "mmap",    no_argument, 0, 'm' },
+    { "pread",   no_argument, &rrd_use_pread, 1 },
+    { "stitch",  no_argument, &rrd_stitch, 1 },
+    { "prefetch", required_argument, 0, 'p' },
+    { "rrd-cache", required_argument, 0, 'r' },
+    { "parse-threads", required_argument, 0, 'j' },
     { "no-lazy", no_argument, &nolazy, 1 },
     { "help",    no_argument, 0, 'h' },
     { "version", no_argument, 0, 'v' },
@@ -46,6 +67,9 @@ static const struct option long_options[] =
 };
 
 static const char* datafile = "/var/lib/munin/datafile";
+static char* cache_file;
+static char* layout_file;
+static int use_mmap = 0;
 static struct graph *last_graph;
 
 static void
@@ -58,7 +82,25 @@ help (const char* argv0)
          " options too\n"
          "\n"
          " -d, --data-file=FILE       load graph information from FILE\n"
+         " -c, --cache-file=FILE      cache the parsed data file in FILE\n"
+         "                            (default: data file name plus .cache)\n"
+         " -l, --layout-file=FILE     remember the layout of RRD files in FILE\n"
+         "                            (default: data file name plus .layout)\n"
+         "     --rebuild-cache        parse the data file and RRD files even if\n"
+         "                            the caches are up to date\n"
+         "     --no-cache             neither read nor write the caches\n"
          "     --debug                print debug messages\n"
+         " -m, --mmap                 map the data file instead of reading it\n"
+         "     --pread                read only the rows of RRD files that are\n"
+         "                            drawn, instead of mapping whole files\n"
+         "     --stitch               draw the recent part of long periods from\n"
+         "                            the finest archives that cover it\n"
+         " -p, --prefetch=DEPTH       read up to DEPTH RRD files of upcoming\n"
+         "                            graphs ahead of time (default: 32)\n"
+         " -r, --rrd-cache=MIB        keep up to MIB mebibytes of RRD files\n"
+         "                            mapped for later graphs (default: 64)\n"
+         " -j, --parse-threads=COUNT  parse the data file using COUNT threads\n"
+         "                            (default: 1)\n"
          " -n, --no-lazy              redraw every single graph\n"
          "     --help     display this help and exit\n"
          "     --version  display version information and exit\n"
@@ -66,17 +108,74 @@ help (const char* argv0)
          "Report bugs to <morten@rashbox.org>.\n", argv0);
 }
 
-int
-graph_cmp (const void* plhs, const void* prhs)
+/* Reads the data file into a NUL-terminated, writable buffer */
+static char*
+read_datafile (size_t* size)
 {
-  const struct graph* lhs = plhs;
-  const struct graph* rhs = prhs;
-  int result;
+  FILE* f;
+  size_t data_size;
+  char* data;
+
+  if (!(f = fopen (datafile, "r")))
+    errx (EXIT_FAILURE, "Failed to open '%s' for reading: %s", datafile, strerror (errno));
+
+  if (-1 == (fseek (f, 0, SEEK_END)))
+    errx (EXIT_FAILURE, "Failed to seek to end of '%s': %s", datafile, strerror (errno));
+
+  data_size = ftell (f);
+
+  if (-1 == (fseek (f, 0, SEEK_SET)))
+    errx (EXIT_FAILURE, "Failed to seek to start of '%s': %s", datafile, strerror (errno));
+
+  data = malloc (data_size + 1);
+
+  if (data_size != fread (data, 1, data_size, f))
+    errx (EXIT_FAILURE, "Error reading %zu bytes from '%s': %s", (size_t) data_size, datafile, strerror (errno));
+
+  fclose (f);
+
+  data[data_size] = 0;
+  *size = data_size;
+
+  return data;
+}
+
+/* Maps the data file copy-on-write, so that the parser can still write its
+   NUL terminators in place.  The file is mapped over an anonymous mapping
+   one page larger than the file, which guarantees a terminating NUL even
+   when the file size is a multiple of the page size.  */
+static char*
+map_datafile (size_t* size, size_t* map_size)
+{
+  struct stat st;
+  size_t page_size;
+  char* data;
+  int fd;
+
+  if (-1 == (fd = open (datafile, O_RDONLY)))
+    errx (EXIT_FAILURE, "Failed to open '%s' for reading: %s", datafile, strerror (errno));
+
+  if (-1 == fstat (fd, &st))
+    errx (EXIT_FAILURE, "Failed to stat '%s': %s", datafile, strerror (errno));
 
-  if (0 != (result = strcmp (lhs->domain, rhs->domain)))
-    return result;
+  page_size = sysconf (_SC_PAGESIZE);
+  *size = st.st_size;
+  *map_size = (st.st_size + page_size) & ~(page_size - 1);
 
-  return strcmp (lhs->name, rhs->name);
+  data = mmap (0, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (data == MAP_FAILED)
+    errx (EXIT_FAILURE, "Failed to map %zu bytes: %s", *map_size, strerror (errno));
+
+  if (*size
+      && MAP_FAILED == mmap (data, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0))
+    errx (EXIT_FAILURE, "Memory map failed on '%s': %s", datafile, strerror (errno));
+
+  madvise (data, *size, MADV_SEQUENTIAL);
+
+  close (fd);
+
+  return data;
 }
 
 void
@@ -101,7 +200,7 @@ sigsegvhandler(int signal)
 
           c = &last_graph->curves[i];
 
-          fprintf(stderr, "Data source #%zu: %s\n", i, c->path);
+          fprintf(stderr, "Data source #%zu: %s\n", i, c->work ? c->work->path : c->name);
 
           if (c->draw)     fprintf (stderr, "  draw=%s\n", c->draw);
           if (c->negative) fprintf (stderr, "  negative=%s\n", c->negative);
@@ -114,25 +213,59 @@ sigsegvhandler(int signal)
   exit (EX_SOFTWARE);
 }
 
+/* Returns the name of the journal in which child number CHILD leaves the
+   RRD layouts it found, for the parent to merge into the layout index */
+static char*
+journal_path (size_t child)
+{
+  char* result;
+
+  if (-1 == asprintf (&result, "%s.journal.%zu", layout_file, child))
+    errx (EXIT_FAILURE, "asprintf failed: %s", strerror (errno));
+
+  return result;
+}
+
 void
 process_graphs(size_t offset, size_t step)
 {
+  const char* prefetch_method;
+
+  prefetch_method = prefetch_init (prefetch_depth > 0 ? prefetch_depth : 0);
+
   for (; offset < graph_count; offset += step)
     {
       last_graph = &graphs[offset];
+      prefetch_advance (offset, step);
       process_graph (offset);
     }
 
   last_graph = 0;
+
+  rrd_cache_flush ();
+  dir_index_reset ();
+
+  prefetch_finish ();
+
+  if (stats)
+    {
+      fprintf (stats, "GL|layout|%zu|%zu\n", layout_hits, layout_misses);
+      fprintf (stats, "GR|%s|%zu|%zu\n", prefetch_method, prefetch_files, prefetch_bytes);
+      fprintf (stats, "GF|fallback|%zu|%zu\n", rrd_fallback_finer, rrd_fallback_coarser);
+      fprintf (stats, "GM|mapping|%zu|%zu\n", rrd_cache_hits, rrd_cache_misses);
+      fprintf (stats, "GN|directory|%zu|%zu\n", dir_index_scans, dir_index_missing);
+    }
 }
 
 int
 main (int argc, char** argv)
 {
   unsigned int ver_major, ver_minor, ver_patch;
-  FILE* f;
-  size_t i, data_size;
-  char* data;
+  size_t i, data_size, map_size = 0;
+  struct stat datafile_stat;
+  uint64_t checksum = 0;
+  const char* parse_method = "parse";
+  char* data = 0;
   char* in;
   char* line_end;
   pid_t *children;
@@ -146,7 +279,7 @@ main (int argc, char** argv)
       int optindex = 0;
       int c;
 
-      c = getopt_long (argc, argv, "dn", long_options, &optindex);
+      c = getopt_long (argc, argv, "d:c:l:nmj:p:r:", long_options, &optindex);
 
       if (c == -1)
         break;
@@ -159,6 +292,48 @@ main (int argc, char** argv)
 
           break;
 
+        case 'c':
+
+          cache_file = optarg;
+
+          break;
+
+        case 'l':
+
+          layout_file = optarg;
+
+          break;
+
+        case 'n':
+
+          nolazy = 1;
+
+          break;
+
+        case 'm':
+
+          use_mmap = 1;
+
+          break;
+
+        case 'j':
+
+          parse_thread_count = strtol (optarg, 0, 0);
+
+          break;
+
+        case 'p':
+
+          prefetch_depth = strtol (optarg, 0, 0);
+
+          break;
+
+        case 'r':
+
+          rrd_cache_limit = (size_t) strtol (optarg, 0, 0) << 20;
+
+          break;
+
         case 'h':
 
           help (argv[0]);
@@ -197,69 +372,123 @@ main (int argc, char** argv)
   if (cpu_count < 1)
     cpu_count = 1;
 
+  if (parse_thread_count < 1)
+    parse_thread_count = 1;
+
   stats = fopen ("/var/lib/munin/munin-graph.stats", "w");
 
   if (!stats && debug)
     fprintf (stderr, "Failed to open /var/lib/munin/munin-graph.stats for writing: %s\n", strerror (errno));
 
   struct timeval total_start, total_end;
+  struct timeval parse_start, parse_end;
 
   gettimeofday (&total_start, 0);
 
   font_init ();
 
-  if (!(f = fopen (datafile, "r")))
-    errx (EXIT_FAILURE, "Failed to open '%s' for reading: %s", datafile, strerror (errno));
+  if (-1 == stat (datafile, &datafile_stat))
+    errx (EXIT_FAILURE, "Failed to stat '%s': %s", datafile, strerror (errno));
 
-  if (-1 == (fseek (f, 0, SEEK_END)))
-    errx (EXIT_FAILURE, "Failed to seek to end of '%s': %s", datafile, strerror (errno));
+  if (use_cache && !cache_file
+      && -1 == asprintf (&cache_file, "%s.cache", datafile))
+    errx (EXIT_FAILURE, "asprintf failed: %s", strerror (errno));
 
-  data_size = ftell (f);
+  if (use_cache && !layout_file
+      && -1 == asprintf (&layout_file, "%s.layout", datafile))
+    errx (EXIT_FAILURE, "asprintf failed: %s", strerror (errno));
 
-  if (-1 == (fseek (f, 0, SEEK_SET)))
-    errx (EXIT_FAILURE, "Failed to seek to start of '%s': %s", datafile, strerror (errno));
+  if (use_cache && !rebuild_cache)
+    layout_open (layout_file);
 
-  data = malloc (data_size + 1);
+  gettimeofday (&parse_start, 0);
 
-  if (data_size != fread (data, 1, data_size, f))
-    errx (EXIT_FAILURE, "Error reading %zu bytes from '%s': %s", (size_t) data_size, datafile, strerror (errno));
+  if (use_cache && !rebuild_cache
+      && 0 == cache_load (cache_file, datafile, &datafile_stat))
+    {
+      if (debug)
+        fprintf (stderr, "Loaded graphs from cache '%s'\n", cache_file);
 
-  fclose (f);
+      /* The graphs are stored sorted and resolved */
+      graph_index_rebuild ();
 
-  data[data_size] = 0;
+      parse_method = "cache";
+    }
+  else
+    {
+      if (use_mmap)
+        data = map_datafile (&data_size, &map_size);
+      else
+        data = read_datafile (&data_size);
+
+      /* The parser writes into the buffer, so take the checksum first */
+      if (use_cache)
+        checksum = cache_checksum (data, data_size);
 
-  in = data;
-  line_end = strchr (in, '\n');
+      in = data;
+      line_end = memchr (in, '\n', data_size);
 
-  if (!line_end)
-    errx (EXIT_FAILURE, "No newlines in '%s'", datafile);
+      if (!line_end)
+        errx (EXIT_FAILURE, "No newlines in '%s'", datafile);
 
-  if (3 != sscanf (in, "version %u.%u.%u\n", &ver_major, &ver_minor, &ver_patch))
-    errx (EXIT_FAILURE, "Unsupported version signature at start of '%s'", datafile);
+      if (3 != sscanf (in, "version %u.%u.%u\n", &ver_major, &ver_minor, &ver_patch))
+        errx (EXIT_FAILURE, "Unsupported version signature at start of '%s'", datafile);
 
-  if (ver_major == 1 && ver_minor == 2)
-    cur_version = ver_1_2;
-  else if (ver_major == 1 && ver_minor == 3)
-    cur_version = ver_1_3;
-  else if (ver_major == 1 && ver_minor == 4)
-    cur_version = ver_1_4;
-  else if (ver_major == 2 && ver_minor == 0)
-    cur_version = ver_2_0;
+      if (ver_major == 1 && ver_minor == 2)
+        cur_version = ver_1_2;
+      else if (ver_major == 1 && ver_minor == 3)
+        cur_version = ver_1_3;
+      else if (ver_major == 1 && ver_minor == 4)
+        cur_version = ver_1_4;
+      else if (ver_major == 2 && ver_minor == 0)
+        cur_version = ver_2_0;
 
-  if (cur_version == ver_unknown)
-    errx (EXIT_FAILURE, "Unsupported version %u.%u.  I only support 1.2, 1.3, 1.4, and 2.0", ver_major, ver_minor);
+      if (cur_version == ver_unknown)
+        errx (EXIT_FAILURE, "Unsupported version %u.%u.  I only support 1.2, 1.3, 1.4, and 2.0", ver_major, ver_minor);
 
-  in = line_end + 1;
+      in = line_end + 1;
 
-  parse_datafile (in, datafile);
+      parse_datafile (in, data + data_size, datafile);
+
+      intern_graphs ();
+      sort_graphs ();
+      graph_index_rebuild ();
+
+      for (i = 0; i < graph_count; ++i)
+        resolve_graph_order (&graphs[i]);
+
+      if (use_cache && -1 == cache_write (cache_file, &datafile_stat, checksum) && debug)
+        fprintf (stderr, "Failed to write cache '%s'\n", cache_file);
+    }
+
+  if (stats)
+    {
+      double parse_time;
+
+      gettimeofday (&parse_end, 0);
+
+      parse_time = parse_end.tv_sec - parse_start.tv_sec + (parse_end.tv_usec - parse_start.tv_usec) * 1.0e-6;
+
+      fprintf (stats, "GP|%s|%.3f|%.1f\n", parse_method, parse_time,
+               parse_time > 0 ? datafile_stat.st_size / parse_time / (1024.0 * 1024.0) : 0.0);
+      fprintf (stats, "GA|arena|%zu|%zu\n", parse_arena.used, parse_arena.reserved);
+    }
 
   if (debug)
     fprintf (stderr, "Found %zu graphs\n", graph_count);
 
-  qsort (graphs, graph_count, sizeof (struct graph), graph_cmp);
+  /* Keep the children from flushing our buffered statistics again */
+  if (stats)
+    fflush (stats);
 
   if (debug)
-    process_graphs(0, 1);
+    {
+      process_graphs(0, 1);
+
+      if (use_cache && layout_added_count ()
+          && -1 == layout_write (layout_file, 1))
+        fprintf (stderr, "Failed to write layout index '%s'\n", layout_file);
+    }
   else
     {
       children = calloc (sizeof (*children), cpu_count);
@@ -278,12 +507,35 @@ main (int argc, char** argv)
             {
               process_graphs(i, cpu_count);
 
+              if (use_cache && layout_added_count ())
+                {
+                  char* path = journal_path (i);
+
+                  layout_write (path, 0);
+                  free (path);
+                }
+
               exit (EXIT_SUCCESS);
             }
         }
 
       for (i = 0; i < cpu_count; ++i)
         waitpid (children[i], 0, 0);
+
+      if (use_cache)
+        {
+          for (i = 0; i < cpu_count; ++i)
+            {
+              char* path = journal_path (i);
+
+              layout_merge_journal (path);
+              free (path);
+            }
+
+          if (layout_added_count ()
+              && -1 == layout_write (layout_file, 1) && debug)
+            fprintf (stderr, "Failed to write layout index '%s'\n", layout_file);
+        }
     }
 
   if (stats)
@@ -297,7 +549,14 @@ main (int argc, char** argv)
     }
 
   free (graphs);
-  free (data);
+  arena_free (&parse_arena);
+  cache_close ();
+  layout_close ();
+
+  if (map_size)
+    munmap (data, map_size);
+  else
+    free (data);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,175 @@
+/*  Entry point for munin-hardcore-update.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <getopt.h>
+
+#include "update.h"
+
+static const struct option long_options[] =
+{
+    { "help",    no_argument, 0, 'h' },
+    { "version", no_argument, 0, 'v' },
+    { 0, 0, 0, 0 }
+};
+
+static void
+help (const char* argv0)
+{
+  printf ("Usage: %s [OPTION]... [FILE UPDATE...]\n"
+         "update RRD files without rrdtool\n"
+         "\n"
+         "Each UPDATE is TIME:VALUE[:VALUE]..., as for `rrdtool update'.  Without\n"
+         "arguments, lines of the form FILE UPDATE... are read from standard\n"
+         "input, and consecutive lines for the same file are applied together.\n"
+         "\n"
+         "     --help     display this help and exit\n"
+         "     --version  display version information and exit\n"
+         "\n"
+         "Report bugs to <morten@rashbox.org>.\n", argv0);
+}
+
+/* Applies the updates read from standard input, one batch per run of
+   lines naming the same file */
+static int
+update_from_stdin ()
+{
+  char* line = 0;
+  size_t line_alloc = 0;
+  ssize_t length;
+  char* filename = 0;
+  char** updates = 0;
+  size_t update_count = 0, update_alloc = 0, i;
+  int result = EXIT_SUCCESS;
+
+  for (;;)
+    {
+      char* token;
+      char* saveptr;
+
+      length = getline (&line, &line_alloc, stdin);
+
+      if (length > 0 && line[length - 1] == '\n')
+        line[--length] = 0;
+
+      token = (length >= 0) ? strtok_r (line, " \t", &saveptr) : 0;
+
+      if (length >= 0 && !token)
+        continue;
+
+      if (filename && (length < 0 || strcmp (token, filename)))
+        {
+          if (-1 == rrd_update (filename, (const char* const*) updates, update_count))
+            result = EXIT_FAILURE;
+
+          for (i = 0; i < update_count; ++i)
+            free (updates[i]);
+
+          free (filename);
+          filename = 0;
+          update_count = 0;
+        }
+
+      if (length < 0)
+        break;
+
+      if (!filename && !(filename = strdup (token)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      while ((token = strtok_r (0, " \t", &saveptr)))
+        {
+          if (update_count == update_alloc)
+            {
+              update_alloc = update_alloc * 3 / 2 + 16;
+
+              if (!(updates = realloc (updates, sizeof (*updates) * update_alloc)))
+                errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+            }
+
+          if (!(updates[update_count++] = strdup (token)))
+            errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+        }
+    }
+
+  free (updates);
+  free (line);
+
+  return result;
+}
+
+int
+main (int argc, char** argv)
+{
+  for (;;)
+    {
+      int optindex = 0;
+      int c;
+
+      c = getopt_long (argc, argv, "", long_options, &optindex);
+
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 'h':
+
+          help (argv[0]);
+
+          return EXIT_SUCCESS;
+
+        case 'v':
+
+          printf ("%s-update %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+          printf ("Copyright © 2009 Morten Hustveit\n"
+                 "This is free software.  You may redistribute copies of it under the terms of\n"
+                 "the GNU General Public License <http://www.gnu.org/licenses/gpl.html>.\n"
+                 "There is NO WARRANTY, to the extent permitted by law.\n"
+                 "\n"
+                 "Authors:\n"
+                 "  Morten Hustveit\n");
+
+          return EXIT_SUCCESS;
+
+        case '?':
+
+          fprintf (stderr, "Try `%s --help' for more information.\n", argv[0]);
+
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (optind == argc)
+    return update_from_stdin ();
+
+  if (optind + 1 == argc)
+    {
+      printf ("Usage: %s [OPTION]... [FILE UPDATE...]\n", argv[0]);
+      fprintf (stderr, "Try `%s --help' for more information.\n", argv[0]);
+
+      return EXIT_FAILURE;
+    }
+
+  if (-1 == rrd_update (argv[optind], (const char* const*) argv + optind + 1, argc - optind - 1))
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
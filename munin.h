@@ -39,40 +39,72 @@ struct cdef_run_args
   enum iterator_name name;
 };
 
-struct curve
+/* Per-render state of a curve, allocated by process_graph() only for the
+   curves of the graph being drawn */
+struct curve_work
 {
   char* path;
   struct rrd data;
+  size_t ds;
+
+  /* Stored values of each iterator, gathered by do_graph() for all
+     curves reading the same file at once */
+  double* window[3];
+
+  /* The remaining fields are reset for every period drawn */
+  struct cdef_script script;
+  size_t window_count[3];
+
+  double cur, max, min, avg;
+  double max_avg, min_avg;
+  const struct curve* negative;
+
+  /* Set if none of the values drawn is known, so nothing is plotted */
+  int unknown;
+
+  struct rrd_iterator iterator[3];
+  struct rrd_iterator eff_iterator[3];
+  struct cdef_run_args script_args[3];
+};
 
+struct curve
+{
   const char* name;
+  const char* basename;
+
+  /* Filled in by resolve_graph_order().  ALIAS is the curve whose RRD
+     file holds this curve's data, if graph_order says so, and
+     ALIAS_MISSING is set if that curve does not exist.  */
+  size_t order_rank;
+  const struct graph* alias_graph;
+  const struct curve* alias;
+
+  unsigned int assigned;
+  uint32_t color;
+
+  unsigned int nograph : 1;
+  unsigned int has_color : 1;
+  unsigned int has_min : 1;
+  unsigned int has_max : 1;
+  unsigned int alias_missing : 1;
+
   const char* label;
   const char* draw;
   const char* type;
   const char* info;
   const char* cdef;
   const char* negative;
-  int nograph;
 
-  uint32_t color;
-  int has_color;
+  /* RRD file relative to dbdir, and data source within it, for data that
+     does not follow the one-file-per-field naming */
+  const char* filename;
+  const char* ds;
 
   double max, min;
-  int has_min, has_max;
-
   double warning, critical;
 
-  struct
-    {
-      struct cdef_script script;
-
-      double cur, max, min, avg;
-      double max_avg, min_avg;
-      const struct curve* negative;
-
-      struct rrd_iterator iterator[3];
-      struct rrd_iterator eff_iterator[3];
-      struct cdef_run_args script_args[3];
-    } work;
+  /* Zero outside process_graph(), unless the caller supplies the data */
+  struct curve_work* work;
 };
 
 struct graph
@@ -81,6 +113,13 @@ struct graph
   const char* host;
   const char* name;
 
+  /* Filled in by intern_graphs().  The IDs follow strcmp() order, and the
+     prefixes are "dbdir/domain/host-" and the PNG directory of the host,
+     shared by all graphs of a host.  */
+  size_t domain_id, host_id, name_id;
+  const char* rrd_prefix;
+  const char* png_prefix;
+
   char *name_png_path;
   char *name_rrd_path;
 
@@ -104,9 +143,18 @@ struct graph
 
   size_t width, height;
 
+  /* Seconds between updates, if set by update_rate */
+  size_t update_rate;
+
+  unsigned int assigned;
+
   struct curve* curves;
   size_t curve_count;
   size_t curve_alloc;
+
+  size_t* curve_hash;
+  size_t curve_hash_size;
+  size_t curve_hash_count;
 };
 
 #endif /* !MUNIH_H_ */
@@ -0,0 +1,242 @@
+/*  Benchmark for parallel datafile parsing.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <sys/time.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "graph.h"
+#include "munin.h"
+
+static char* text;
+static size_t text_size, text_alloc;
+
+static void
+append (const char* format, ...) __attribute__((format (printf, 1, 2)));
+
+static void
+append (const char* format, ...)
+{
+  va_list args;
+  int length;
+
+  for (;;)
+    {
+      va_start (args, format);
+      length = vsnprintf (text + text_size, text_alloc - text_size, format, args);
+      va_end (args);
+
+      if (length < text_alloc - text_size)
+        break;
+
+      text_alloc = text_alloc * 2 + 65536;
+
+      if (!(text = realloc (text, text_alloc)))
+        err (EX_OSERR, "realloc failed");
+    }
+
+  text_size += length;
+}
+
+/* Builds a datafile resembling that of a large master: many hosts with the
+   usual plugins, some of them with hundreds of fields */
+static void
+generate (size_t target_size)
+{
+  static const char* plugins[] = { "cpu", "load", "memory", "df", "if_eth0", "diskstats_iops", "netstat" };
+  size_t host, plugin, field, field_count;
+
+  append ("version 1.4.0\ndbdir /var/lib/munin\nhtmldir /var/www/munin\n");
+
+  for (host = 0; text_size < target_size; ++host)
+    {
+      const char* domain = (host % 3) ? "example.org" : "example.com";
+
+      for (plugin = 0; plugin < sizeof (plugins) / sizeof (plugins[0]); ++plugin)
+        {
+          const char* name = plugins[plugin];
+
+          append ("%s;node%zu.%s:%s.graph_title %s on node%zu\n", domain, host, domain, name, name, host);
+          append ("%s;node%zu.%s:%s.graph_args --base 1000 -l 0\n", domain, host, domain, name);
+          append ("%s;node%zu.%s:%s.graph_vlabel per ${graph_period}\n", domain, host, domain, name);
+          append ("%s;node%zu.%s:%s.graph_category system\n", domain, host, domain, name);
+
+          field_count = (plugin == 5) ? 200 : 8;
+
+          for (field = 0; field < field_count; ++field)
+            {
+              append ("%s;node%zu.%s:%s.f%zu.label field %zu\n", domain, host, domain, name, field, field);
+              append ("%s;node%zu.%s:%s.f%zu.draw %s\n", domain, host, domain, name, field, field ? "STACK" : "AREA");
+              append ("%s;node%zu.%s:%s.f%zu.type DERIVE\n", domain, host, domain, name, field);
+              append ("%s;node%zu.%s:%s.f%zu.min 0\n", domain, host, domain, name, field);
+              append ("%s;node%zu.%s:%s.f%zu.warning %zu\n", domain, host, domain, name, field, field * 10);
+            }
+        }
+    }
+}
+
+/* Summarizes the parse result, with strings identified by their offset
+   into the parsed buffer */
+static unsigned long long
+fingerprint (const char* base)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  size_t i, j;
+
+#define mix(value) hash = (hash ^ (unsigned long long) (value)) * 0x100000001b3ULL
+#define mix_string(string) mix ((string) ? (string) - base : -1)
+
+  for (i = 0; i < graph_count; ++i)
+    {
+      const struct graph* g = &graphs[i];
+
+      mix_string (g->domain); mix_string (g->host); mix_string (g->name);
+      mix_string (g->title); mix_string (g->vlabel); mix_string (g->category);
+      mix (g->base); mix (g->precision); mix (g->has_lower_limit);
+      mix (g->curve_count);
+
+      for (j = 0; j < g->curve_count; ++j)
+        {
+          const struct curve* c = &g->curves[j];
+
+          mix_string (c->name); mix_string (c->label); mix_string (c->draw);
+          mix_string (c->type); mix (c->has_min); mix (c->min * 1000);
+          mix (c->warning * 1000);
+        }
+    }
+
+#undef mix_string
+#undef mix
+
+  return hash;
+}
+
+static void
+reset ()
+{
+  size_t i;
+
+  for (i = 0; i < graph_count; ++i)
+    free (graphs[i].curve_hash);
+
+  arena_free (&parse_arena);
+
+  free (graphs);
+  graphs = 0;
+  graph_count = 0;
+  graph_alloc = 0;
+}
+
+/* Times parse_datafile() on a SIZE byte datafile with 1, 2, 4, ...
+   MAX_THREADS threads, checking each result against the serial parse */
+static void
+run (size_t size, size_t max_threads)
+{
+  struct timeval start, end;
+  size_t threads, round;
+  unsigned long long serial_fingerprint = 0;
+  double serial_time = 0;
+  char* buffer;
+  char* in;
+
+  text_size = 0;
+  generate (size);
+
+  if (!(buffer = malloc (text_size + 1)))
+    err (EX_OSERR, "malloc failed");
+
+  printf ("%.1f MB synthetic datafile\n\n", text_size / 1048576.0);
+  printf ("%8s %8s %10s %10s %8s\n", "threads", "chunks", "seconds", "MB/s", "speedup");
+
+  for (threads = 1; ; threads = (threads * 2 < max_threads) ? threads * 2 : max_threads)
+    {
+      double best = 0;
+
+      for (round = 0; round < 3; ++round)
+        {
+          double elapsed;
+
+          memcpy (buffer, text, text_size + 1);
+          in = strchr (buffer, '\n') + 1;
+
+          parse_thread_count = threads;
+
+          gettimeofday (&start, 0);
+          parse_datafile (in, buffer + text_size, "synthetic");
+          gettimeofday (&end, 0);
+
+          elapsed = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) * 1.0e-6;
+
+          if (!round || elapsed < best)
+            best = elapsed;
+
+          if (threads == 1 && !round)
+            serial_fingerprint = fingerprint (buffer);
+          else if (fingerprint (buffer) != serial_fingerprint)
+            errx (EXIT_FAILURE, "Result with %zu threads differs from serial parse", threads);
+
+          reset ();
+        }
+
+      if (threads == 1)
+        serial_time = best;
+
+      printf ("%8zu %8zu %10.3f %10.1f %7.2fx\n", threads, parse_chunk_count, best,
+              text_size / best / 1048576.0, serial_time / best);
+
+      if (threads >= max_threads)
+        break;
+    }
+
+  printf ("\n");
+
+  free (buffer);
+}
+
+int
+main (int argc, char** argv)
+{
+  size_t size_mb, max_threads;
+  long cpu_count;
+
+  size_mb = (argc > 1) ? strtol (argv[1], 0, 0) : 256;
+  max_threads = (argc > 2) ? strtol (argv[2], 0, 0) : 16;
+  cpu_count = sysconf (_SC_NPROCESSORS_ONLN);
+
+  cur_version = ver_1_4;
+
+  printf ("%ld online CPUs", cpu_count);
+
+  if (max_threads > cpu_count)
+    printf (", so runs with more than %ld threads only show overhead", cpu_count);
+
+  printf ("\n\n");
+
+  /* A datafile of a typical master, which must stay on the serial path */
+  run (2 << 20, max_threads);
+
+  run (size_mb << 20, max_threads);
+
+  free (text);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,592 @@
+/*  Read-ahead of the RRD files of upcoming graphs.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined (__linux__) && defined (__has_include)
+# if __has_include (<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  ifdef __NR_io_uring_setup
+#   define HAVE_IO_URING 1
+#  endif
+# endif
+#endif
+
+#include "arena.h"
+#include "dirindex.h"
+#include "graph.h"
+#include "layout.h"
+#include "munin.h"
+#include "prefetch.h"
+
+/* While a worker draws one graph, the RRD files of the graphs it will
+   draw next are read into the page cache, so that rrd_parse() and
+   rrd_iterator_fetch() find them there.  Up to DEPTH files are in
+   flight at a time.
+
+   When rrd_parse() maps whole files, each file is handed to
+   posix_fadvise(), which starts reading it without waiting and without
+   copying it anywhere.  In pread mode, with io_uring, each file is
+   first read up to its value list.  The RRA pointers found there give
+   the rows that will be drawn, which are then read in a second round.
+   Without io_uring, the head is handed to posix_fadvise().
+
+   Each file in flight has a slot, whose buffers are kept for the next
+   file.  The rows are only read to bring them into the page cache, so
+   all reads of one file share a buffer.  */
+
+size_t prefetch_files, prefetch_bytes;
+
+struct prefetch_path
+{
+  char* path;
+  size_t width, update_rate;
+};
+
+struct prefetch_file
+{
+  /* -1 if the slot is free */
+  int fd;
+
+  size_t width, update_rate;
+  const struct rrd_layout* layout;
+  unsigned char* prefix;
+  size_t prefix_size, prefix_alloc;
+  unsigned char* rows;
+  size_t rows_alloc;
+  unsigned int pending;
+};
+
+static size_t depth;
+static size_t next_graph;
+
+/* Paths of upcoming files, oldest first */
+static struct prefetch_path* queue;
+static size_t queue_first, queue_count, queue_alloc;
+
+static size_t files_in_flight;
+
+/* Holds paths while a graph is queued */
+static struct arena path_arena;
+
+#if HAVE_IO_URING
+/* DEPTH slots for files read through io_uring */
+static struct prefetch_file* slots;
+
+static struct
+{
+  int fd;
+
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  void* sq_map;
+  void* cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+
+  unsigned int to_submit;
+} ring = { -1 };
+
+static int
+ring_setup (unsigned int entries)
+{
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+
+  if (-1 == (ring.fd = syscall (__NR_io_uring_setup, entries, &params)))
+    return -1;
+
+  ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+  ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring.sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring.cq_map_size > ring.sq_map_size)
+        ring.sq_map_size = ring.cq_map_size;
+    }
+
+  ring.sq_map = mmap (0, ring.sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+
+  if (ring.sq_map == MAP_FAILED)
+    goto fail;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring.cq_map = ring.sq_map;
+  else
+    {
+      ring.cq_map = mmap (0, ring.cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+
+      if (ring.cq_map == MAP_FAILED)
+        {
+          munmap (ring.sq_map, ring.sq_map_size);
+
+          goto fail;
+        }
+    }
+
+  ring.sqes = mmap (0, ring.sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+  if (ring.sqes == MAP_FAILED)
+    {
+      if (ring.cq_map != ring.sq_map)
+        munmap (ring.cq_map, ring.cq_map_size);
+
+      munmap (ring.sq_map, ring.sq_map_size);
+
+      goto fail;
+    }
+
+  ring.sq_head = (unsigned int*) ((char*) ring.sq_map + params.sq_off.head);
+  ring.sq_tail = (unsigned int*) ((char*) ring.sq_map + params.sq_off.tail);
+  ring.sq_mask = (unsigned int*) ((char*) ring.sq_map + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned int*) ((char*) ring.sq_map + params.sq_off.array);
+  ring.cq_head = (unsigned int*) ((char*) ring.cq_map + params.cq_off.head);
+  ring.cq_tail = (unsigned int*) ((char*) ring.cq_map + params.cq_off.tail);
+  ring.cq_mask = (unsigned int*) ((char*) ring.cq_map + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*) ((char*) ring.cq_map + params.cq_off.cqes);
+
+  return 0;
+
+fail:
+
+  close (ring.fd);
+  ring.fd = -1;
+
+  return -1;
+}
+
+static void
+ring_close ()
+{
+  munmap (ring.sqes, ring.sqes_size);
+
+  if (ring.cq_map != ring.sq_map)
+    munmap (ring.cq_map, ring.cq_map_size);
+
+  munmap (ring.sq_map, ring.sq_map_size);
+  close (ring.fd);
+
+  ring.fd = -1;
+}
+
+/* Submits queued requests, and waits for at least MIN_COMPLETE of them */
+static void
+ring_enter (unsigned int min_complete)
+{
+  int ret;
+
+  while (ring.to_submit || min_complete)
+    {
+      ret = syscall (__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+
+      if (ret == -1)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+
+          errx (EXIT_FAILURE, "io_uring_enter failed: %s", strerror (errno));
+        }
+
+      ring.to_submit -= ret;
+
+      if (!ring.to_submit)
+        break;
+    }
+}
+
+/* Queues a read of SIZE bytes at OFFSET into BUFFER, which is either the
+   prefix or the row buffer of FILE.  Callers make sure there is room, by
+   keeping at most DEPTH files in flight.  */
+static void
+ring_read (struct prefetch_file* file, void* buffer, size_t size, off_t offset)
+{
+  struct io_uring_sqe* sqe;
+  unsigned int tail, index;
+
+  tail = *ring.sq_tail;
+  index = tail & *ring.sq_mask;
+  sqe = &ring.sqes[index];
+
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = file->fd;
+  sqe->addr = (uintptr_t) buffer;
+  sqe->len = size;
+  sqe->off = offset;
+  /* The slot number, and whether this is the read of the prefix */
+  sqe->user_data = ((uint64_t) (file - slots) << 1) | (buffer == file->prefix);
+
+  ring.sq_array[index] = index;
+  __atomic_store_n (ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  ++ring.to_submit;
+  ++file->pending;
+}
+
+static void
+file_done (struct prefetch_file* file)
+{
+  close (file->fd);
+  file->fd = -1;
+
+  --files_in_flight;
+}
+
+/* Makes *BUFFER, holding *ALLOC bytes, hold at least SIZE bytes */
+static void
+buffer_reserve (unsigned char** buffer, size_t* alloc, size_t size)
+{
+  if (*alloc >= size)
+    return;
+
+  free (*buffer);
+
+  if (!(*buffer = malloc (size)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  *alloc = size;
+}
+
+/* Reads the rows that will be drawn, now that the RRA pointers are known.
+   The first pass only finds the size of the row buffer, which must not
+   change once reads into it are queued.  */
+static void
+read_rows (struct prefetch_file* file)
+{
+  static const enum cf_type cfs[] = { cf_average, cf_minimum, cf_maximum };
+  const unsigned long* rra_ptrs;
+  struct rrd_range ranges[2];
+  size_t pass, i, j, k, count, size = 0;
+
+  rra_ptrs = (const unsigned long*) (file->prefix + file->layout->rra_ptrs);
+
+  for (pass = 0; pass < 2; ++pass)
+    {
+      if (pass == 1)
+        buffer_reserve (&file->rows, &file->rows_alloc, size);
+
+      for (i = 0; i < period_count; ++i)
+        {
+          size_t interval;
+
+          if (!(interval = period_interval (i, file->update_rate, file->width)))
+            continue;
+
+          for (j = 0; j < sizeof (cfs) / sizeof (cfs[0]); ++j)
+            {
+              count = rrd_layout_ranges (file->layout, rra_ptrs, cfs[j], interval,
+                                         file->width, ranges);
+
+              for (k = 0; k < count; ++k)
+                {
+                  if (!pass)
+                    {
+                      if (ranges[k].size > size)
+                        size = ranges[k].size;
+                    }
+                  else
+                    ring_read (file, file->rows, ranges[k].size, ranges[k].offset);
+                }
+            }
+        }
+    }
+}
+
+/* Handles all finished reads, without waiting */
+static void
+ring_reap ()
+{
+  unsigned int head;
+
+  head = *ring.cq_head;
+
+  while (head != __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+      struct prefetch_file* file = &slots[cqe->user_data >> 1];
+      int res = cqe->res;
+
+      __atomic_store_n (ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+      if (res > 0)
+        prefetch_bytes += res;
+
+      --file->pending;
+
+      if ((cqe->user_data & 1) && file->layout && res == file->prefix_size)
+        read_rows (file);
+
+      if (!file->pending)
+        file_done (file);
+    }
+}
+#endif /* HAVE_IO_URING */
+
+static void
+start_file (const struct prefetch_path* entry)
+{
+  const struct rrd_layout* layout;
+  struct stat st;
+  size_t size;
+  int fd;
+
+  if (-1 == (fd = dir_index_open (entry->path)))
+    return;
+
+  if (-1 == fstat (fd, &st) || !st.st_size)
+    {
+      close (fd);
+
+      return;
+    }
+
+  ++prefetch_files;
+
+  layout = layout_lookup (&st);
+
+  if (!rrd_use_pread)
+    size = st.st_size;
+  else if (layout)
+    size = layout->values;
+  else
+    size = (st.st_size < RRD_HEAD_SIZE) ? st.st_size : RRD_HEAD_SIZE;
+
+#if HAVE_IO_URING
+  if (ring.fd != -1)
+    {
+      struct prefetch_file* file;
+
+      /* There are fewer than DEPTH files in flight */
+      for (file = slots; file->fd != -1; ++file)
+        ;
+
+      buffer_reserve (&file->prefix, &file->prefix_alloc, size);
+
+      file->fd = fd;
+      file->width = entry->width;
+      file->update_rate = entry->update_rate;
+      file->layout = layout;
+      file->prefix_size = size;
+
+      ++files_in_flight;
+
+      ring_read (file, file->prefix, size, 0);
+
+      return;
+    }
+#endif
+
+  posix_fadvise (fd, 0, size, POSIX_FADV_WILLNEED);
+  prefetch_bytes += size;
+
+  close (fd);
+}
+
+static void
+queue_graph (const struct graph* g)
+{
+  size_t i, first;
+
+  if (g->nograph)
+    return;
+
+  first = queue_count;
+
+  for (i = 0; i < g->curve_count; ++i)
+    {
+      char* path;
+      size_t j;
+
+      if (!(path = curve_rrd_path (g, &g->curves[i], &path_arena)))
+        continue;
+
+      /* Curves may read different data sources of one file */
+      for (j = first; j < queue_count; ++j)
+        {
+          if (!strcmp (queue[queue_first + j].path, path))
+            break;
+        }
+
+      if (j < queue_count)
+        continue;
+
+      if (queue_first + queue_count == queue_alloc)
+        {
+          memmove (queue, queue + queue_first, sizeof (*queue) * queue_count);
+          queue_first = 0;
+
+          if (queue_count == queue_alloc)
+            {
+              queue_alloc = queue_alloc * 3 / 2 + 16;
+
+              if (!(queue = realloc (queue, sizeof (*queue) * queue_alloc)))
+                errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+            }
+        }
+
+      if (!(queue[queue_first + queue_count].path = strdup (path)))
+        errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+      queue[queue_first + queue_count].width = plot_width (g);
+      queue[queue_first + queue_count].update_rate = g->update_rate;
+      ++queue_count;
+    }
+
+  arena_reset (&path_arena);
+}
+
+/* Prepares read-ahead of up to DEPTH files at a time, using io_uring if
+   the kernel has it.  Returns the method used.  */
+const char*
+prefetch_init (size_t new_depth)
+{
+  depth = new_depth;
+  next_graph = 0;
+
+  if (!depth)
+    return "off";
+
+#if HAVE_IO_URING
+  /* Whole files are left to posix_fadvise(), as there is nothing to
+     learn from reading them first */
+  if (rrd_use_pread)
+    {
+      size_t entries, reads_per_file, i;
+
+      /* Every file needs one read for its head, and at most two for each
+         window it draws */
+      reads_per_file = 1 + period_count * 3 * 2;
+
+      for (entries = 1; entries < depth * reads_per_file && entries < 32768; entries <<= 1)
+        ;
+
+      if (0 == ring_setup (entries))
+        {
+          if (depth > entries / reads_per_file)
+            depth = entries / reads_per_file;
+
+          if (!(slots = calloc (depth, sizeof (*slots))))
+            errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+          for (i = 0; i < depth; ++i)
+            slots[i].fd = -1;
+
+          return "io_uring";
+        }
+    }
+#endif
+
+  return "fadvise";
+}
+
+/* Called before drawing graph number GRAPH_INDEX, with the graphs of this
+   worker being STEP apart.  Queues the files of the graphs that come
+   after it, and starts as many of them as there is room for.  */
+void
+prefetch_advance (size_t graph_index, size_t step)
+{
+  if (!depth)
+    return;
+
+#if HAVE_IO_URING
+  if (ring.fd != -1)
+    ring_reap ();
+#endif
+
+  if (next_graph <= graph_index)
+    next_graph = graph_index + step;
+
+  while (queue_count < depth && next_graph < graph_count)
+    {
+      queue_graph (&graphs[next_graph]);
+      next_graph += step;
+    }
+
+  while (queue_count && files_in_flight < depth)
+    {
+      start_file (&queue[queue_first]);
+      free (queue[queue_first].path);
+
+      ++queue_first;
+      --queue_count;
+    }
+
+#if HAVE_IO_URING
+  if (ring.fd != -1)
+    ring_enter (0);
+#endif
+}
+
+/* Waits for reads in flight and releases everything */
+void
+prefetch_finish ()
+{
+#if HAVE_IO_URING
+  size_t i;
+
+  if (ring.fd != -1)
+    {
+      while (files_in_flight)
+        {
+          ring_enter (1);
+          ring_reap ();
+        }
+
+      ring_close ();
+
+      for (i = 0; i < depth; ++i)
+        {
+          free (slots[i].prefix);
+          free (slots[i].rows);
+        }
+
+      free (slots);
+      slots = 0;
+    }
+#endif
+
+  while (queue_count)
+    {
+      free (queue[queue_first++].path);
+      --queue_count;
+    }
+
+  free (queue);
+  queue = 0;
+  queue_first = queue_alloc = 0;
+
+  arena_free (&path_arena);
+  depth = 0;
+}
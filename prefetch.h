@@ -0,0 +1,17 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_ 1
+
+#include <stdlib.h>
+
+extern size_t prefetch_files, prefetch_bytes;
+
+const char*
+prefetch_init (size_t depth);
+
+void
+prefetch_advance (size_t graph_index, size_t step);
+
+void
+prefetch_finish ();
+
+#endif /* !PREFETCH_H_ */
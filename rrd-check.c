@@ -0,0 +1,556 @@
+/*  Tests of reading RRD files, on small files written by the test.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "dirindex.h"
+#include "layout.h"
+#include "rrd.h"
+
+/* All fixtures end their last row at this time, which is a whole number
+   of days */
+#define LAST_UP 1262304000
+
+struct fixture_rra
+{
+  const char* cf;
+  unsigned long pdp_count, row_count;
+
+  /* The value of the row AGE rows before the last one */
+  double (*value) (size_t age);
+};
+
+static char* directory;
+
+/* Writes an RRD file with one data source and 300 second steps to PATH,
+   in the format of `rrdtool create'.  The RRA pointers are set to a
+   third of each archive, so that the archives wrap around.  The file is
+   rewritten in place if it exists, keeping its inode.  Directory listings
+   are dropped, so that a new file is found.  */
+static void
+write_rrd (const char* path, const struct fixture_rra* rras, size_t rra_count)
+{
+  struct rrd_header header;
+  struct ds_def ds_def;
+  struct rra_def rra_def;
+  struct live_header live_header;
+  struct pdp_prepare pdp_prep;
+  struct cdp_prepare cdp_prep;
+  unsigned long rra_ptr;
+  size_t i, row;
+  FILE* f;
+
+  if (!(f = fopen (path, "r+")) && !(f = fopen (path, "w")))
+    err (EX_CANTCREAT, "Failed to open '%s' for writing", path);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.cookie, "RRD", 4);
+  memcpy (header.version, "0003", 5);
+  header.float_cookie = 8.642135E130;
+  header.ds_count = 1;
+  header.rra_count = rra_count;
+  header.pdp_step = 300;
+  fwrite (&header, sizeof (header), 1, f);
+
+  memset (&ds_def, 0, sizeof (ds_def));
+  strcpy (ds_def.ds_name, "42");
+  strcpy (ds_def.dst, "GAUGE");
+  ds_def.par[0].u_count = 600;
+  ds_def.par[1].u_val = NAN;
+  ds_def.par[2].u_val = NAN;
+  fwrite (&ds_def, sizeof (ds_def), 1, f);
+
+  for (i = 0; i < rra_count; ++i)
+    {
+      memset (&rra_def, 0, sizeof (rra_def));
+      strcpy (rra_def.cf_name, rras[i].cf);
+      rra_def.row_count = rras[i].row_count;
+      rra_def.pdp_count = rras[i].pdp_count;
+      rra_def.par[0].u_val = 0.5;
+      fwrite (&rra_def, sizeof (rra_def), 1, f);
+    }
+
+  live_header.last_up = LAST_UP;
+  live_header.last_up_usec = 0;
+  fwrite (&live_header, sizeof (live_header), 1, f);
+
+  memset (&pdp_prep, 0, sizeof (pdp_prep));
+  strcpy (pdp_prep.last_ds, "U");
+  fwrite (&pdp_prep, sizeof (pdp_prep), 1, f);
+
+  memset (&cdp_prep, 0, sizeof (cdp_prep));
+  cdp_prep.scratch[0].u_val = NAN;
+
+  for (i = 0; i < rra_count; ++i)
+    fwrite (&cdp_prep, sizeof (cdp_prep), 1, f);
+
+  for (i = 0; i < rra_count; ++i)
+    {
+      rra_ptr = rras[i].row_count / 3;
+      fwrite (&rra_ptr, sizeof (rra_ptr), 1, f);
+    }
+
+  for (i = 0; i < rra_count; ++i)
+    {
+      rra_ptr = rras[i].row_count / 3;
+
+      for (row = 0; row < rras[i].row_count; ++row)
+        {
+          double value;
+
+          value = rras[i].value ((rra_ptr + rras[i].row_count - row) % rras[i].row_count);
+          fwrite (&value, sizeof (value), 1, f);
+        }
+    }
+
+  if (ferror (f) | fclose (f))
+    err (EX_IOERR, "Failed to write '%s'", path);
+
+  /* The file may be newer than the directory listing */
+  dir_index_reset ();
+}
+
+static char*
+fixture_path (const char* name)
+{
+  char* result;
+
+  if (-1 == asprintf (&result, "%s/%s", directory, name))
+    err (EX_OSERR, "asprintf failed");
+
+  return result;
+}
+
+/* Checks that the last COUNT values of ITERATOR are EXPECTED */
+static void
+check_values (const char* what, const struct rrd_iterator* iterator,
+              const double* expected, size_t count)
+{
+  size_t i, first;
+  double value;
+
+  if (iterator->count - iterator->current_position != count)
+    errx (EXIT_FAILURE, "%s: %zu values, expected %zu", what,
+          iterator->count - iterator->current_position, count);
+
+  first = iterator->current_position;
+
+  for (i = 0; i < count; ++i)
+    {
+      value = rrd_iterator_peek_index (iterator, first + i);
+
+      if (value != expected[i] && !(isnan (value) && isnan (expected[i])))
+        errx (EXIT_FAILURE, "%s: value %zu is %g, expected %g", what, i, value, expected[i]);
+    }
+}
+
+static double value_one (size_t age) { return 1.0; }
+static double value_six (size_t age) { return 6.0; }
+static double value_age (size_t age) { return age; }
+static double value_age_1000 (size_t age) { return 1000.0 + age; }
+
+/* A file whose layout is in the index is set up from the stored
+   offsets.  If the file is then rewritten with other archives of the
+   same size, the stored offsets must not be used.  */
+static void
+check_layout ()
+{
+  static const double ones[4] = { 1, 1, 1, 1 };
+  static const double sixes[4] = { 6, 6, 6, 6 };
+  struct fixture_rra rras[2] =
+    {
+      { "AVERAGE", 1, 24, value_one },
+      { "AVERAGE", 6, 24, value_six }
+    };
+  struct rrd_iterator iterator;
+  struct rrd data;
+  size_t hits = layout_hits, misses = layout_misses;
+  char* path;
+
+  path = fixture_path ("layout.rrd");
+  write_rrd (path, rras, 2);
+
+  if (-1 == rrd_parse (&data, path))
+    errx (EXIT_FAILURE, "Failed to parse '%s'", path);
+
+  if (layout_misses != misses + 1 || !data.layout)
+    errx (EXIT_FAILURE, "The layout of a new file was not recorded");
+
+  rrd_free (&data);
+
+  if (-1 == rrd_parse (&data, path))
+    errx (EXIT_FAILURE, "Failed to parse '%s'", path);
+
+  if (layout_hits != hits + 1)
+    errx (EXIT_FAILURE, "The stored layout was not used");
+
+  if (-1 == rrd_iterator_create (&iterator, &data, "AVERAGE", 300, 4, 0))
+    errx (EXIT_FAILURE, "No AVERAGE archive in '%s'", path);
+
+  check_values ("stored layout", &iterator, ones, 4);
+  rrd_iterator_free (&iterator);
+  rrd_free (&data);
+
+  /* Same inode, size and counts, but the archives trade places */
+  rras[0].pdp_count = 6;
+  rras[1].pdp_count = 1;
+  write_rrd (path, rras, 2);
+
+  if (-1 == rrd_parse (&data, path))
+    errx (EXIT_FAILURE, "Failed to parse rewritten '%s'", path);
+
+  if (layout_hits != hits + 1 || layout_misses != misses + 2)
+    errx (EXIT_FAILURE, "The stored layout was used for a rewritten file");
+
+  if (-1 == rrd_iterator_create (&iterator, &data, "AVERAGE", 300, 4, 0))
+    errx (EXIT_FAILURE, "No AVERAGE archive in '%s'", path);
+
+  check_values ("rewritten file", &iterator, sixes, 4);
+  rrd_iterator_free (&iterator);
+  rrd_free (&data);
+
+  unlink (path);
+  free (path);
+}
+
+/* Parses the fixture RRAS, and checks the AVERAGE rows of INTERVAL
+   seconds that rrd_iterator_create() returns for it */
+static void
+check_archives (const char* what, const struct fixture_rra* rras, size_t rra_count,
+                size_t interval, const double* expected, size_t count)
+{
+  struct rrd_iterator iterator;
+  struct rrd data;
+  char* path;
+
+  path = fixture_path ("archives.rrd");
+  write_rrd (path, rras, rra_count);
+
+  if (-1 == rrd_parse (&data, path))
+    errx (EXIT_FAILURE, "Failed to parse '%s'", path);
+
+  if (-1 == rrd_iterator_create (&iterator, &data, "AVERAGE", interval, count, 0))
+    errx (EXIT_FAILURE, "%s: no AVERAGE archive", what);
+
+  check_values (what, &iterator, expected, count);
+  rrd_iterator_free (&iterator);
+  rrd_free (&data);
+
+  unlink (path);
+  free (path);
+}
+
+/* Without an archive of the requested resolution, rows are consolidated
+   from the nearest finer archive, or failing that, the nearest coarser
+   one.  With rrd_stitch set, a finer archive also covers the recent rows
+   of an exact one.  */
+static void
+check_fallback ()
+{
+  static const struct fixture_rra finer[] = { { "AVERAGE", 1, 60, value_age } };
+  static const struct fixture_rra coarser[] = { { "AVERAGE", 6, 10, value_age } };
+  static const struct fixture_rra stitched[] =
+    {
+      { "AVERAGE", 1, 12, value_age_1000 },
+      { "AVERAGE", 6, 10, value_age }
+    };
+  /* Averages of six rows of five minutes, oldest first */
+  static const double from_finer[5] = { 26.5, 20.5, 14.5, 8.5, 2.5 };
+  /* Each half-hour row repeated for its six five-minute rows */
+  static const double from_coarser[12] = { 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0 };
+  /* The hour the finer archive covers, in front of the exact one */
+  static const double from_both[5] = { 4, 3, 2, 1008.5, 1002.5 };
+  size_t finer_count = rrd_fallback_finer, coarser_count = rrd_fallback_coarser;
+
+  check_archives ("finer archive", finer, 1, 1800, from_finer, 5);
+
+  if (rrd_fallback_finer != finer_count + 1)
+    errx (EXIT_FAILURE, "The finer archive was not counted as a fallback");
+
+  check_archives ("coarser archive", coarser, 1, 300, from_coarser, 12);
+
+  if (rrd_fallback_coarser != coarser_count + 1)
+    errx (EXIT_FAILURE, "The coarser archive was not counted as a fallback");
+
+  rrd_stitch = 1;
+  check_archives ("stitched archives", stitched, 2, 1800, from_both, 5);
+  rrd_stitch = 0;
+
+  if (rrd_fallback_finer != finer_count + 1 || rrd_fallback_coarser != coarser_count + 1)
+    errx (EXIT_FAILURE, "Stitching onto an exact archive was counted as a fallback");
+}
+
+/* With rrd_stitch set, the ranges to prefetch leave out the recent rows
+   of the exact archive that a finer one is sure to cover */
+static void
+check_stitched_ranges ()
+{
+  static const struct fixture_rra rras[] =
+    {
+      { "AVERAGE", 1, 12, value_age_1000 },
+      { "AVERAGE", 6, 10, value_age }
+    };
+  struct rrd_range ranges[2];
+  struct rrd data;
+  size_t count, i, size;
+  char* path;
+
+  path = fixture_path ("stitched.rrd");
+  write_rrd (path, rras, 2);
+
+  if (-1 == rrd_parse (&data, path) || !data.layout)
+    errx (EXIT_FAILURE, "Failed to parse '%s' with its layout", path);
+
+  for (i = 0; i < 2; ++i)
+    {
+      rrd_stitch = i;
+      count = rrd_layout_ranges (data.layout, data.rra_ptrs, cf_average, 1800, 5, ranges);
+      size = count ? ranges[0].size : 0;
+
+      if (count == 2)
+        size += ranges[1].size;
+
+      /* The twelve finer rows span at least one of the five */
+      if (size != (5 - i) * sizeof (double))
+        errx (EXIT_FAILURE, "%s ranges: %zu bytes, expected %zu",
+              i ? "Stitched" : "Unstitched", size, (5 - i) * sizeof (double));
+    }
+
+  rrd_stitch = 0;
+  rrd_free (&data);
+
+  unlink (path);
+  free (path);
+}
+
+/* Opens PATH through the cache, and checks that its last four AVERAGE
+   rows of five minutes are EXPECTED */
+static void
+check_cached (const char* what, const char* path, double expected)
+{
+  const double values[4] = { expected, expected, expected, expected };
+  struct rrd_iterator iterator;
+  struct rrd data;
+
+  if (-1 == rrd_open (&data, path))
+    errx (EXIT_FAILURE, "%s: failed to open '%s'", what, path);
+
+  if (-1 == rrd_iterator_create (&iterator, &data, "AVERAGE", 300, 4, 0))
+    errx (EXIT_FAILURE, "%s: no AVERAGE archive in '%s'", what, path);
+
+  check_values (what, &iterator, values, 4);
+  rrd_iterator_free (&iterator);
+  rrd_close (&data);
+}
+
+/* Files kept by rrd_open() are used again while they are unchanged, and
+   hold no descriptor while unused */
+static void
+check_cache ()
+{
+  struct fixture_rra rras[1] = { { "AVERAGE", 1, 24, value_one } };
+  struct timespec times[2];
+  struct rlimit saved_limit, limit;
+  size_t hits, misses, i;
+  char name[32];
+  char* path;
+  int fd;
+
+  rrd_cache_limit = 64 << 20;
+
+  path = fixture_path ("cache.rrd");
+  write_rrd (path, rras, 1);
+
+  misses = rrd_cache_misses;
+  check_cached ("first open", path, 1);
+  hits = rrd_cache_hits;
+  check_cached ("cached file", path, 1);
+
+  if (rrd_cache_hits != hits + 1 || rrd_cache_misses != misses + 1)
+    errx (EXIT_FAILURE, "An unchanged file was not used from the cache");
+
+  /* Rewritten in place, with the same size, as munin-update does */
+  rras[0].value = value_six;
+  write_rrd (path, rras, 1);
+
+  times[0].tv_sec = times[1].tv_sec = LAST_UP + 300;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+
+  if (-1 == utimensat (AT_FDCWD, path, times, 0))
+    err (EX_OSERR, "Failed to set the time of '%s'", path);
+
+  check_cached ("updated file", path, 6);
+
+  if (rrd_cache_hits != hits + 1 || rrd_cache_misses != misses + 2)
+    errx (EXIT_FAILURE, "A changed file was used from the cache");
+
+  unlink (path);
+  free (path);
+
+  /* More cached files than descriptors */
+  if (-1 == getrlimit (RLIMIT_NOFILE, &saved_limit))
+    err (EX_OSERR, "getrlimit failed");
+
+  limit = saved_limit;
+  limit.rlim_cur = 32;
+
+  if (-1 == setrlimit (RLIMIT_NOFILE, &limit))
+    err (EX_OSERR, "setrlimit failed");
+
+  rras[0].value = value_one;
+
+  for (i = 0; i < 64; ++i)
+    {
+      sprintf (name, "cache-%zu.rrd", i);
+      path = fixture_path (name);
+      write_rrd (path, rras, 1);
+      check_cached ("one of many files", path, 1);
+      free (path);
+    }
+
+  if (-1 == (fd = open (directory, O_RDONLY)))
+    err (EXIT_FAILURE, "Unused cached files hold descriptors");
+
+  close (fd);
+
+  if (-1 == setrlimit (RLIMIT_NOFILE, &saved_limit))
+    err (EX_OSERR, "setrlimit failed");
+
+  rrd_cache_flush ();
+
+  for (i = 0; i < 64; ++i)
+    {
+      sprintf (name, "cache-%zu.rrd", i);
+      path = fixture_path (name);
+      unlink (path);
+      free (path);
+    }
+}
+
+/* A file missing from the directory listing is refused without asking
+   the file system.  A file deleted after the listing was made is still
+   in it, and must fail to open like any other missing file, which
+   rrd_parse() then skips.  */
+static void
+check_dir_index ()
+{
+  static const struct fixture_rra rras[1] = { { "AVERAGE", 1, 24, value_one } };
+  struct rrd data;
+  size_t scans, missing;
+  char* path;
+  char* absent;
+  int fd;
+
+  path = fixture_path ("deleted.rrd");
+  absent = fixture_path ("never.rrd");
+  write_rrd (path, rras, 1);
+
+  scans = dir_index_scans;
+  missing = dir_index_missing;
+
+  if (-1 == (fd = dir_index_open (path)))
+    err (EXIT_FAILURE, "Failed to open '%s' through the directory index", path);
+
+  close (fd);
+
+  if (dir_index_scans != scans + 1)
+    errx (EXIT_FAILURE, "The directory was not listed");
+
+  if (-1 != dir_index_open (absent) || errno != ENOENT)
+    errx (EXIT_FAILURE, "A file missing from the listing was opened");
+
+  unlink (path);
+
+  if (-1 != (fd = dir_index_open (path)) || errno != ENOENT)
+    errx (EXIT_FAILURE, "A file deleted after the listing was opened");
+
+  if (-1 != rrd_parse (&data, path))
+    errx (EXIT_FAILURE, "A deleted file was parsed");
+
+  /* The absent file, and both attempts at the deleted one */
+  if (dir_index_missing != missing + 3 || dir_index_scans != scans + 1)
+    errx (EXIT_FAILURE, "Missing files were not counted, or the directory was listed again");
+
+  free (absent);
+  free (path);
+}
+
+/* Runs of positions where both arrays are known, across the blocks the
+   SSE2 code handles and the tail after them */
+static void
+check_known_runs ()
+{
+  static const struct rrd_run expected[] = { { 0, 3 }, { 4, 8 }, { 18, 20 } };
+  double a[21], b[21];
+  struct rrd_run runs[11];
+  size_t i, count;
+
+  for (i = 0; i < 21; ++i)
+    {
+      a[i] = (i == 3 || (i >= 8 && i < 18)) ? NAN : i;
+      b[i] = (i == 20) ? NAN : -(double) i;
+    }
+
+  count = rrd_known_runs (a, b, 21, runs);
+
+  if (count != sizeof (expected) / sizeof (expected[0]))
+    errx (EXIT_FAILURE, "Found %zu known runs, expected %zu", count,
+          sizeof (expected) / sizeof (expected[0]));
+
+  for (i = 0; i < count; ++i)
+    {
+      if (runs[i].begin != expected[i].begin || runs[i].end != expected[i].end)
+        errx (EXIT_FAILURE, "Known run %zu is [%zu, %zu), expected [%zu, %zu)", i,
+              runs[i].begin, runs[i].end, expected[i].begin, expected[i].end);
+    }
+}
+
+int
+main (int argc, char** argv)
+{
+  if (!(directory = strdup ("rrd-check.XXXXXX")) || !mkdtemp (directory))
+    err (EX_CANTCREAT, "Failed to create a temporary directory");
+
+  for (rrd_use_pread = 0; rrd_use_pread < 2; ++rrd_use_pread)
+    {
+      check_layout ();
+      check_fallback ();
+      check_stitched_ranges ();
+      check_cache ();
+    }
+
+  check_dir_index ();
+
+  check_known_runs ();
+
+  if (-1 == rmdir (directory))
+    err (EX_IOERR, "Failed to remove '%s'", directory);
+
+  free (directory);
+
+  return EXIT_SUCCESS;
+}
@@ -17,29 +17,238 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dirindex.h"
+#include "layout.h"
 #include "rrd.h"
 
+int rrd_use_pread;
+int rrd_stitch;
+size_t rrd_bytes_read;
+size_t rrd_fallback_finer, rrd_fallback_coarser;
+
+enum cf_type
+rrd_cf_type (const char* cf_name)
+{
+  if (!strcmp (cf_name, "AVERAGE"))
+    return cf_average;
+
+  if (!strcmp (cf_name, "MIN"))
+    return cf_minimum;
+
+  if (!strcmp (cf_name, "MAX"))
+    return cf_maximum;
+
+  if (!strcmp (cf_name, "LAST"))
+    return cf_last;
+
+  return cf_unknown;
+}
+
+static int
+rrd_version (const struct rrd_header* header)
+{
+  return (header->version[0] - '0') * 1000
+    + (header->version[1] - '0') * 100
+    + (header->version[2] - '0') * 10
+    + (header->version[3] - '0');
+}
+
+/* Reads SIZE bytes at OFFSET, failing on errors and early end-of-file */
+static int
+rrd_pread (int fd, void* buffer, size_t size, off_t offset)
+{
+  ssize_t ret;
+
+  while (size)
+    {
+      if (-1 == (ret = pread (fd, buffer, size, offset)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          return -1;
+        }
+
+      if (!ret)
+        {
+          errno = EIO;
+
+          return -1;
+        }
+
+      rrd_bytes_read += ret;
+      buffer = (char*) buffer + ret;
+      offset += ret;
+      size -= ret;
+    }
+
+  return 0;
+}
+
+/* Reads everything in front of the value list into DATA, which spans the
+   whole file.  Without a LAYOUT the size of that part is computed from
+   the header.  */
+static int
+rrd_read_prefix (int fd, unsigned char* data, size_t file_size,
+                 const struct rrd_layout* layout)
+{
+  const struct rrd_header* header = (const struct rrd_header*) data;
+  size_t size, prefix;
+
+  size = layout ? layout->values : (file_size < RRD_HEAD_SIZE ? file_size : RRD_HEAD_SIZE);
+
+  if (-1 == rrd_pread (fd, data, size, 0))
+    return -1;
+
+  if (layout || size < sizeof (*header)
+      || header->ds_count > file_size || header->rra_count > file_size)
+    return 0;
+
+  prefix = sizeof (*header)
+    + header->ds_count * (sizeof (struct ds_def) + sizeof (struct pdp_prepare))
+    + header->rra_count * (sizeof (struct rra_def) + sizeof (unsigned long))
+    + header->ds_count * header->rra_count * sizeof (struct cdp_prepare)
+    + (rrd_version (header) >= 3 ? sizeof (struct live_header) : sizeof (time_t));
+
+  if (prefix > file_size)
+    prefix = file_size;
+
+  if (prefix > size)
+    return rrd_pread (fd, data + size, prefix - size, size);
+
+  return 0;
+}
+
+/* Fills in RESULT from the layout found by an earlier full parse of the
+   same file, skipping the checks of rrd_parse() */
+static void
+rrd_apply_layout (struct rrd* result, const struct rrd_layout* layout, unsigned char* data)
+{
+  result->ds_defs = (void*) (data + layout->ds_defs);
+  result->rra_defs = (void*) (data + layout->rra_defs);
+
+  if (layout->version >= 3)
+    memcpy (&result->live_header, data + layout->live_header, sizeof (result->live_header));
+  else
+    {
+      time_t val;
+
+      memcpy (&val, data + layout->live_header, sizeof (val));
+
+      result->live_header.last_up = val;
+      result->live_header.last_up_usec = 0;
+    }
+
+  result->pdp_preps = (void*) (data + layout->pdp_preps);
+  result->cdp_preps = (void*) (data + layout->cdp_preps);
+  result->rra_ptrs = (void*) (data + layout->rra_ptrs);
+  result->values = (void*) (data + layout->values);
+  result->layout = layout;
+}
+
+/* Records the layout of a fully parsed RRD file in the layout index.
+   Files whose offsets or counts do not fit the index are left out.  */
+static void
+rrd_record_layout (struct rrd* result, const struct stat* st, int version,
+                   const unsigned char* live_header)
+{
+  struct rrd_layout* layout;
+  const unsigned char* data = result->data;
+  size_t i, offset = 0;
+
+  if (st->st_size > UINT32_MAX
+      || result->header.pdp_step > UINT32_MAX)
+    return;
+
+  for (i = 0; i < result->header.rra_count; ++i)
+    if (result->rra_defs[i].pdp_count > UINT32_MAX)
+      return;
+
+  layout = layout_alloc (result->header.rra_count);
+
+  layout->device = st->st_dev;
+  layout->inode = st->st_ino;
+  layout->file_size = st->st_size;
+  layout->version = version;
+  layout->ds_count = result->header.ds_count;
+  layout->rra_count = result->header.rra_count;
+  layout->pdp_step = result->header.pdp_step;
+  layout->ds_defs = (const unsigned char*) result->ds_defs - data;
+  layout->rra_defs = (const unsigned char*) result->rra_defs - data;
+  layout->live_header = live_header - data;
+  layout->pdp_preps = (const unsigned char*) result->pdp_preps - data;
+  layout->cdp_preps = (const unsigned char*) result->cdp_preps - data;
+  layout->rra_ptrs = (const unsigned char*) result->rra_ptrs - data;
+  layout->values = (const unsigned char*) result->values - data;
+  layout->defs_checksum = layout_defs_checksum (data, layout);
+
+  for (i = 0; i < result->header.rra_count; ++i)
+    {
+      struct rrd_archive* a = &layout->archives[i];
+
+      a->cf = rrd_cf_type (result->rra_defs[i].cf_name);
+      a->pdp_count = result->rra_defs[i].pdp_count;
+      a->row_count = result->rra_defs[i].row_count;
+      a->offset = offset;
+
+      offset += result->rra_defs[i].row_count * result->header.ds_count;
+    }
+
+  layout_insert (layout);
+  result->layout = layout;
+}
+
+/* Sets up on-demand reading of the values for files opened in pread
+   mode, keeping FD open until rrd_free() */
+static int
+rrd_finish (struct rrd* result, int fd)
+{
+  size_t row_size, row_count;
+
+  if (fd == -1)
+    return 0;
+
+  row_size = (result->header.ds_count ? result->header.ds_count : 1) * sizeof (double);
+  row_count = (result->file_size - ((unsigned char*) result->values - (unsigned char*) result->data)) / row_size;
+
+  if (!(result->fetched = calloc (row_count / 8 + 1, 1)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  result->fd = fd;
+
+  return 0;
+}
+
 int
 rrd_parse (struct rrd* result, const char* filename)
 {
+  const struct rrd_layout* layout;
+  struct stat st;
   off_t file_size;
   size_t i, data_size = 0;
   void* data;
   unsigned char* input;
   unsigned char* end;
+  unsigned char* live_header;
   int fd;
 
   /* To facilitate free-ing of incompletely loaded RRDs */
   memset (result, 0, sizeof (struct rrd));
 
-  if (-1 == (fd = open (filename, O_RDONLY)))
+  if (-1 == (fd = dir_index_open (filename)))
     {
       /* Silently ignore ENOENT like munin-graph does */
       if (errno == ENOENT)
@@ -50,27 +259,95 @@ rrd_parse (struct rrd* result, const char* filename)
       return -1;
     }
 
-  if (-1 == (file_size = lseek (fd, 0, SEEK_END)))
+  if (-1 == fstat (fd, &st))
     {
-      fprintf (stderr, "Seek failed on '%s': %s\n", filename, strerror (errno));
+      fprintf (stderr, "Stat failed on '%s': %s\n", filename, strerror (errno));
 
       close (fd);
 
       return -1;
     }
 
-  data = mmap (0, file_size,  PROT_READ, MAP_SHARED, fd, 0);
-  madvise (data, file_size, MADV_WILLNEED);
+  file_size = st.st_size;
+  layout = layout_find (&st);
+
+  result->device = st.st_dev;
+  result->inode = st.st_ino;
+  result->mtime = st.st_mtim;
+
+  if (rrd_use_pread)
+    {
+      /* Only the part in front of the values is read here.  The values
+         are left as untouched zero pages until rrd_iterator_fetch()
+         reads the rows that are actually drawn.  */
+      data = mmap (0, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (data != MAP_FAILED
+          && -1 == rrd_read_prefix (fd, data, file_size, layout))
+        {
+          fprintf (stderr, "Read failed on '%s': %s\n", filename, strerror (errno));
+
+          munmap (data, file_size);
+          close (fd);
+
+          return -1;
+        }
+    }
+  else
+    {
+      data = mmap (0, file_size,  PROT_READ, MAP_SHARED, fd, 0);
+      madvise (data, file_size, MADV_WILLNEED);
+
+      close (fd);
+      fd = -1;
 
-  close (fd);
+      if (data != MAP_FAILED)
+        rrd_bytes_read += file_size;
+    }
 
   if (data == MAP_FAILED)
     {
       fprintf (stderr, "Memory map failed on '%s': %s\n", filename, strerror (errno));
 
+      if (fd != -1)
+        close (fd);
+
       return -1;
     }
 
+  /* Files whose layout is known only need their header and definitions
+     compared */
+  if (layout)
+    {
+      memcpy (&result->header, data, sizeof (result->header));
+
+      if (!memcmp ("RRD", result->header.cookie, 4)
+          && result->header.float_cookie == 8.642135E130
+          && result->header.ds_count == layout->ds_count
+          && result->header.rra_count == layout->rra_count
+          && result->header.pdp_step == layout->pdp_step
+          && layout->defs_checksum == layout_defs_checksum (data, layout))
+        {
+          rrd_apply_layout (result, layout, data);
+
+          result->data = data;
+          result->file_size = file_size;
+
+          return rrd_finish (result, fd);
+        }
+
+      /* The layout is stale, so the wrong amount may have been read */
+      --layout_hits;
+      ++layout_misses;
+
+      if (fd != -1 && -1 == rrd_read_prefix (fd, data, file_size, 0))
+        {
+          fprintf (stderr, "Read failed on '%s': %s\n", filename, strerror (errno));
+
+          goto fail;
+        }
+    }
+
   input = (unsigned char*) data;
   end = input + file_size;
 
@@ -93,10 +370,7 @@ rrd_parse (struct rrd* result, const char* filename)
       goto fail;
     }
 
-  int version = (result->header.version[0] - '0') * 1000
-    + (result->header.version[1] - '0') * 100
-    + (result->header.version[2] - '0') * 10
-    + (result->header.version[3] - '0');
+  int version = rrd_version (&result->header);
 
   if (version < 1 || version > 3)
     {
@@ -147,6 +421,8 @@ rrd_parse (struct rrd* result, const char* filename)
         }
     }
 
+  live_header = input;
+
   if (version >= 3)
     {
       test_end (input + sizeof (result->live_header), "live header");
@@ -203,10 +479,15 @@ rrd_parse (struct rrd* result, const char* filename)
   result->data = data;
   result->file_size = file_size;
 
-  return 0;
+  rrd_record_layout (result, &st, version, live_header);
+
+  return rrd_finish (result, fd);
 
 fail:
 
+  if (fd != -1)
+    close (fd);
+
   munmap (data, file_size);
   memset (result, 0, sizeof (struct rrd));
 
@@ -219,40 +500,1263 @@ rrd_free (struct rrd* data)
   if (data->file_size)
     munmap (data->data, data->file_size);
 
+  if (data->fetched)
+    {
+      if (data->fd != -1)
+        close (data->fd);
+
+      free (data->fetched);
+    }
+
   memset (data, 0, sizeof (struct rrd));
 }
 
-int
-rrd_iterator_create (struct rrd_iterator* result, const struct rrd* data,
-                    const char* cf_name, size_t interval,
-                    size_t max_count)
+/* Files opened with rrd_open() are kept mapped after their last user
+   closes them, so that curves and graphs reading the same file, which
+   the graph order places close together, need not parse it again.
+   Unused files are unmapped least recently used first when more than
+   rrd_cache_limit bytes are mapped.  Each worker process has a cache of
+   its own.
+
+   An unused file holds no descriptor, so that the number of cached files
+   is not bounded by the descriptor limit.  When it is taken into use
+   again, it is reopened, and parsed anew if it is no longer the same
+   file with the same size and modification time.  Otherwise its header
+   and rows, including the rows read in pread mode, are still current.  */
+struct rrd_cache_entry
 {
-  size_t rra;
-  size_t offset = 0;
+  char* path;
+  struct rrd data;
+  size_t references;
+
+  /* Next entry in the same hash bucket */
+  struct rrd_cache_entry* next_in_bucket;
+
+  /* Neighbours in the list of unused entries, least recently used
+     first */
+  struct rrd_cache_entry* prev_unused;
+  struct rrd_cache_entry* next_unused;
+};
+
+size_t rrd_cache_limit = 64 << 20;
+size_t rrd_cache_hits, rrd_cache_misses;
+
+static struct rrd_cache_entry** rrd_cache_buckets;
+static size_t rrd_cache_bucket_count, rrd_cache_count;
+static struct rrd_cache_entry* rrd_cache_first_unused;
+static struct rrd_cache_entry* rrd_cache_last_unused;
+static size_t rrd_cache_bytes;
+
+static size_t
+rrd_cache_hash (const char* string)
+{
+  size_t hash = 0xcbf29ce484222325ULL;
 
-  memset (result, 0, sizeof (*result));
+  while (*string)
+    hash = (hash ^ (unsigned char) *string++) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+static struct rrd_cache_entry**
+rrd_cache_bucket (const char* path)
+{
+  return &rrd_cache_buckets[rrd_cache_hash (path) & (rrd_cache_bucket_count - 1)];
+}
+
+static void
+rrd_cache_rehash (size_t bucket_count)
+{
+  struct rrd_cache_entry** old_buckets = rrd_cache_buckets;
+  struct rrd_cache_entry* entry;
+  size_t i, old_count = rrd_cache_bucket_count;
+
+  if (!(rrd_cache_buckets = calloc (bucket_count, sizeof (*rrd_cache_buckets))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  rrd_cache_bucket_count = bucket_count;
+
+  for (i = 0; i < old_count; ++i)
+    {
+      while ((entry = old_buckets[i]))
+        {
+          struct rrd_cache_entry** bucket = rrd_cache_bucket (entry->path);
+
+          old_buckets[i] = entry->next_in_bucket;
+          entry->next_in_bucket = *bucket;
+          *bucket = entry;
+        }
+    }
+
+  free (old_buckets);
+}
+
+static void
+rrd_cache_unlink_unused (struct rrd_cache_entry* entry)
+{
+  if (entry->prev_unused)
+    entry->prev_unused->next_unused = entry->next_unused;
+  else
+    rrd_cache_first_unused = entry->next_unused;
+
+  if (entry->next_unused)
+    entry->next_unused->prev_unused = entry->prev_unused;
+  else
+    rrd_cache_last_unused = entry->prev_unused;
+
+  entry->prev_unused = 0;
+  entry->next_unused = 0;
+}
+
+static void
+rrd_cache_evict (struct rrd_cache_entry* entry)
+{
+  struct rrd_cache_entry** bucket;
+
+  for (bucket = rrd_cache_bucket (entry->path); *bucket != entry; bucket = &(*bucket)->next_in_bucket)
+    ;
+
+  *bucket = entry->next_in_bucket;
+  --rrd_cache_count;
+
+  rrd_cache_unlink_unused (entry);
+  rrd_cache_bytes -= entry->data.file_size;
+
+  rrd_free (&entry->data);
+  free (entry->path);
+  free (entry);
+}
+
+/* Reopens the unused file of ENTRY.  Returns -1 if it can no longer be
+   opened, or has changed since it was parsed.  */
+static int
+rrd_cache_reopen (struct rrd_cache_entry* entry)
+{
+  struct stat st;
+  int fd;
+
+  if (-1 == (fd = dir_index_open (entry->path)))
+    return -1;
+
+  if (-1 == fstat (fd, &st)
+      || st.st_dev != entry->data.device
+      || st.st_ino != entry->data.inode
+      || st.st_size != entry->data.file_size
+      || st.st_mtim.tv_sec != entry->data.mtime.tv_sec
+      || st.st_mtim.tv_nsec != entry->data.mtime.tv_nsec)
+    {
+      close (fd);
+
+      return -1;
+    }
+
+  if (entry->data.fetched)
+    entry->data.fd = fd;
+  else
+    close (fd);
+
+  return 0;
+}
+
+/* Unmaps unused files until no more than LIMIT bytes are mapped, or no
+   unused file remains */
+static void
+rrd_cache_trim (size_t limit)
+{
+  while (rrd_cache_bytes > limit && rrd_cache_first_unused)
+    rrd_cache_evict (rrd_cache_first_unused);
+}
 
-  interval /= data->header.pdp_step;
+/* Like rrd_parse(), but returns the existing mapping of FILENAME if it
+   is still in the cache.  RESULT must be released with rrd_close().  */
+int
+rrd_open (struct rrd* result, const char* filename)
+{
+  struct rrd_cache_entry* entry;
+  struct rrd_cache_entry** bucket;
 
-  for (rra = 0; rra < data->header.rra_count; ++rra)
+  if (rrd_cache_count)
     {
-      if (data->rra_defs[rra].pdp_count == interval
-         && !strcmp (data->rra_defs[rra].cf_name, cf_name))
+      for (entry = *rrd_cache_bucket (filename); entry; entry = entry->next_in_bucket)
         {
-          result->values = data->values;
-          result->offset = offset;
-          result->count = data->rra_defs[rra].row_count;
-          result->first = (data->rra_ptrs[rra] + 1) % result->count;
-          result->step = data->header.ds_count;
+          if (strcmp (entry->path, filename))
+            continue;
+
+          if (!entry->references)
+            {
+              if (-1 == rrd_cache_reopen (entry))
+                {
+                  rrd_cache_evict (entry);
+
+                  break;
+                }
 
-          if (result->count > max_count)
-            result->current_position = result->count - max_count;
+              rrd_cache_unlink_unused (entry);
+            }
+
+          ++entry->references;
+          ++rrd_cache_hits;
+          *result = entry->data;
 
           return 0;
         }
+    }
+
+  ++rrd_cache_misses;
+
+  if (-1 == rrd_parse (result, filename))
+    return -1;
+
+  if (!(entry = calloc (1, sizeof (*entry)))
+      || !(entry->path = strdup (filename)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  if (rrd_cache_count * 2 >= rrd_cache_bucket_count)
+    rrd_cache_rehash (rrd_cache_bucket_count ? rrd_cache_bucket_count * 2 : 256);
+
+  bucket = rrd_cache_bucket (filename);
+  entry->next_in_bucket = *bucket;
+  *bucket = entry;
+  ++rrd_cache_count;
+
+  result->cache_entry = entry;
+  entry->data = *result;
+  entry->references = 1;
+  rrd_cache_bytes += result->file_size;
 
-      offset += data->rra_defs[rra].row_count * data->header.ds_count;
+  rrd_cache_trim (rrd_cache_limit);
+
+  return 0;
+}
+
+/* Releases DATA, opened with rrd_open() or rrd_parse() */
+void
+rrd_close (struct rrd* data)
+{
+  struct rrd_cache_entry* entry = data->cache_entry;
+
+  if (!entry)
+    {
+      rrd_free (data);
+
+      return;
     }
 
-  return -1;
+  memset (data, 0, sizeof (struct rrd));
+
+  if (--entry->references)
+    return;
+
+  if (entry->data.fetched)
+    {
+      close (entry->data.fd);
+      entry->data.fd = -1;
+    }
+
+  entry->prev_unused = rrd_cache_last_unused;
+
+  if (rrd_cache_last_unused)
+    rrd_cache_last_unused->next_unused = entry;
+  else
+    rrd_cache_first_unused = entry;
+
+  rrd_cache_last_unused = entry;
+
+  rrd_cache_trim (rrd_cache_limit);
+}
+
+/* Unmaps every file that is not in use */
+void
+rrd_cache_flush ()
+{
+  rrd_cache_trim (0);
+}
+
+/* Makes sure the rows ITERATOR reads at positions BEGIN to END are in
+   memory, reading the ones that are not with as few pread() calls as
+   the ring buffer wrap allows.  Rows that cannot be read become NaN.
+   Does nothing for mapped files.  */
+int
+rrd_iterator_fetch (struct rrd* data, const struct rrd_iterator* iterator,
+                    size_t begin, size_t end)
+{
+  size_t row_size, base, row, run;
+  double* values;
+  int result = 0;
+
+  if (!data->fetched || iterator->generator || iterator->consolidated
+      || !iterator->count || !iterator->step)
+    return 0;
+
+  if (end > iterator->count)
+    end = iterator->count;
+
+  row_size = iterator->step * sizeof (double);
+  base = iterator->offset / iterator->step;
+  values = data->values + iterator->offset;
+
+  while (begin < end)
+    {
+      row = (begin + iterator->first) % iterator->count;
+
+      if (data->fetched[(base + row) / 8] & (1 << ((base + row) % 8)))
+        {
+          ++begin;
+
+          continue;
+        }
+
+      for (run = 1; begin + run < end && row + run < iterator->count; ++run)
+        {
+          if (data->fetched[(base + row + run) / 8] & (1 << ((base + row + run) % 8)))
+            break;
+        }
+
+      if (-1 == rrd_pread (data->fd, values + row * iterator->step, run * row_size,
+                           (unsigned char*) (values + row * iterator->step) - (unsigned char*) data->data))
+        {
+          size_t i;
+
+          fprintf (stderr, "Failed to read %zu bytes of RRD values: %s\n", run * row_size, strerror (errno));
+
+          for (i = 0; i < run * iterator->step; ++i)
+            values[row * iterator->step + i] = NAN;
+
+          result = -1;
+        }
+
+      for (begin += run; run--; ++row)
+        data->fetched[(base + row) / 8] |= 1 << ((base + row) % 8);
+    }
+
+  return result;
+}
+
+/* Splits positions BEGIN to END of ITERATOR into the runs of rows they
+   cover in the archive, which wraps around at most once.  Returns the
+   number of spans, or zero for generated iterators.  */
+size_t
+rrd_iterator_spans (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                    struct rrd_span* spans)
+{
+  size_t row, count;
+  const double* values;
+
+  if (iterator->generator || !iterator->count)
+    return 0;
+
+  if (end > iterator->count)
+    end = iterator->count;
+
+  if (begin >= end)
+    return 0;
+
+  values = iterator->values + iterator->offset + iterator->ds;
+  row = (begin + iterator->first) % iterator->count;
+  count = end - begin;
+
+  spans[0].values = values + row * iterator->step;
+  spans[0].stride = iterator->step;
+  spans[0].count = iterator->count - row;
+
+  if (spans[0].count >= count)
+    {
+      spans[0].count = count;
+
+      return 1;
+    }
+
+  spans[1].values = values;
+  spans[1].stride = iterator->step;
+  spans[1].count = count - spans[0].count;
+
+  return 2;
+}
+
+/* Copies positions BEGIN to END of ITERATOR into RESULT, so that the
+   values can be read as a dense array.  Positions past the end of the
+   iterator wrap around, as with rrd_iterator_peek_index().  */
+void
+rrd_iterator_gather (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                     double* result)
+{
+  struct rrd_span spans[2];
+  size_t i, j, span_count;
+
+  if (iterator->generator)
+    {
+      for (i = begin; i < end; ++i)
+        *result++ = iterator->generator (iterator, i, iterator->generator_arg);
+
+      return;
+    }
+
+  if (!iterator->count)
+    {
+      for (i = begin; i < end; ++i)
+        *result++ = NAN;
+
+      return;
+    }
+
+  while (begin < end)
+    {
+      size_t position, count;
+
+      position = begin % iterator->count;
+      count = iterator->count - position;
+
+      if (count > end - begin)
+        count = end - begin;
+
+      span_count = rrd_iterator_spans (iterator, position, position + count, spans);
+
+      for (i = 0; i < span_count; ++i)
+        {
+          const double* values = spans[i].values;
+          size_t stride = spans[i].stride;
+
+          if (stride == 1)
+            memcpy (result, values, spans[i].count * sizeof (double));
+          else
+            {
+              for (j = 0; j < spans[i].count; ++j)
+                result[j] = values[j * stride];
+            }
+
+          result += spans[i].count;
+        }
+
+      begin += count;
+    }
+}
+
+/* Copies positions BEGIN to END of ITERATOR for each of the COLUMN_COUNT
+   data sources in COLUMNS into the matching array in RESULTS, reading
+   each row once.  The iterator's own data source is ignored.  */
+void
+rrd_iterator_gather_columns (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                             const size_t* columns, double* const* results,
+                             size_t column_count)
+{
+  struct rrd_span spans[2];
+  struct rrd_iterator row_iterator;
+  size_t i, j, k, span_count, done = 0;
+
+  if (iterator->generator || !iterator->count)
+    {
+      for (k = 0; k < column_count; ++k)
+        rrd_iterator_gather (iterator, begin, end, results[k]);
+
+      return;
+    }
+
+  row_iterator = *iterator;
+  row_iterator.ds = 0;
+
+  while (begin < end)
+    {
+      size_t position, count;
+
+      position = begin % iterator->count;
+      count = iterator->count - position;
+
+      if (count > end - begin)
+        count = end - begin;
+
+      span_count = rrd_iterator_spans (&row_iterator, position, position + count, spans);
+
+      for (i = 0; i < span_count; ++i)
+        {
+          const double* row = spans[i].values;
+
+          for (j = 0; j < spans[i].count; ++j, ++done, row += spans[i].stride)
+            {
+              for (k = 0; k < column_count; ++k)
+                results[k][done] = row[columns[k]];
+            }
+        }
+
+      begin += count;
+    }
+}
+
+/* Finds the runs of the first COUNT positions where neither A nor B is
+   unknown, and stores them in RUNS, which must have room for COUNT / 2
+   + 1 runs.  Pass the same array twice to find the runs of one.  Returns
+   the number of runs.  */
+size_t
+rrd_known_runs (const double* a, const double* b, size_t count, struct rrd_run* runs)
+{
+  size_t i = 0, run_count = 0;
+  unsigned int known = 0, bit;
+
+#ifdef __SSE2__
+  /* Eight positions at a time, skipping blocks that lie entirely inside
+     or outside a run */
+  for (; i + 8 <= count; i += 8)
+    {
+      unsigned int mask;
+      size_t j;
+
+      mask = _mm_movemask_pd (_mm_cmpord_pd (_mm_loadu_pd (a + i), _mm_loadu_pd (b + i)))
+        | _mm_movemask_pd (_mm_cmpord_pd (_mm_loadu_pd (a + i + 2), _mm_loadu_pd (b + i + 2))) << 2
+        | _mm_movemask_pd (_mm_cmpord_pd (_mm_loadu_pd (a + i + 4), _mm_loadu_pd (b + i + 4))) << 4
+        | _mm_movemask_pd (_mm_cmpord_pd (_mm_loadu_pd (a + i + 6), _mm_loadu_pd (b + i + 6))) << 6;
+
+      if (mask == (known ? 0xff : 0))
+        continue;
+
+      for (j = 0; j < 8; ++j)
+        {
+          if ((bit = (mask >> j) & 1) == known)
+            continue;
+
+          if (bit)
+            runs[run_count].begin = i + j;
+          else
+            runs[run_count++].end = i + j;
+
+          known = bit;
+        }
+    }
+#endif
+
+  for (; i < count; ++i)
+    {
+      if ((bit = !isnan (a[i]) && !isnan (b[i])) == known)
+        continue;
+
+      if (bit)
+        runs[run_count].begin = i;
+      else
+        runs[run_count++].end = i;
+
+      known = bit;
+    }
+
+  if (known)
+    runs[run_count++].end = count;
+
+  return run_count;
+}
+
+/* Returns the first of the largest of BASE and the values from BEGIN to
+   END, as a loop replacing the result only by larger values would */
+static double
+rrd_first_max (const double* values, size_t begin, size_t end, double base)
+{
+  for (; begin < end; ++begin)
+    {
+      if (values[begin] > base)
+        base = values[begin];
+    }
+
+  return base;
+}
+
+#ifdef __SSE2__
+static double
+rrd_first_min (const double* values, size_t begin, size_t end, double base)
+{
+  for (; begin < end; ++begin)
+    {
+      if (values[begin] < base)
+        base = values[begin];
+    }
+
+  return base;
+}
+
+static double
+rrd_lanes_min (__m128d lanes)
+{
+  double lo = _mm_cvtsd_f64 (lanes), hi = _mm_cvtsd_f64 (_mm_unpackhi_pd (lanes, lanes));
+
+  return (hi < lo) ? hi : lo;
+}
+
+static double
+rrd_lanes_max (__m128d lanes)
+{
+  double lo = _mm_cvtsd_f64 (lanes), hi = _mm_cvtsd_f64 (_mm_unpackhi_pd (lanes, lanes));
+
+  return (hi > lo) ? hi : lo;
+}
+#endif
+
+/* Summarizes the first COUNT values of the averages, minimums and
+   maximums of a curve in one pass.  The minimum and maximum start at
+   zero, and the minimum restarts at the first known average.  If STACK
+   is not null, positive averages are added to it, and STACK_MAX is
+   raised to the highest stack level where the average is known.
+
+   The results are bit-identical to those of a plain loop over the
+   values: the sum is accumulated in order, and where comparisons
+   between lanes cannot tell zero from negative zero, the plain loop is
+   run instead.  */
+void
+rrd_summarize (const double* avgs, const double* mins, const double* maxs,
+               size_t count, double* stack, double* stack_max,
+               struct rrd_summary* result)
+{
+  size_t x, first;
+
+  memset (result, 0, sizeof (*result));
+
+  for (first = 0; first < count && isnan (avgs[first]); ++first)
+    ;
+
+  /* Before the first known average, only the maximums count */
+  if (first < count)
+    {
+      result->max = rrd_first_max (maxs, 0, first, 0.0);
+      result->avg_min = result->avg_max = result->min = avgs[first];
+      x = first;
+    }
+  else
+    x = 0;
+
+#ifdef __SSE2__
+  {
+    const __m128d zero = _mm_setzero_pd ();
+    const __m128d minus_inf = _mm_set1_pd (-INFINITY);
+    __m128d avg_min = _mm_set1_pd (INFINITY), avg_max = minus_inf;
+    __m128d min = _mm_set1_pd (INFINITY), max = _mm_set1_pd (result->max);
+    __m128d top = _mm_set1_pd (*stack_max), known = zero;
+    size_t begin = x;
+    double value;
+
+    for (; x + 2 <= count; x += 2)
+      {
+        __m128d avg = _mm_loadu_pd (avgs + x);
+        __m128d avg_known = _mm_cmpord_pd (avg, avg);
+        __m128d addend = _mm_and_pd (avg_known, avg);
+        __m128d min_value = _mm_loadu_pd (mins + x);
+        __m128d max_value = _mm_loadu_pd (maxs + x);
+        int mask = _mm_movemask_pd (avg_known);
+
+        /* Unknown averages add zero, which leaves the sum unchanged, as
+           it can never be negative zero */
+        result->avg_sum += _mm_cvtsd_f64 (addend);
+        result->avg_sum += _mm_cvtsd_f64 (_mm_unpackhi_pd (addend, addend));
+        result->avg_count += (mask & 1) + (mask >> 1);
+
+        /* With the new value first, NaNs leave the lanes as they were, and
+           ties keep the earlier value */
+        avg_min = _mm_min_pd (avg, avg_min);
+        avg_max = _mm_max_pd (avg, avg_max);
+        min = _mm_min_pd (min_value, min);
+        max = _mm_max_pd (max_value, max);
+
+        known = _mm_or_pd (known, _mm_or_pd (_mm_cmpord_pd (min_value, min_value),
+                                             _mm_cmpord_pd (max_value, max_value)));
+
+        if (stack)
+          {
+            __m128d level = _mm_add_pd (_mm_loadu_pd (stack + x),
+                                        _mm_and_pd (_mm_cmpgt_pd (avg, zero), avg));
+
+            _mm_storeu_pd (stack + x, level);
+
+            top = _mm_max_pd (_mm_or_pd (_mm_and_pd (avg_known, level),
+                                         _mm_andnot_pd (avg_known, minus_inf)), top);
+          }
+      }
+
+    if (x > begin)
+      {
+        if (0 == (value = rrd_lanes_min (avg_min)))
+          result->avg_min = rrd_first_min (avgs, begin, x, result->avg_min);
+        else if (value < result->avg_min)
+          result->avg_min = value;
+
+        if (0 == (value = rrd_lanes_max (avg_max)))
+          result->avg_max = rrd_first_max (avgs, begin, x, result->avg_max);
+        else if (value > result->avg_max)
+          result->avg_max = value;
+
+        if (0 == (value = rrd_lanes_min (min)))
+          result->min = rrd_first_min (mins, begin, x, result->min);
+        else if (value < result->min)
+          result->min = value;
+
+        /* The maximum and the stack levels start at zero and only grow,
+           so they never hold negative zero */
+        result->max = rrd_lanes_max (max);
+
+        if (stack)
+          *stack_max = rrd_lanes_max (top);
+
+        result->known = (0 != _mm_movemask_pd (known));
+      }
+  }
+#endif
+
+  for (; x < count; ++x)
+    {
+      double avg = avgs[x];
+
+      if (!isnan (avg))
+        {
+          if (stack)
+            {
+              if (avg > 0)
+                stack[x] += avg;
+
+              if (stack[x] > *stack_max)
+                *stack_max = stack[x];
+            }
+
+          result->avg_sum += avg;
+          ++result->avg_count;
+
+          if (avg > result->avg_max)
+            result->avg_max = avg;
+          else if (avg < result->avg_min)
+            result->avg_min = avg;
+        }
+
+      if (maxs[x] > result->max)
+        result->max = maxs[x];
+
+      if (mins[x] < result->min)
+        result->min = mins[x];
+
+      if (!isnan (mins[x]) || !isnan (maxs[x]))
+        result->known = 1;
+    }
+
+  if (result->avg_count)
+    result->known = 1;
+}
+
+/* Returns the index of the data source called NAME, or -1 if there is
+   none */
+int
+rrd_ds_index (const struct rrd* data, const char* name)
+{
+  size_t i;
+
+  for (i = 0; i < data->header.ds_count; ++i)
+    {
+      if (!strcmp (data->ds_defs[i].ds_name, name))
+        return i;
+    }
+
+  return -1;
+}
+
+/* An archive that rows of an iterator are consolidated from */
+struct rrd_source
+{
+  struct rrd_archive archive;
+  size_t rra;
+};
+
+/* The archives of one consolidation function nearest to a requested
+   row length: one of that length, and the nearest finer and coarser
+   ones.  Unset members have no rows.  */
+struct rrd_choice
+{
+  struct rrd_source exact, finer, coarser;
+};
+
+/* Considers archive RRA for CHOICE, for rows of INTERVAL seconds.  Of
+   two archives equally near, the longer one is chosen.  */
+static void
+rrd_choose (struct rrd_choice* choice, const struct rrd_archive* archive, size_t rra,
+            size_t pdp_step, size_t interval)
+{
+  size_t length, other;
+
+  if (!archive->row_count || !archive->pdp_count)
+    return;
+
+  length = (size_t) archive->pdp_count * pdp_step;
+
+  if (length == interval)
+    {
+      if (!choice->exact.archive.row_count)
+        {
+          choice->exact.archive = *archive;
+          choice->exact.rra = rra;
+        }
+    }
+  else if (length < interval)
+    {
+      other = (size_t) choice->finer.archive.pdp_count * pdp_step;
+
+      if (length > other
+          || (length == other && archive->row_count > choice->finer.archive.row_count))
+        {
+          choice->finer.archive = *archive;
+          choice->finer.rra = rra;
+        }
+    }
+  else
+    {
+      other = (size_t) choice->coarser.archive.pdp_count * pdp_step;
+
+      if (!choice->coarser.archive.row_count || length < other
+          || (length == other && archive->row_count > choice->coarser.archive.row_count))
+        {
+          choice->coarser.archive = *archive;
+          choice->coarser.rra = rra;
+        }
+    }
+}
+
+/* Returns the archive to read for CHOICE: the exact one, or failing
+   that, the nearest finer and then the nearest coarser one */
+static const struct rrd_source*
+rrd_choice_best (const struct rrd_choice* choice)
+{
+  if (choice->exact.archive.row_count)
+    return &choice->exact;
+
+  if (choice->finer.archive.row_count)
+    return &choice->finer;
+
+  if (choice->coarser.archive.row_count)
+    return &choice->coarser;
+
+  return 0;
+}
+
+/* Computes the byte ranges of the file that an iterator created with
+   the same arguments would read, given the RRA pointers of the file,
+   except for any archives stitched in front.  With rrd_stitch set, the
+   recent rows that those archives are sure to cover are left out.
+   Returns the number of ranges, which is at most two, or zero if there
+   is no archive of the consolidation function or no row left to read.  */
+size_t
+rrd_layout_ranges (const struct rrd_layout* layout, const unsigned long* rra_ptrs,
+                   enum cf_type cf, size_t interval, size_t max_count,
+                   struct rrd_range* ranges)
+{
+  struct rrd_choice choice;
+  const struct rrd_source* best;
+  const struct rrd_archive* a;
+  size_t rra, count, begin, end, row, row_size, length, covered = 0;
+  off_t base;
+
+  if (!layout->pdp_step)
+    return 0;
+
+  memset (&choice, 0, sizeof (choice));
+
+  for (rra = 0; rra < layout->archive_count; ++rra)
+    {
+      if (layout->archives[rra].cf == cf)
+        rrd_choose (&choice, &layout->archives[rra], rra, layout->pdp_step, interval);
+    }
+
+  if (!(best = rrd_choice_best (&choice)))
+    return 0;
+
+  a = &best->archive;
+  length = (size_t) a->pdp_count * layout->pdp_step;
+
+  /* Each finer archive stitched in front covers the requested rows that
+     its own rows span entirely.  Its last row ends less than INTERVAL
+     seconds after the last requested one, so at least this many.  */
+  if (rrd_stitch)
+    {
+      for (rra = 0; rra < layout->archive_count; ++rra)
+        {
+          const struct rrd_archive* finer = &layout->archives[rra];
+          long long source_period, span;
+
+          if (finer->cf != cf || !finer->row_count || !finer->pdp_count)
+            continue;
+
+          source_period = (long long) finer->pdp_count * layout->pdp_step;
+
+          if (source_period >= (long long) length || interval % source_period)
+            continue;
+
+          span = (long long) finer->row_count * source_period
+                 - ((long long) interval - source_period);
+
+          if (span > 0 && (size_t) (span / (long long) interval) > covered)
+            covered = span / (long long) interval;
+        }
+
+      if (covered >= max_count)
+        return 0;
+    }
+
+  /* Rows of another length are consolidated, and may straddle the
+     requested ones */
+  if (length != interval)
+    max_count = (max_count * interval + length - 1) / length + 1;
+
+  covered = covered * interval / length;
+
+  count = a->row_count;
+  begin = (count > max_count) ? count - max_count : 0;
+  end = (count - begin > covered) ? count - covered : begin;
+
+  if (begin == end)
+    return 0;
+
+  row = (begin + (rra_ptrs[best->rra] + 1) % count) % count;
+  row_size = layout->ds_count * sizeof (double);
+  base = layout->values + (off_t) a->offset * sizeof (double);
+
+  ranges[0].offset = base + row * row_size;
+
+  if (row + end - begin <= count)
+    {
+      ranges[0].size = (end - begin) * row_size;
+
+      return 1;
+    }
+
+  ranges[0].size = (count - row) * row_size;
+  ranges[1].offset = base;
+  ranges[1].size = (row + end - begin - count) * row_size;
+
+  return 2;
+}
+
+/* Adds COUNT values, STRIDE doubles apart, to the running result
+   *RESULT of consolidation function CF, skipping unknown values, and
+   counts the known ones in *VALID.  The AVERAGE, MIN and MAX loops have
+   no data dependent branches, so that the compiler can vectorize them.  */
+static void
+rrd_reduce (const double* values, size_t stride, size_t count, enum cf_type cf,
+            double* result, size_t* valid)
+{
+  double acc = *result;
+  size_t i, known = 0;
+
+  switch (cf)
+    {
+    case cf_average:
+
+      for (i = 0; i < count; ++i)
+        {
+          double v = values[i * stride];
+          int k = !isnan (v);
+
+          acc += k ? v : 0.0;
+          known += k;
+        }
+
+      break;
+
+    case cf_minimum:
+
+      for (i = 0; i < count; ++i)
+        {
+          double v = values[i * stride];
+
+          acc = (v < acc) ? v : acc;
+          known += !isnan (v);
+        }
+
+      break;
+
+    case cf_maximum:
+
+      for (i = 0; i < count; ++i)
+        {
+          double v = values[i * stride];
+
+          acc = (v > acc) ? v : acc;
+          known += !isnan (v);
+        }
+
+      break;
+
+    default:
+
+      for (i = 0; i < count; ++i)
+        {
+          if (!isnan (values[i * stride]))
+            {
+              acc = values[i * stride];
+              ++known;
+            }
+        }
+    }
+
+  *result = acc;
+  *valid += known;
+}
+
+static long long
+rrd_floor_div (long long a, long long b)
+{
+  return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/* Orders sources finest first, and of equally fine ones, longest first */
+static int
+rrd_source_compare (const void* vlhs, const void* vrhs)
+{
+  const struct rrd_source* lhs = vlhs;
+  const struct rrd_source* rhs = vrhs;
+
+  if (lhs->archive.pdp_count != rhs->archive.pdp_count)
+    return (lhs->archive.pdp_count < rhs->archive.pdp_count) ? -1 : 1;
+
+  if (lhs->archive.row_count != rhs->archive.row_count)
+    return (lhs->archive.row_count > rhs->archive.row_count) ? -1 : 1;
+
+  return 0;
+}
+
+/* Fills RESULT with MAX_COUNT rows of INTERVAL seconds each, consolidated
+   from the SOURCE_COUNT archives in SOURCES, finest first.  Going back
+   from the last row, each archive but the last fills the rows it covers
+   entirely, and the last one fills the rest.  Each row reduces the rows
+   of its archive that overlap it in time, so a finer archive is
+   summarized and a coarser one is repeated.  Every archive is read once,
+   over just the rows it contributes.  */
+static void
+rrd_iterator_consolidate (struct rrd_iterator* result, struct rrd* data,
+                          const struct rrd_source* sources, size_t source_count,
+                          size_t interval, size_t max_count, size_t ds)
+{
+  struct rrd_iterator source;
+  struct rrd_span spans[2];
+  size_t ds_count, count, row = 0, row_end, column, i, j, span_count;
+  long long period, source_period, shift, begin, end;
+  time_t last_up, last_row;
+
+  ds_count = data->header.ds_count;
+
+  if (!max_count)
+    max_count = 1;
+
+  if (!(result->consolidated = malloc (sizeof (double) * ds_count * max_count)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  /* Rows are numbered backwards from the last completed one */
+  last_up = data->live_header.last_up;
+  period = interval;
+  last_row = last_up - last_up % period;
+
+  for (i = 0; i < source_count && row < max_count; ++i)
+    {
+      const struct rrd_archive* archive = &sources[i].archive;
+
+      count = archive->row_count;
+
+      memset (&source, 0, sizeof (source));
+      source.values = data->values;
+      source.offset = archive->offset;
+      source.count = count;
+      source.first = (data->rra_ptrs[sources[i].rra] + 1) % count;
+      source.step = ds_count;
+
+      /* How much later the archive's last row ends than the result's */
+      source_period = (long long) archive->pdp_count * data->header.pdp_step;
+      shift = (last_up - last_up % source_period) - last_row;
+
+      row_end = max_count;
+
+      if (i + 1 < source_count)
+        {
+          long long covered;
+
+          covered = ((long long) count * source_period - shift) / period;
+
+          if (covered < (long long) row)
+            covered = row;
+
+          if (covered < (long long) row_end)
+            row_end = covered;
+        }
+
+      if (row == row_end)
+        continue;
+
+      begin = rrd_floor_div (shift + (long long) row * period, source_period);
+      end = -rrd_floor_div (-(shift + (long long) row_end * period), source_period);
+
+      if (begin < 0)
+        begin = 0;
+
+      if (end > (long long) count)
+        end = count;
+
+      if (begin < end)
+        rrd_iterator_fetch (data, &source, count - end, count - begin);
+
+      for (; row < row_end; ++row)
+        {
+          double* values = result->consolidated + (max_count - 1 - row) * ds_count;
+
+          begin = rrd_floor_div (shift + (long long) row * period, source_period);
+          end = -rrd_floor_div (-(shift + (long long) (row + 1) * period), source_period);
+
+          if (begin < 0)
+            begin = 0;
+
+          if (end > (long long) count)
+            end = count;
+
+          span_count = (begin < end) ? rrd_iterator_spans (&source, count - end, count - begin, spans) : 0;
+
+          for (column = 0; column < ds_count; ++column)
+            {
+              double value;
+              size_t valid = 0;
+
+              switch (archive->cf)
+                {
+                case cf_average: value = 0.0; break;
+                case cf_minimum: value = INFINITY; break;
+                case cf_maximum: value = -INFINITY; break;
+                default: value = NAN;
+                }
+
+              for (j = 0; j < span_count; ++j)
+                rrd_reduce (spans[j].values + column, spans[j].stride, spans[j].count,
+                            archive->cf, &value, &valid);
+
+              if (!valid)
+                value = NAN;
+              else if (archive->cf == cf_average)
+                value /= valid;
+
+              values[column] = value;
+            }
+        }
+    }
+
+  result->values = result->consolidated;
+  result->offset = 0;
+  result->count = max_count;
+  result->first = 0;
+  result->step = ds_count;
+  result->ds = ds;
+}
+
+/* Creates an iterator over the last MAX_COUNT rows of the archive with
+   consolidation function CF_NAME and rows of INTERVAL seconds.  Without
+   such an archive, the rows are consolidated from the nearest finer
+   archive of the same function, or failing that, the nearest coarser
+   one.  If rrd_stitch is set, the recent rows that finer archives cover
+   are consolidated from the finest of them.  Returns -1 if there is no
+   archive of the function at all.  */
+int
+rrd_iterator_create (struct rrd_iterator* result, struct rrd* data,
+                    const char* cf_name, size_t interval,
+                    size_t max_count, size_t ds)
+{
+  struct rrd_archive archive;
+  struct rrd_choice choice;
+  const struct rrd_source* best;
+  struct rrd_source* sources;
+  enum cf_type cf;
+  size_t rra, rra_count, offset = 0, i, source_count = 0, pdp_step;
+
+  memset (result, 0, sizeof (*result));
+
+  if (!(pdp_step = data->header.pdp_step) || cf_unknown == (cf = rrd_cf_type (cf_name)))
+    return -1;
+
+  memset (&choice, 0, sizeof (choice));
+
+  rra_count = data->layout ? data->layout->archive_count : data->header.rra_count;
+
+  if (!(sources = malloc (sizeof (*sources) * (rra_count + 1))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (rra = 0; rra < rra_count; ++rra)
+    {
+      if (data->layout)
+        archive = data->layout->archives[rra];
+      else
+        {
+          archive.cf = rrd_cf_type (data->rra_defs[rra].cf_name);
+          archive.pdp_count = data->rra_defs[rra].pdp_count;
+          archive.row_count = data->rra_defs[rra].row_count;
+          archive.offset = offset;
+
+          offset += data->rra_defs[rra].row_count * data->header.ds_count;
+        }
+
+      if (archive.cf != cf)
+        continue;
+
+      rrd_choose (&choice, &archive, rra, pdp_step, interval);
+
+      /* Rows of archives whose rows divide the requested ones can be
+         stitched in front of it */
+      if (rrd_stitch && archive.row_count && archive.pdp_count
+          && archive.pdp_count * pdp_step < interval
+          && !(interval % (archive.pdp_count * pdp_step)))
+        {
+          sources[source_count].archive = archive;
+          sources[source_count++].rra = rra;
+        }
+    }
+
+  if (!(best = rrd_choice_best (&choice)))
+    {
+      free (sources);
+
+      return -1;
+    }
+
+  if (best == &choice.finer)
+    ++rrd_fallback_finer;
+  else if (best == &choice.coarser)
+    ++rrd_fallback_coarser;
+
+  /* Keep the longest of equally fine archives */
+  qsort (sources, source_count, sizeof (*sources), rrd_source_compare);
+
+  for (i = 0, rra = 0; i < source_count; ++i)
+    {
+      if (!rra || sources[i].archive.pdp_count != sources[rra - 1].archive.pdp_count)
+        sources[rra++] = sources[i];
+    }
+
+  source_count = rra;
+
+  /* The archive of the requested resolution, or the one standing in for
+     it, fills the rows the finer ones do not */
+  sources[source_count] = *best;
+
+  if (!source_count
+      || best->archive.pdp_count != sources[source_count - 1].archive.pdp_count)
+    ++source_count;
+
+  if (best != &choice.exact || source_count > 1)
+    {
+      rrd_iterator_consolidate (result, data, sources, source_count, interval, max_count, ds);
+      free (sources);
+
+      return 0;
+    }
+
+  free (sources);
+
+  result->values = data->values;
+  result->offset = best->archive.offset;
+  result->count = best->archive.row_count;
+  result->first = (data->rra_ptrs[best->rra] + 1) % result->count;
+  result->step = data->header.ds_count;
+  result->ds = ds;
+
+  if (result->count > max_count)
+    result->current_position = result->count - max_count;
+
+  rrd_iterator_fetch (data, result, result->current_position, result->count);
+
+  return 0;
+}
+
+void
+rrd_iterator_free (struct rrd_iterator* iterator)
+{
+  free (iterator->consolidated);
+  iterator->consolidated = 0;
 }
@@ -3,8 +3,12 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
+/* Bytes read from the start of an RRD file whose layout is not known */
+#define RRD_HEAD_SIZE 4096
+
 union unival
 {
   unsigned long u_count;
@@ -16,7 +20,8 @@ enum cf_type
   cf_average = 0,
   cf_minimum,
   cf_maximum,
-  cf_last
+  cf_last,
+  cf_unknown
 };
 
 struct rrd_header
@@ -62,6 +67,49 @@ struct cdp_prepare
   union unival scratch[10];
 };
 
+/* One RRA of an RRD file.  OFFSET is the index of the archive's first
+   value in the value list.  */
+struct rrd_archive
+{
+  uint32_t cf;
+  uint32_t pdp_count;
+  uint32_t row_count;
+  uint32_t offset;
+};
+
+/* Where everything lives in an RRD file, as found by a full rrd_parse().
+   Offsets are in bytes from the start of the file.  Identified by device,
+   inode and size, and checked against the data source and archive
+   definitions of the file; see layout.h.  */
+struct rrd_layout
+{
+  /* Of the rest of the record, set when it is written to disk */
+  uint64_t checksum;
+
+  uint64_t device, inode, file_size;
+
+  /* Of the data source and archive definitions, which an update never
+     changes, so that a new file reusing the inode is not mistaken for
+     the old one.  The modification and change times would change with
+     every update.  */
+  uint64_t defs_checksum;
+
+  uint32_t version;
+  uint32_t ds_count, rra_count, pdp_step;
+
+  uint32_t ds_defs, rra_defs, live_header;
+  uint32_t pdp_preps, cdp_preps, rra_ptrs, values;
+
+  uint32_t archive_count;
+  struct rrd_archive archives[];
+};
+
+struct rrd_range
+{
+  off_t offset;
+  size_t size;
+};
+
 struct rrd
 {
   void* data;
@@ -75,6 +123,24 @@ struct rrd
   struct cdp_prepare* cdp_preps;
   unsigned long* rra_ptrs;
   double* values;
+
+  /* Null unless the file was opened with rrd_parse() */
+  const struct rrd_layout* layout;
+
+  /* Set for files opened in pread mode, which have one bit per row of
+     the value list that has been read.  FD is -1 while a cached file is
+     not in use.  */
+  int fd;
+  unsigned char* fetched;
+
+  /* The file that was parsed, for telling whether it has since changed */
+  dev_t device;
+  ino_t inode;
+  struct timespec mtime;
+
+  /* Set for files opened with rrd_open(), whose mapping is owned by the
+     cache */
+  struct rrd_cache_entry* cache_entry;
 };
 
 struct rrd_iterator
@@ -90,6 +156,38 @@ struct rrd_iterator
 
   double (*generator)(const struct rrd_iterator* iterator, size_t index, void* arg);
   void* generator_arg;
+
+  /* Set if the file has no archive of the requested resolution, and the
+     values were consolidated from another archive.  Owned by the
+     iterator; see rrd_iterator_free().  */
+  double* consolidated;
+};
+
+/* COUNT values, STRIDE doubles apart */
+struct rrd_span
+{
+  const double* values;
+  size_t stride;
+  size_t count;
+};
+
+/* Positions BEGIN to END of an array, all holding known values */
+struct rrd_run
+{
+  size_t begin, end;
+};
+
+/* Statistics of the values a curve draws; see rrd_summarize() */
+struct rrd_summary
+{
+  double avg_sum;
+  size_t avg_count;
+  double avg_min, avg_max;
+
+  double min, max;
+
+  /* Set if any average, minimum or maximum is known */
+  int known;
 };
 
 #define rrd_iterator_peek_index(i, index) \
@@ -103,6 +201,33 @@ struct rrd_iterator
 #define rrd_iterator_advance(i) \
   do { ++(i)->current_position; } while (0)
 
+/* If set, rrd_parse() reads only the part of the file in front of the
+   values, and rrd_iterator_create() reads the rows the iterator covers,
+   instead of mapping the whole file.  */
+extern int rrd_use_pread;
+
+/* If set, rrd_iterator_create() fills the recent rows of an iterator
+   from the finest archive that covers them, instead of from the archive
+   of the requested resolution alone.  */
+extern int rrd_stitch;
+
+/* Bytes read from RRD files, or for mapped files, bytes mapped */
+extern size_t rrd_bytes_read;
+
+/* Iterators created from a finer or a coarser archive, for lack of one
+   with the requested resolution */
+extern size_t rrd_fallback_finer, rrd_fallback_coarser;
+
+/* Bytes of files that rrd_open() keeps mapped after their last
+   rrd_close(), in case they are opened again */
+extern size_t rrd_cache_limit;
+
+/* Calls to rrd_open() served with and without an existing mapping */
+extern size_t rrd_cache_hits, rrd_cache_misses;
+
+enum cf_type
+rrd_cf_type (const char* cf_name);
+
 int
 rrd_parse (struct rrd* result, const char* filename);
 
@@ -110,8 +235,53 @@ void
 rrd_free (struct rrd* data);
 
 int
-rrd_iterator_create (struct rrd_iterator* result, const struct rrd* data,
+rrd_open (struct rrd* result, const char* filename);
+
+void
+rrd_close (struct rrd* data);
+
+void
+rrd_cache_flush ();
+
+size_t
+rrd_layout_ranges (const struct rrd_layout* layout, const unsigned long* rra_ptrs,
+                   enum cf_type cf, size_t interval, size_t max_count,
+                   struct rrd_range* ranges);
+
+int
+rrd_iterator_fetch (struct rrd* data, const struct rrd_iterator* iterator,
+                    size_t begin, size_t end);
+
+size_t
+rrd_iterator_spans (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                    struct rrd_span* spans);
+
+void
+rrd_iterator_gather (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                     double* result);
+
+void
+rrd_iterator_gather_columns (const struct rrd_iterator* iterator, size_t begin, size_t end,
+                             const size_t* columns, double* const* results,
+                             size_t column_count);
+
+size_t
+rrd_known_runs (const double* a, const double* b, size_t count, struct rrd_run* runs);
+
+void
+rrd_summarize (const double* avgs, const double* mins, const double* maxs,
+               size_t count, double* stack, double* stack_max,
+               struct rrd_summary* result);
+
+int
+rrd_ds_index (const struct rrd* data, const char* name);
+
+int
+rrd_iterator_create (struct rrd_iterator* result, struct rrd* data,
                     const char* cf_name, size_t interval,
-                    size_t max_count);
+                    size_t max_count, size_t ds);
+
+void
+rrd_iterator_free (struct rrd_iterator* iterator);
 
 #endif /* !RRD_H_ */
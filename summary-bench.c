@@ -0,0 +1,220 @@
+/*  Benchmark for the curve statistics of do_graph().
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <sys/time.h>
+#include <sysexits.h>
+
+#include "rrd.h"
+
+#define WIDTH 400
+
+/* The loop rrd_summarize() replaced, for reference */
+static void
+summarize_plain (const double* avgs, const double* mins, const double* maxs,
+                 size_t count, double* stack, double* stack_max,
+                 struct rrd_summary* result)
+{
+  size_t x;
+  int first = 1;
+
+  memset (result, 0, sizeof (*result));
+
+  for (x = 0; x < count; ++x)
+    {
+      double avg_value = avgs[x];
+      double min_value = mins[x];
+      double max_value = maxs[x];
+
+      if (!isnan (avg_value))
+        {
+          if (stack)
+            {
+              if (avg_value > 0)
+                stack[x] += avg_value;
+
+              if (stack[x] > *stack_max)
+                *stack_max = stack[x];
+            }
+
+          result->avg_sum += avg_value;
+          ++result->avg_count;
+
+          if (first)
+            {
+              result->avg_max = avg_value;
+              result->avg_min = avg_value;
+              result->min = avg_value;
+              first = 0;
+            }
+          else
+            {
+              if (avg_value > result->avg_max)
+                result->avg_max = avg_value;
+              else if (avg_value < result->avg_min)
+                result->avg_min = avg_value;
+            }
+        }
+
+      if (!isnan (max_value) && max_value > result->max)
+        result->max = max_value;
+
+      if (!isnan (min_value) && min_value < result->min)
+        result->min = min_value;
+
+      if (!isnan (avg_value) || !isnan (min_value) || !isnan (max_value))
+        result->known = 1;
+    }
+}
+
+/* Fills the columns of CURVE with a noisy signal, leaving out runs of
+   unknown values.  Every eighth curve holds nothing but signed zeros,
+   to exercise the tie-breaking between lanes.  */
+static void
+generate (double* avgs, double* mins, double* maxs, size_t curve)
+{
+  size_t x;
+  int known = 1;
+
+  for (x = 0; x < WIDTH; ++x)
+    {
+      double value;
+
+      if (!(rand () % 50))
+        known = !known;
+
+      if (!known || !(rand () % 40))
+        {
+          avgs[x] = mins[x] = maxs[x] = NAN;
+
+          continue;
+        }
+
+      if (curve % 8 == 7)
+        value = (rand () & 1) ? 0.0 : -0.0;
+      else
+        value = sin (x * 0.05 + curve) * 100.0 + rand () % 100 - 50;
+
+      avgs[x] = value;
+      mins[x] = value - rand () % 10;
+      maxs[x] = value + rand () % 10;
+    }
+}
+
+int
+main (int argc, char** argv)
+{
+  struct timeval start, end;
+  size_t curve_count, curve, round, method;
+  double* columns;
+  double* stacks[2];
+  double stack_max[2];
+  double best[2] = { 0, 0 };
+
+  curve_count = (argc > 1) ? strtol (argv[1], 0, 0) : 10000;
+
+  if (!(columns = malloc (sizeof (*columns) * 3 * WIDTH * curve_count))
+      || !(stacks[0] = malloc (sizeof (double) * WIDTH))
+      || !(stacks[1] = malloc (sizeof (double) * WIDTH)))
+    err (EX_OSERR, "malloc failed");
+
+  srand (1);
+
+  for (curve = 0; curve < curve_count; ++curve)
+    generate (columns + curve * 3 * WIDTH, columns + (curve * 3 + 1) * WIDTH,
+              columns + (curve * 3 + 2) * WIDTH, curve);
+
+  /* Every curve is summarized by both methods, and both the summaries
+     and the stacks must match bit for bit */
+  for (curve = 0; curve < curve_count; ++curve)
+    {
+      const double* avgs = columns + curve * 3 * WIDTH;
+      struct rrd_summary summaries[2];
+
+      if (!(curve % 4))
+        {
+          memset (stacks[0], 0, sizeof (double) * WIDTH);
+          memset (stacks[1], 0, sizeof (double) * WIDTH);
+          stack_max[0] = stack_max[1] = 0;
+        }
+
+      summarize_plain (avgs, avgs + WIDTH, avgs + 2 * WIDTH, WIDTH - curve % 3,
+                       (curve % 2) ? stacks[0] : 0, &stack_max[0], &summaries[0]);
+      rrd_summarize (avgs, avgs + WIDTH, avgs + 2 * WIDTH, WIDTH - curve % 3,
+                     (curve % 2) ? stacks[1] : 0, &stack_max[1], &summaries[1]);
+
+      if (summaries[0].avg_sum != summaries[1].avg_sum
+          || summaries[0].avg_count != summaries[1].avg_count
+          || memcmp (&summaries[0].avg_min, &summaries[1].avg_min, sizeof (double))
+          || memcmp (&summaries[0].avg_max, &summaries[1].avg_max, sizeof (double))
+          || memcmp (&summaries[0].min, &summaries[1].min, sizeof (double))
+          || memcmp (&summaries[0].max, &summaries[1].max, sizeof (double))
+          || summaries[0].known != summaries[1].known
+          || memcmp (&stack_max[0], &stack_max[1], sizeof (double))
+          || memcmp (stacks[0], stacks[1], sizeof (double) * WIDTH))
+        errx (EXIT_FAILURE, "Summaries of curve %zu differ", curve);
+    }
+
+  printf ("%zu curves of %u samples\n\n", curve_count, WIDTH);
+  printf ("%8s %10s %10s %8s\n", "method", "seconds", "Msamples/s", "speedup");
+
+  for (method = 0; method < 2; ++method)
+    {
+      for (round = 0; round < 5; ++round)
+        {
+          struct rrd_summary summary;
+          double elapsed;
+
+          memset (stacks[0], 0, sizeof (double) * WIDTH);
+          stack_max[0] = 0;
+
+          gettimeofday (&start, 0);
+
+          for (curve = 0; curve < curve_count; ++curve)
+            {
+              const double* avgs = columns + curve * 3 * WIDTH;
+
+              if (method)
+                rrd_summarize (avgs, avgs + WIDTH, avgs + 2 * WIDTH, WIDTH,
+                               (curve % 2) ? stacks[0] : 0, &stack_max[0], &summary);
+              else
+                summarize_plain (avgs, avgs + WIDTH, avgs + 2 * WIDTH, WIDTH,
+                                 (curve % 2) ? stacks[0] : 0, &stack_max[0], &summary);
+            }
+
+          gettimeofday (&end, 0);
+
+          elapsed = end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) * 1.0e-6;
+
+          if (!round || elapsed < best[method])
+            best[method] = elapsed;
+        }
+
+      printf ("%8s %10.3f %10.1f %7.2fx\n", method ? "fused" : "plain", best[method],
+              curve_count * WIDTH / best[method] * 1.0e-6, best[0] / best[method]);
+    }
+
+  free (stacks[1]);
+  free (stacks[0]);
+  free (columns);
+
+  return EXIT_SUCCESS;
+}
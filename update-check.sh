@@ -0,0 +1,84 @@
+#!/bin/sh
+#  Applies updates to a fixture RRD with munin-hardcore-update, and
+#  compares the result with that of rrdtool 1.4, byte for byte: either
+#  testdata/update-rrdtool.rrd, written by `rrdtool update' from
+#  testdata/update.rrd with the FIRST and SECOND batches below, or, if
+#  that is absent, the output of an installed rrdtool.  With neither,
+#  nothing confirms the result and the test is skipped.
+#
+#  testdata/update-native.rrd is what munin-hardcore-update itself wrote
+#  from the same batches.  It only guards against unintended changes in
+#  the output; it is not evidence of agreement with rrdtool.
+#
+#  testdata/update.rrd has four data sources, one of each type, and five
+#  archives of all consolidation functions, laid out as `rrdtool create'
+#  would have written it; it was not itself written by rrdtool.
+
+srcdir=${srcdir:-.}
+work=update-check.$$
+
+trap 'rm -f $work.rrd $work-rrdtool.rrd' 0
+
+# Within and across steps, a reading above the maximum, unknown readings,
+# a gap longer than the heartbeat, a counter wrap and a fractional time
+FIRST="1262304000:10:1000:5:0 1262304300:20:4000:8:30
+1262304630:30:7000:7:60 1262304900:U:10000:9:U
+1262305500:150:13000:10:90 1262306700:40:16000:11:120
+1262307000:50:1000:11:150 1262307150:55:2000:12:10
+1262307600:60:3000:13:20"
+
+SECOND="1262307900:70:4000:14:30 1262308500:65:5000:15:40
+1262309100:60:6000:16:50 1262309400.5:58:6500:17:55
+1262309700:57:7100:18:60 1262310000:56:7700:17:65
+1262310300:55:8300:16:70 1262310600:54:8900:15:75"
+
+cp "$srcdir/testdata/update.rrd" $work.rrd || exit 1
+
+# One batch from the command line, and one from standard input
+./munin-hardcore-update $work.rrd $FIRST || exit 1
+echo $work.rrd $SECOND | ./munin-hardcore-update || exit 1
+
+if ! cmp $work.rrd "$srcdir/testdata/update-native.rrd"
+then
+  echo "munin-hardcore-update: result differs from testdata/update-native.rrd" >&2
+  exit 1
+fi
+
+# An update that is not newer than the last must leave the file unchanged
+if ./munin-hardcore-update $work.rrd 1262310900:1:1:1:1 1262310600:1:1:1:1 2>/dev/null
+then
+  echo "munin-hardcore-update: accepted an update older than the last" >&2
+  exit 1
+fi
+
+if ! cmp $work.rrd "$srcdir/testdata/update-native.rrd"
+then
+  echo "munin-hardcore-update: a failed batch changed the file" >&2
+  exit 1
+fi
+
+if test -f "$srcdir/testdata/update-rrdtool.rrd"
+then
+  if ! cmp $work.rrd "$srcdir/testdata/update-rrdtool.rrd"
+  then
+    echo "munin-hardcore-update: result differs from testdata/update-rrdtool.rrd" >&2
+    exit 1
+  fi
+elif command -v rrdtool >/dev/null
+then
+  cp "$srcdir/testdata/update.rrd" $work-rrdtool.rrd || exit 1
+
+  rrdtool update $work-rrdtool.rrd $FIRST || exit 1
+  rrdtool update $work-rrdtool.rrd $SECOND || exit 1
+
+  if ! cmp $work.rrd $work-rrdtool.rrd
+  then
+    echo "munin-hardcore-update: result differs from that of rrdtool" >&2
+    exit 1
+  fi
+else
+  echo "update-check: no rrdtool output to compare with; skipped" >&2
+  exit 77
+fi
+
+exit 0
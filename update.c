@@ -0,0 +1,1073 @@
+/*  Native RRD updates, consolidating the way rrdtool 1.4 does.
+    Copyright (C) 2009  Morten Hustveit <morten@rashbox.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "rrd.h"
+#include "update.h"
+
+/* All updates of a batch are applied to a copy of the file's head, which
+   holds everything but the value list, and the rows they complete are
+   collected in memory.  The rows a batch writes to an archive follow
+   each other around its ring, so they are written back with at most two
+   writes per archive, followed by the head.  The file is write locked
+   throughout, and nothing is written unless every update succeeds.
+
+   The arithmetic follows rrd_update.c of rrdtool 1.4 step by step,
+   including its integer conversions, so that the bytes written are the
+   same as rrdtool would write.  Aberrant behavior RRAs and COMPUTE data
+   sources are not supported.  */
+
+/* Length of the last_ds field of struct pdp_prepare */
+#define LAST_DS_LEN 30
+
+/* Indices into the parameter and scratch arrays, as named by rrdtool */
+#define DS_mrhb_cnt 0
+#define DS_min_val 1
+#define DS_max_val 2
+#define RRA_cdp_xff_val 0
+#define PDP_unkn_sec_cnt 0
+#define PDP_val 1
+#define CDP_val 0
+#define CDP_unkn_pdp_cnt 1
+#define CDP_primary_val 8
+#define CDP_secondary_val 9
+
+enum ds_type
+{
+  ds_gauge, ds_counter, ds_derive, ds_absolute
+};
+
+struct update_archive
+{
+  enum cf_type cf;
+
+  /* Of the archive's first row */
+  off_t offset;
+
+  /* Rows completed by the current update */
+  unsigned long step_count;
+
+  /* The ROW_COUNT rows written by the batch, starting at FIRST_ROW */
+  unsigned long first_row, row_count;
+  double* rows;
+  size_t row_alloc;
+};
+
+struct update_file
+{
+  const char* filename;
+  int fd;
+  int version;
+
+  unsigned char* head;
+  size_t head_size;
+
+  struct rrd_header* header;
+  struct ds_def* ds_defs;
+  struct rra_def* rra_defs;
+  void* live_header;
+  struct pdp_prepare* pdp_preps;
+  struct cdp_prepare* cdp_preps;
+  unsigned long* rra_ptrs;
+
+  time_t last_up;
+  long last_up_usec;
+
+  enum ds_type* ds_types;
+  struct update_archive* archives;
+
+  double* pdp_new;
+  double* pdp_temp;
+};
+
+static int
+read_fully (int fd, void* buffer, size_t size, off_t offset)
+{
+  ssize_t ret;
+
+  while (size)
+    {
+      if (-1 == (ret = pread (fd, buffer, size, offset)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          return -1;
+        }
+
+      if (!ret)
+        {
+          errno = EINVAL;
+
+          return -1;
+        }
+
+      buffer = (char*) buffer + ret;
+      size -= ret;
+      offset += ret;
+    }
+
+  return 0;
+}
+
+static int
+write_fully (int fd, const void* buffer, size_t size, off_t offset)
+{
+  ssize_t ret;
+
+  while (size)
+    {
+      if (-1 == (ret = pwrite (fd, buffer, size, offset)))
+        {
+          if (errno == EINTR)
+            continue;
+
+          return -1;
+        }
+
+      buffer = (const char*) buffer + ret;
+      size -= ret;
+      offset += ret;
+    }
+
+  return 0;
+}
+
+/* Reads the head of an opened and locked file */
+static int
+read_head (struct update_file* f)
+{
+  struct rrd_header header;
+  struct stat st;
+  size_t i, live_header_size, value_count = 0;
+  unsigned char* input;
+
+  if (-1 == fstat (f->fd, &st))
+    {
+      fprintf (stderr, "Failed to stat '%s': %s\n", f->filename, strerror (errno));
+
+      return -1;
+    }
+
+  if (-1 == read_fully (f->fd, &header, sizeof (header), 0))
+    {
+      fprintf (stderr, "Failed to read header of '%s': %s\n", f->filename, strerror (errno));
+
+      return -1;
+    }
+
+  if (memcmp ("RRD", header.cookie, 4) || header.float_cookie != 8.642135E130)
+    {
+      fprintf (stderr, "'%s' is not an RRD file for this architecture\n", f->filename);
+
+      return -1;
+    }
+
+  f->version = atoi (header.version);
+
+  if (f->version < 1 || f->version > 3)
+    {
+      fprintf (stderr, "Unsupported RRD version %d in '%s'\n", f->version, f->filename);
+
+      return -1;
+    }
+
+  if (!header.ds_count || !header.rra_count || !header.pdp_step
+      || header.ds_count > 0xffff || header.rra_count > 0xffff)
+    {
+      fprintf (stderr, "Corrupt header in '%s'\n", f->filename);
+
+      return -1;
+    }
+
+  live_header_size = (f->version >= 3) ? sizeof (struct live_header) : sizeof (time_t);
+
+  f->head_size = sizeof (header)
+    + header.ds_count * sizeof (struct ds_def)
+    + header.rra_count * sizeof (struct rra_def)
+    + live_header_size
+    + header.ds_count * sizeof (struct pdp_prepare)
+    + header.ds_count * header.rra_count * sizeof (struct cdp_prepare)
+    + header.rra_count * sizeof (unsigned long);
+
+  if (f->head_size > (size_t) st.st_size)
+    {
+      fprintf (stderr, "Unexpected end-of-file in '%s'\n", f->filename);
+
+      return -1;
+    }
+
+  if (!(f->head = malloc (f->head_size)))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  if (-1 == read_fully (f->fd, f->head, f->head_size, 0))
+    {
+      fprintf (stderr, "Failed to read '%s': %s\n", f->filename, strerror (errno));
+
+      return -1;
+    }
+
+  input = f->head;
+  f->header = (struct rrd_header*) input;
+  input += sizeof (header);
+  f->ds_defs = (struct ds_def*) input;
+  input += header.ds_count * sizeof (struct ds_def);
+  f->rra_defs = (struct rra_def*) input;
+  input += header.rra_count * sizeof (struct rra_def);
+  f->live_header = input;
+  input += live_header_size;
+  f->pdp_preps = (struct pdp_prepare*) input;
+  input += header.ds_count * sizeof (struct pdp_prepare);
+  f->cdp_preps = (struct cdp_prepare*) input;
+  input += header.ds_count * header.rra_count * sizeof (struct cdp_prepare);
+  f->rra_ptrs = (unsigned long*) input;
+
+  if (f->version >= 3)
+    {
+      struct live_header live_header;
+
+      memcpy (&live_header, f->live_header, sizeof (live_header));
+      f->last_up = live_header.last_up;
+      f->last_up_usec = live_header.last_up_usec;
+    }
+  else
+    {
+      memcpy (&f->last_up, f->live_header, sizeof (time_t));
+      f->last_up_usec = 0;
+    }
+
+  if (!(f->ds_types = calloc (header.ds_count, sizeof (*f->ds_types)))
+      || !(f->pdp_new = calloc (header.ds_count, sizeof (*f->pdp_new)))
+      || !(f->pdp_temp = calloc (header.ds_count, sizeof (*f->pdp_temp)))
+      || !(f->archives = calloc (header.rra_count, sizeof (*f->archives))))
+    errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+
+  for (i = 0; i < header.ds_count; ++i)
+    {
+      const char* dst = f->ds_defs[i].dst;
+
+      if (f->ds_defs[i].ds_name[19] || dst[19])
+        {
+          fprintf (stderr, "Missing NUL-termination in data source definition strings in '%s'\n", f->filename);
+
+          return -1;
+        }
+
+      if (!strcmp (dst, "GAUGE"))
+        f->ds_types[i] = ds_gauge;
+      else if (!strcmp (dst, "COUNTER"))
+        f->ds_types[i] = ds_counter;
+      else if (!strcmp (dst, "DERIVE"))
+        f->ds_types[i] = ds_derive;
+      else if (!strcmp (dst, "ABSOLUTE"))
+        f->ds_types[i] = ds_absolute;
+      else
+        {
+          fprintf (stderr, "Unsupported data source type '%s' in '%s'\n", dst, f->filename);
+
+          return -1;
+        }
+    }
+
+  for (i = 0; i < header.rra_count; ++i)
+    {
+      const struct rra_def* rra = &f->rra_defs[i];
+
+      if (rra->cf_name[19] || cf_unknown == (f->archives[i].cf = rrd_cf_type (rra->cf_name)))
+        {
+          fprintf (stderr, "Unsupported consolidation function in '%s'\n", f->filename);
+
+          return -1;
+        }
+
+      if (!rra->row_count || !rra->pdp_count || f->rra_ptrs[i] >= rra->row_count)
+        {
+          fprintf (stderr, "Corrupt RRA definition in '%s'\n", f->filename);
+
+          return -1;
+        }
+
+      f->archives[i].offset = f->head_size + value_count * sizeof (double);
+      value_count += rra->row_count * header.ds_count;
+    }
+
+  if (f->head_size + value_count * sizeof (double) > (size_t) st.st_size)
+    {
+      fprintf (stderr, "Unexpected end-of-file in value list of '%s'\n", f->filename);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+/* rrd_diff() of rrdtool: subtracts the integer B from the integer A,
+   digit by digit, so that counters wider than a double are exact */
+static double
+update_diff (const char* a_string, const char* b_string)
+{
+  char a[LAST_DS_LEN + 1], b[LAST_DS_LEN + 1], res[LAST_DS_LEN + 3];
+  int a_neg = 0, b_neg = 0, c, x, m, a_len, b_len, ai, bi, ri;
+  double result;
+
+  while (*a_string && !isdigit ((unsigned char) *a_string))
+    {
+      if (*a_string == '-')
+        a_neg = 1;
+
+      ++a_string;
+    }
+
+  while (*b_string && !isdigit ((unsigned char) *b_string))
+    {
+      if (*b_string == '-')
+        b_neg = 1;
+
+      ++b_string;
+    }
+
+  for (a_len = 0; isdigit ((unsigned char) a_string[a_len]) && a_len < LAST_DS_LEN; ++a_len)
+    a[a_len] = a_string[a_len];
+
+  for (b_len = 0; isdigit ((unsigned char) b_string[b_len]) && b_len < LAST_DS_LEN; ++b_len)
+    b[b_len] = b_string[b_len];
+
+  if (!a_len || !b_len)
+    return NAN;
+
+  /* Numbers with different signs are not handled */
+  if (a_neg + b_neg == 1)
+    return NAN;
+
+  m = (a_len > b_len) ? a_len : b_len;
+
+  for (x = 0; x <= m + 1; ++x)
+    res[x] = ' ';
+
+  res[m + 2] = 0;
+
+  c = 0;
+  ai = a_len - 1;
+  bi = b_len - 1;
+  ri = m + 1;
+
+  for (x = 0; x < m; ++x, --ai, --bi, --ri)
+    {
+      if (ai >= 0 && bi >= 0)
+        res[ri] = ((a[ai] - c) - b[bi]) + '0';
+      else if (ai >= 0)
+        res[ri] = a[ai] - c;
+      else
+        res[ri] = ('0' - b[bi] - c) + '0';
+
+      if (res[ri] < '0')
+        {
+          res[ri] += 10;
+          c = 1;
+        }
+      else if (res[ri] > '9')
+        {
+          res[ri] -= 10;
+          c = 1;
+        }
+      else
+        c = 0;
+    }
+
+  if (c)
+    {
+      ri = m + 1;
+
+      for (x = 0; isdigit ((unsigned char) res[ri]) && x < m; ++x, --ri)
+        {
+          res[ri] = ('9' - res[ri] + c) + '0';
+
+          if (res[ri] > '9')
+            {
+              res[ri] -= 10;
+              c = 1;
+            }
+          else
+            c = 0;
+        }
+
+      result = -atof (res);
+    }
+  else
+    result = atof (res);
+
+  if (a_neg + b_neg == 2)
+    result = -result;
+
+  return result;
+}
+
+/* Computes the new PDP contribution of every data source from the
+   readings in VALUES; see update_pdp_prep() in rrdtool */
+static int
+update_pdp_prep (struct update_file* f, char** values, double interval)
+{
+  size_t i;
+
+  for (i = 0; i < f->header->ds_count; ++i)
+    {
+      struct pdp_prepare* pdp = &f->pdp_preps[i];
+      const struct ds_def* ds = &f->ds_defs[i];
+      const char* value = values[i];
+      unsigned long mrhb = ds->par[DS_mrhb_cnt].u_count;
+      double rate = NAN;
+      char* endptr;
+
+      /* Do not build differences from stale readings */
+      if (mrhb < interval)
+        {
+          strncpy (pdp->last_ds, "U", LAST_DS_LEN - 1);
+          pdp->last_ds[LAST_DS_LEN - 1] = 0;
+        }
+
+      if (value[0] != 'U' && mrhb >= interval)
+        {
+          switch (f->ds_types[i])
+            {
+            case ds_counter:
+            case ds_derive:
+
+                {
+                  size_t j;
+
+                  for (j = 0; value[j]; ++j)
+                    {
+                      if (!j && f->ds_types[i] == ds_derive && value[j] == '-')
+                        continue;
+
+                      if (value[j] < '0' || value[j] > '9')
+                        {
+                          fprintf (stderr, "Not a simple %s integer in '%s': '%s'\n",
+                                   ds->dst, f->filename, value);
+
+                          return -1;
+                        }
+                    }
+                }
+
+              if (pdp->last_ds[0] != 'U')
+                {
+                  f->pdp_new[i] = update_diff (value, pdp->last_ds);
+
+                  if (f->ds_types[i] == ds_counter)
+                    {
+                      /* Assume 32 bit, and then 64 bit, counter wraps */
+                      if (f->pdp_new[i] < 0.0)
+                        f->pdp_new[i] += 4294967296.0;
+
+                      if (f->pdp_new[i] < 0.0)
+                        f->pdp_new[i] += 18446744069414584320.0;
+                    }
+
+                  rate = f->pdp_new[i] / interval;
+                }
+              else
+                f->pdp_new[i] = NAN;
+
+              break;
+
+            case ds_absolute:
+            case ds_gauge:
+
+              errno = 0;
+              f->pdp_new[i] = strtod (value, &endptr);
+
+              if (errno || *endptr)
+                {
+                  fprintf (stderr, "Invalid reading '%s' for '%s'\n", value, f->filename);
+
+                  return -1;
+                }
+
+              if (f->ds_types[i] == ds_gauge)
+                f->pdp_new[i] *= interval;
+
+              rate = f->pdp_new[i] / interval;
+
+              break;
+            }
+
+          /* Readings out of range become unknown */
+          if (!isnan (rate)
+              && ((!isnan (ds->par[DS_max_val].u_val) && rate > ds->par[DS_max_val].u_val)
+                  || (!isnan (ds->par[DS_min_val].u_val) && rate < ds->par[DS_min_val].u_val)))
+            f->pdp_new[i] = NAN;
+        }
+      else
+        f->pdp_new[i] = NAN;
+
+      strncpy (pdp->last_ds, value, LAST_DS_LEN - 1);
+      pdp->last_ds[LAST_DS_LEN - 1] = 0;
+    }
+
+  return 0;
+}
+
+/* Adds the readings to the PDPs in progress, when no PDP is completed */
+static void
+simple_update (struct update_file* f, double interval)
+{
+  size_t i;
+
+  for (i = 0; i < f->header->ds_count; ++i)
+    {
+      union unival* scratch = f->pdp_preps[i].scratch;
+
+      if (isnan (f->pdp_new[i]))
+        scratch[PDP_unkn_sec_cnt].u_count += floor (interval);
+      else if (isnan (scratch[PDP_val].u_val))
+        scratch[PDP_val].u_val = f->pdp_new[i];
+      else
+        scratch[PDP_val].u_val += f->pdp_new[i];
+    }
+}
+
+/* Completes the PDP of data source I, storing it in pdp_temp */
+static void
+process_pdp_st (struct update_file* f, size_t i, double interval,
+                double pre_int, double post_int, long diff_pdp_st)
+{
+  union unival* scratch = f->pdp_preps[i].scratch;
+  unsigned long mrhb = f->ds_defs[i].par[DS_mrhb_cnt].u_count;
+  double pre_unknown = 0.0;
+
+  if (isnan (f->pdp_new[i]))
+    pre_unknown = pre_int;
+  else
+    {
+      if (isnan (scratch[PDP_val].u_val))
+        scratch[PDP_val].u_val = 0;
+
+      scratch[PDP_val].u_val += f->pdp_new[i] / interval * pre_int;
+    }
+
+  /* Too much of the PDP is unknown */
+  if (interval > mrhb
+      || f->header->pdp_step / 2.0 < (int) scratch[PDP_unkn_sec_cnt].u_count)
+    f->pdp_temp[i] = NAN;
+  else
+    f->pdp_temp[i] = scratch[PDP_val].u_val
+      / ((double) (diff_pdp_st - scratch[PDP_unkn_sec_cnt].u_count) - pre_unknown);
+
+  if (isnan (f->pdp_new[i]))
+    {
+      scratch[PDP_unkn_sec_cnt].u_count = floor (post_int);
+      scratch[PDP_val].u_val = NAN;
+    }
+  else
+    {
+      scratch[PDP_unkn_sec_cnt].u_count = 0;
+      scratch[PDP_val].u_val = f->pdp_new[i] / interval * post_int;
+    }
+}
+
+static double
+initialize_carry_over (double pdp_temp, enum cf_type cf, unsigned long elapsed_pdp_st,
+                       unsigned long start_pdp_offset, unsigned long pdp_cnt)
+{
+  unsigned long pdp_into_cdp_cnt = (elapsed_pdp_st - start_pdp_offset) % pdp_cnt;
+
+  if (!pdp_into_cdp_cnt || isnan (pdp_temp))
+    {
+      switch (cf)
+        {
+        case cf_maximum: return -INFINITY;
+        case cf_minimum: return INFINITY;
+        case cf_average: return 0;
+        default: return NAN;
+        }
+    }
+
+  if (cf == cf_average)
+    return pdp_temp * pdp_into_cdp_cnt;
+
+  return pdp_temp;
+}
+
+static void
+initialize_cdp_val (union unival* scratch, enum cf_type cf, double pdp_temp,
+                    unsigned long start_pdp_offset, unsigned long pdp_cnt)
+{
+  double cum_val, cur_val;
+
+  switch (cf)
+    {
+    case cf_average:
+
+      cum_val = isnan (scratch[CDP_val].u_val) ? 0.0 : scratch[CDP_val].u_val;
+      cur_val = isnan (pdp_temp) ? 0.0 : pdp_temp;
+      scratch[CDP_primary_val].u_val = (cum_val + cur_val * start_pdp_offset)
+        / (pdp_cnt - scratch[CDP_unkn_pdp_cnt].u_count);
+
+      break;
+
+    case cf_maximum:
+
+      cum_val = isnan (scratch[CDP_val].u_val) ? -INFINITY : scratch[CDP_val].u_val;
+      cur_val = isnan (pdp_temp) ? -INFINITY : pdp_temp;
+      scratch[CDP_primary_val].u_val = (cur_val > cum_val) ? cur_val : cum_val;
+
+      break;
+
+    case cf_minimum:
+
+      cum_val = isnan (scratch[CDP_val].u_val) ? INFINITY : scratch[CDP_val].u_val;
+      cur_val = isnan (pdp_temp) ? INFINITY : pdp_temp;
+      scratch[CDP_primary_val].u_val = (cur_val < cum_val) ? cur_val : cum_val;
+
+      break;
+
+    default:
+
+      scratch[CDP_primary_val].u_val = pdp_temp;
+    }
+}
+
+static double
+calculate_cdp_val (double cdp_val, double pdp_temp, unsigned long elapsed_pdp_st,
+                   enum cf_type cf)
+{
+  if (isnan (cdp_val))
+    {
+      if (cf == cf_average)
+        pdp_temp *= elapsed_pdp_st;
+
+      return pdp_temp;
+    }
+
+  switch (cf)
+    {
+    case cf_average: return cdp_val + pdp_temp * elapsed_pdp_st;
+    case cf_minimum: return (pdp_temp < cdp_val) ? pdp_temp : cdp_val;
+    case cf_maximum: return (pdp_temp > cdp_val) ? pdp_temp : cdp_val;
+    default: return pdp_temp;
+    }
+}
+
+/* Consolidates the completed PDPs into the CDP of every RRA, and counts
+   the rows each RRA completes */
+static void
+update_all_cdp_prep (struct update_file* f, unsigned long elapsed_pdp_st,
+                     unsigned long proc_pdp_cnt)
+{
+  size_t rra, i;
+  unsigned long ds_count = f->header->ds_count;
+
+  for (rra = 0; rra < f->header->rra_count; ++rra)
+    {
+      unsigned long pdp_cnt = f->rra_defs[rra].pdp_count;
+      unsigned long start_pdp_offset = pdp_cnt - proc_pdp_cnt % pdp_cnt;
+      struct update_archive* a = &f->archives[rra];
+      enum cf_type cf = a->cf;
+
+      if (start_pdp_offset <= elapsed_pdp_st)
+        a->step_count = (elapsed_pdp_st - start_pdp_offset) / pdp_cnt + 1;
+      else
+        a->step_count = 0;
+
+      for (i = 0; i < ds_count; ++i)
+        {
+          union unival* scratch = f->cdp_preps[rra * ds_count + i].scratch;
+          double pdp_temp = f->pdp_temp[i];
+
+          if (pdp_cnt == 1)
+            {
+              /* Nothing to consolidate, but the values written in place
+                 of skipped rows must be kept up to date */
+              scratch[CDP_primary_val].u_val = pdp_temp;
+
+              if (elapsed_pdp_st >= 2)
+                scratch[CDP_secondary_val].u_val = pdp_temp;
+
+              continue;
+            }
+
+          if (a->step_count)
+            {
+              /* The first row written is the primary value, and any
+                 further rows, for which there were no readings, get the
+                 secondary value */
+              if (isnan (pdp_temp))
+                {
+                  scratch[CDP_unkn_pdp_cnt].u_count += start_pdp_offset;
+                  scratch[CDP_secondary_val].u_val = NAN;
+                }
+              else
+                scratch[CDP_secondary_val].u_val = pdp_temp;
+
+              if (scratch[CDP_unkn_pdp_cnt].u_count > pdp_cnt * f->rra_defs[rra].par[RRA_cdp_xff_val].u_val)
+                scratch[CDP_primary_val].u_val = NAN;
+              else
+                initialize_cdp_val (scratch, cf, pdp_temp, start_pdp_offset, pdp_cnt);
+
+              scratch[CDP_val].u_val = initialize_carry_over (pdp_temp, cf, elapsed_pdp_st,
+                                                              start_pdp_offset, pdp_cnt);
+
+              if (isnan (pdp_temp))
+                scratch[CDP_unkn_pdp_cnt].u_count = (elapsed_pdp_st - start_pdp_offset) % pdp_cnt;
+              else
+                scratch[CDP_unkn_pdp_cnt].u_count = 0;
+            }
+          else
+            {
+              if (isnan (pdp_temp))
+                scratch[CDP_unkn_pdp_cnt].u_count += elapsed_pdp_st;
+              else
+                scratch[CDP_val].u_val = calculate_cdp_val (scratch[CDP_val].u_val, pdp_temp,
+                                                            elapsed_pdp_st, cf);
+            }
+        }
+    }
+}
+
+/* Stores the row at the pointer of RRA, taken from the CDP scratch value
+   INDEX, for writing at the end of the batch */
+static void
+store_row (struct update_file* f, size_t rra, size_t index)
+{
+  struct update_archive* a = &f->archives[rra];
+  unsigned long row_count = f->rra_defs[rra].row_count;
+  size_t i, position, ds_count = f->header->ds_count;
+  double* row;
+
+  if (!a->row_count)
+    a->first_row = f->rra_ptrs[rra];
+
+  position = (f->rra_ptrs[rra] + row_count - a->first_row) % row_count;
+
+  if (position == a->row_count)
+    {
+      if (a->row_count == a->row_alloc)
+        {
+          a->row_alloc = a->row_alloc * 3 / 2 + 16;
+
+          if (a->row_alloc > row_count)
+            a->row_alloc = row_count;
+
+          if (!(a->rows = realloc (a->rows, sizeof (*a->rows) * ds_count * a->row_alloc)))
+            errx (EXIT_FAILURE, "Memory allocation failed: %s", strerror (errno));
+        }
+
+      ++a->row_count;
+    }
+
+  row = a->rows + position * ds_count;
+
+  for (i = 0; i < ds_count; ++i)
+    row[i] = f->cdp_preps[rra * ds_count + i].scratch[index].u_val;
+}
+
+/* Advances the RRA pointers past the rows completed by an update */
+static void
+write_to_rras (struct update_file* f)
+{
+  size_t rra;
+
+  for (rra = 0; rra < f->header->rra_count; ++rra)
+    {
+      unsigned long row_count = f->rra_defs[rra].row_count;
+      unsigned long steps = f->archives[rra].step_count;
+      size_t index = CDP_primary_val;
+
+      /* Rows that would be overwritten within this update are skipped */
+      if (steps > row_count)
+        {
+          f->rra_ptrs[rra] = (f->rra_ptrs[rra] + steps - row_count) % row_count;
+          steps = row_count;
+          index = CDP_secondary_val;
+        }
+
+      for (; steps; --steps, index = CDP_secondary_val)
+        {
+          if (++f->rra_ptrs[rra] >= row_count)
+            f->rra_ptrs[rra] = 0;
+
+          store_row (f, rra, index);
+        }
+    }
+}
+
+/* Applies one update in rrdtool's "TIME:VALUE[:VALUE]..." form */
+static int
+apply_update (struct update_file* f, const char* update)
+{
+  char buffer[1024];
+  char** values;
+  char* time_string;
+  char* endptr;
+  size_t i, value_count = 0;
+  time_t current_time;
+  long current_time_usec;
+  double interval, pre_int, post_int;
+  unsigned long pdp_step, proc_pdp_st, occu_pdp_age, occu_pdp_st;
+  unsigned long elapsed_pdp_st;
+
+  if (strlen (update) >= sizeof (buffer))
+    {
+      fprintf (stderr, "Update too long for '%s'\n", f->filename);
+
+      return -1;
+    }
+
+  strcpy (buffer, update);
+
+  values = alloca (sizeof (*values) * (f->header->ds_count + 1));
+  time_string = buffer;
+
+  for (endptr = buffer; (endptr = strchr (endptr, ':')); )
+    {
+      *endptr++ = 0;
+
+      if (value_count == f->header->ds_count)
+        {
+          ++value_count;
+
+          break;
+        }
+
+      values[value_count++] = endptr;
+    }
+
+  if (value_count != f->header->ds_count)
+    {
+      fprintf (stderr, "Expected %lu data source readings in '%s' for '%s'\n",
+               f->header->ds_count, update, f->filename);
+
+      return -1;
+    }
+
+  if (!strcmp (time_string, "N"))
+    {
+      struct timeval now;
+
+      gettimeofday (&now, 0);
+      current_time = now.tv_sec;
+      current_time_usec = now.tv_usec;
+    }
+  else
+    {
+      double t;
+
+      t = strtod (time_string, &endptr);
+
+      if (*endptr || t < 0.0)
+        {
+          fprintf (stderr, "Invalid time '%s' for '%s'\n", time_string, f->filename);
+
+          return -1;
+        }
+
+      current_time = floor (t);
+      current_time_usec = (long) ((t - (double) current_time) * 1e6f);
+    }
+
+  if (f->version < 3)
+    current_time_usec = 0;
+
+  if (current_time < f->last_up
+      || (current_time == f->last_up && current_time_usec <= f->last_up_usec))
+    {
+      fprintf (stderr, "Illegal attempt to update '%s' using time %ld when last update time is %ld (minimum one second step)\n",
+               f->filename, (long) current_time, (long) f->last_up);
+
+      return -1;
+    }
+
+  interval = (double) (current_time - f->last_up)
+    + (double) (current_time_usec - f->last_up_usec) / 1e6f;
+
+  if (-1 == update_pdp_prep (f, values, interval))
+    return -1;
+
+  pdp_step = f->header->pdp_step;
+  proc_pdp_st = f->last_up - f->last_up % pdp_step;
+  occu_pdp_age = current_time % pdp_step;
+  occu_pdp_st = current_time - occu_pdp_age;
+
+  if (occu_pdp_st > proc_pdp_st)
+    {
+      pre_int = (long) occu_pdp_st - f->last_up;
+      pre_int -= (double) f->last_up_usec / 1e6f;
+      post_int = occu_pdp_age;
+      post_int += (double) current_time_usec / 1e6f;
+    }
+  else
+    {
+      pre_int = interval;
+      post_int = 0;
+    }
+
+  elapsed_pdp_st = (occu_pdp_st - proc_pdp_st) / pdp_step;
+
+  if (!elapsed_pdp_st)
+    simple_update (f, interval);
+  else
+    {
+      for (i = 0; i < f->header->ds_count; ++i)
+        process_pdp_st (f, i, interval, pre_int, post_int, elapsed_pdp_st * pdp_step);
+
+      update_all_cdp_prep (f, elapsed_pdp_st, proc_pdp_st / pdp_step);
+      write_to_rras (f);
+    }
+
+  f->last_up = current_time;
+  f->last_up_usec = current_time_usec;
+
+  return 0;
+}
+
+/* Writes the collected rows, and then the live part of the head */
+static int
+write_changes (struct update_file* f)
+{
+  size_t rra, ds_count = f->header->ds_count;
+  unsigned char* live_start;
+
+  for (rra = 0; rra < f->header->rra_count; ++rra)
+    {
+      const struct update_archive* a = &f->archives[rra];
+      size_t count;
+
+      if (!a->row_count)
+        continue;
+
+      count = f->rra_defs[rra].row_count - a->first_row;
+
+      if (count > a->row_count)
+        count = a->row_count;
+
+      if (-1 == write_fully (f->fd, a->rows, count * ds_count * sizeof (double),
+                             a->offset + (off_t) a->first_row * ds_count * sizeof (double)))
+        goto fail;
+
+      if (count < a->row_count
+          && -1 == write_fully (f->fd, a->rows + count * ds_count,
+                                (a->row_count - count) * ds_count * sizeof (double),
+                                a->offset))
+        goto fail;
+    }
+
+  if (f->version >= 3)
+    {
+      struct live_header live_header;
+
+      memcpy (&live_header, f->live_header, sizeof (live_header));
+      live_header.last_up = f->last_up;
+      live_header.last_up_usec = f->last_up_usec;
+      memcpy (f->live_header, &live_header, sizeof (live_header));
+    }
+  else
+    memcpy (f->live_header, &f->last_up, sizeof (time_t));
+
+  live_start = f->live_header;
+
+  if (-1 == write_fully (f->fd, live_start, f->head + f->head_size - live_start,
+                         live_start - f->head))
+    goto fail;
+
+  return 0;
+
+fail:
+
+  fprintf (stderr, "Failed to write to '%s': %s\n", f->filename, strerror (errno));
+
+  return -1;
+}
+
+/* Applies UPDATE_COUNT updates, each of the form "TIME:VALUE[:VALUE]..."
+   with TIME being seconds since the epoch or "N" for now, to the RRD
+   file FILENAME in one locked read-modify-write.  Returns 0 on success.
+   On failure, an error is printed, -1 is returned, and the file is left
+   unchanged.  */
+int
+rrd_update (const char* filename, const char* const* updates, size_t update_count)
+{
+  struct update_file f;
+  struct flock lock;
+  size_t i;
+  int result = -1;
+
+  memset (&f, 0, sizeof (f));
+  f.filename = filename;
+
+  if (-1 == (f.fd = open (filename, O_RDWR)))
+    {
+      fprintf (stderr, "Failed to open '%s' for writing: %s\n", filename, strerror (errno));
+
+      return -1;
+    }
+
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+
+  while (-1 == fcntl (f.fd, F_SETLKW, &lock))
+    {
+      if (errno != EINTR)
+        {
+          fprintf (stderr, "Failed to lock '%s': %s\n", filename, strerror (errno));
+
+          goto done;
+        }
+    }
+
+  if (-1 == read_head (&f))
+    goto done;
+
+  for (i = 0; i < update_count; ++i)
+    {
+      if (-1 == apply_update (&f, updates[i]))
+        goto done;
+    }
+
+  result = write_changes (&f);
+
+done:
+
+  /* Closing the file releases the lock */
+  close (f.fd);
+
+  if (f.archives)
+    {
+      for (i = 0; i < f.header->rra_count; ++i)
+        free (f.archives[i].rows);
+    }
+
+  free (f.head);
+  free (f.ds_types);
+  free (f.archives);
+  free (f.pdp_new);
+  free (f.pdp_temp);
+
+  return result;
+}
@@ -0,0 +1,9 @@
+#ifndef UPDATE_H_
+#define UPDATE_H_ 1
+
+#include <stdlib.h>
+
+int
+rrd_update (const char* filename, const char* const* updates, size_t update_count);
+
+#endif /* !UPDATE_H_ */